@@ -1,30 +1,12 @@
-QT       += core gui network serialport multimedia 3dcore
-
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
-
-CONFIG += c++11
-
-# You can make your code fail to compile if it uses deprecated APIs.
-# In order to do so, uncomment the following line.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-SOURCES += \
-    main.cpp \
-    mainwindow.cpp
-
-HEADERS += \
-    mainwindow.h
-
-FORMS += \
-    mainwindow.ui
-
-# Default rules for deployment.
-qnx: target.path = /tmp/$${TARGET}/bin
-else: unix:!android: target.path = /opt/$${TARGET}/bin
-!isEmpty(target.path): INSTALLS += target
-
-RESOURCES += \
-    icons.qrc
-
-DISTFILES += \
-    Images/MorseKeyIcon2.png
+TEMPLATE = subdirs
+
+# engine   - key, timing and transport core, a static library
+# client   - the Qt Widgets client
+# headless - command line client for boxes without a display
+SUBDIRS += \
+    engine \
+    client \
+    headless
+
+client.depends = engine
+headless.depends = engine
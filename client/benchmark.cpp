@@ -0,0 +1,1063 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QElapsedTimer>
+#include <QTextStream>
+#include <QAudioFormat>
+#include "benchmark.h"
+#include "tonegenerator.h"
+#include "tonedetector.h"
+#include "keyprotocol.h"
+#include "keyclock.h"
+#include "loopbackserver.h"
+#include "netimpairment.h"
+#include "udpkeystream.h"
+#include "keyengine.h"
+#include "textkeyer.h"
+#include "iambickeyer.h"
+#include "realtime.h"
+#include <QCoreApplication>
+#include <QTcpSocket>
+#include <QUdpSocket>
+#include <QFile>
+#include <QDir>
+#include <QThread>
+#include <QtMath>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#if defined(Q_OS_LINUX)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#endif
+
+#define BENCH_RUN_MS 1000
+#define BENCH_EDGES 400
+#define BENCH_EDGE_US 10000
+// Synthetic keying of the fidelity benchmark
+#define FIDELITY_TEXT "PARIS PARIS"
+// Largest difference between a sent edge and the time the server got
+#define FIDELITY_MATCH_US 1500
+// Keyed tone of the audio key benchmark, in fractions of full scale
+#define AUDIOKEY_LEVEL 0.5
+#define AUDIOKEY_NOISE 0.02
+#define AUDIOKEY_RAMP_US 5000
+#define AUDIOKEY_WPM 25
+// Largest difference between a keyed and a detected edge
+#define AUDIOKEY_MATCH_US 10000
+
+static void benchmarkTone(QTextStream &out)
+{
+    QAudioFormat format;
+    format.setSampleRate(44100);
+    format.setChannelCount(1);
+    format.setSampleSize(16);
+    format.setCodec("audio/pcm");
+    format.setByteOrder(QAudioFormat::LittleEndian);
+    format.setSampleType(QAudioFormat::SignedInt);
+    ToneGenerator tone(format);
+    tone.setFrequency(700);
+
+    out << "tone: period(bytes)  samples/s  ns/callback\n";
+    const int periods[] = { 64, 256, 1024, 4096 };
+    for (int period : periods) {
+        QByteArray buf(period, 0);
+        QElapsedTimer t;
+        quint64 n = 0;
+        tone.resetStatistics();
+        t.start();
+        while ( t.elapsed() < BENCH_RUN_MS ) {
+            // Toggle the key regularly so attack and release ramps are included
+            tone.setKeyed((n++ / 8) & 1);
+            tone.read(buf.data(), period);
+        }
+        qint64 busy = qMax(Q_INT64_C(1), tone.busyNs());
+        out << "tone: " << period
+            << "  " << quint64((tone.samplesGenerated() * 1000000000.0) / busy)
+            << "  " << (busy / qint64(tone.callbackCount())) << "\n";
+    }
+}
+
+class CountingHandler : public KeyMessageHandler
+{
+public:
+    void keyMessage(const KeyMessage &msg) override
+    {
+        count++;
+        sum += msg.type + msg.seq + msg.timeUs + msg.remoteUs;
+    }
+    quint64 count = 0;
+    quint64 sum = 0;
+};
+
+// Stream of binary frames, every textEvery:th message in the old text
+// format instead (0 for binary only)
+static QByteArray makeKeyStream(int messages, int textEvery)
+{
+    static const quint8 types[] = { KP_KEY_DOWN, KP_KEY_UP, KP_PING, KP_PONG };
+    QByteArray stream;
+    char frame[KP_MAX_FRAME];
+    for (int i=0; i<messages; i++) {
+        KeyMessage msg;
+        msg.type = types[i % 4];
+        msg.seq = quint16(i);
+        msg.text = false;
+        msg.timeUs = Q_UINT64_C(1600000000000000) + quint64(i) * 37013;
+        msg.remoteUs = msg.timeUs + 250000;
+        msg.version = 0;
+        if ( textEvery > 0 && (i % textEvery) == 0 ) {
+            QByteArray text("PP ");
+            text.append(QByteArray::number(msg.timeUs / 1000));
+            text.append(" ");
+            text.append(QByteArray::number(msg.remoteUs / 1000));
+            stream.append(text);
+        } else {
+            stream.append(frame, KeyProtocol::encode(frame, msg));
+        }
+    }
+    return stream;
+}
+
+static bool benchmarkParser(QTextStream &out)
+{
+    QByteArray stream = makeKeyStream(100000, 8);
+    KeyStreamParser parser;
+    CountingHandler handler;
+    QElapsedTimer t;
+    quint64 bytes = 0;
+    t.start();
+    while ( t.elapsed() < BENCH_RUN_MS ) {
+        // Read sizes as they come from a socket, one MSS at a time
+        for (int pos=0; pos<stream.size(); pos+=1460) {
+            int space;
+            char *p = parser.writePtr(&space);
+            int n = qMin(qMin(1460, stream.size() - pos), space);
+            memcpy(p, stream.constData() + pos, size_t(n));
+            parser.commit(n);
+            parser.parse(&handler);
+        }
+        bytes += quint64(stream.size());
+    }
+    qint64 ns = qMax(Q_INT64_C(1), t.nsecsElapsed());
+    out << "parser: " << quint64((bytes * 1000.0) / ns) << " MB/s  "
+        << quint64((handler.count * 1000000000.0) / ns) << " messages/s\n";
+
+    // A text message split inside its last number must wait for the rest
+    stream = makeKeyStream(20000, 8);
+    CountingHandler reference;
+    parser.reset();
+    parser.feed(stream.constData(), stream.size(), &reference);
+    parser.flush(&reference);
+    std::mt19937 rnd(4711);
+    bool ok = (reference.count == 20000);
+    for (int round=0; round<50 && ok; round++) {
+        // Chunks from single bytes to many coalesced frames
+        std::uniform_int_distribution<int> chunk(1, 1 + round * 40);
+        CountingHandler split;
+        parser.reset();
+        for (int pos=0; pos<stream.size(); ) {
+            int n = qMin(chunk(rnd), stream.size() - pos);
+            parser.feed(stream.constData() + pos, n, &split);
+            pos += n;
+        }
+        parser.flush(&split);
+        ok = (split.count == reference.count && split.sum == reference.sum);
+    }
+    out << "parser: split/coalesce check " << (ok ? "OK" : "FAILED") << "\n";
+    return ok;
+}
+
+// Lever positions from a time on, for the paddle keyer checks
+struct LeverStep {
+    qint64 atUs;
+    bool dit;
+    bool dah;
+};
+
+// Run the keyer over the lever script, polled every millisecond like the
+// key input thread, and return what it sent as "." and "-"
+static QString runPaddle(IambicKeyer &keyer, const QVector<LeverStep> &script, qint64 endUs,
+                         QVector<KeyerElement> *elements = nullptr)
+{
+    QString sent;
+    keyer.reset();
+    int step = 0;
+    bool dit = false, dah = false;
+    for (qint64 t=0; t<endUs; t+=1000) {
+        while ( step < script.size() && script[step].atUs <= t ) {
+            dit = script[step].dit;
+            dah = script[step].dah;
+            step++;
+        }
+        KeyerElement e;
+        if ( keyer.update(dit, dah, t, &e) ) {
+            sent += (e.upUs - e.downUs > 2 * keyer.unitUs()) ? "-" : ".";
+            if ( elements ) {
+                elements->append(e);
+            }
+        }
+    }
+    return sent;
+}
+
+// Scripted lever sequences through the iambic keyer and the element
+// timing of the text keyer against what they should send
+static bool checkKeyers(QTextStream &out)
+{
+    bool ok = true;
+    IambicKeyer keyer;
+    keyer.setWpm(20);
+    const qint64 unit = keyer.unitUs();
+
+    // Squeeze from the start, released during the dah: mode A stops
+    // after it, mode B sends one more element
+    QVector<LeverStep> squeeze = { { 0, true, true }, { 4 * unit, false, false } };
+    keyer.setModeB(false);
+    QString a = runPaddle(keyer, squeeze, 20 * unit);
+    keyer.setModeB(true);
+    QString b = runPaddle(keyer, squeeze, 20 * unit);
+    bool squeezeOk = (a == ".-" && b == ".-.");
+    out << "keyer: squeeze release A \"" << a << "\" B \"" << b << "\" "
+        << (squeezeOk ? "OK" : "FAILED") << "\n";
+    ok = ok && squeezeOk;
+
+    // Dit tapped and released during a dah: sent after it only with
+    // dit memory
+    QVector<LeverStep> tap = { { 0, false, true }, { unit, true, true }, { 2 * unit, false, true },
+                               { 3 * unit, false, false } };
+    keyer.setModeB(false);
+    keyer.setMemory(true, true);
+    QString memory = runPaddle(keyer, tap, 20 * unit);
+    keyer.setMemory(false, false);
+    QString noMemory = runPaddle(keyer, tap, 20 * unit);
+    keyer.setMemory(true, true);
+    bool memoryOk = (memory == "-." && noMemory == "-");
+    out << "keyer: memory latch \"" << memory << "\" without \"" << noMemory << "\" "
+        << (memoryOk ? "OK" : "FAILED") << "\n";
+    ok = ok && memoryOk;
+
+    // Weighting moves time from the space to the mark, a dit and its
+    // space always take two units and a dah and its space four
+    QVector<LeverStep> dits = { { 0, true, false }, { 3 * unit, false, false } };
+    QVector<LeverStep> dahs = { { 0, false, true }, { 5 * unit, false, false } };
+    bool weightOk = true;
+    out << "keyer: weight";
+    for (int w=IK_WEIGHT_MIN; w<=IK_WEIGHT_MAX; w+=25) {
+        keyer.setWeight(w);
+        QVector<KeyerElement> d, h;
+        runPaddle(keyer, dits, 20 * unit, &d);
+        runPaddle(keyer, dahs, 20 * unit, &h);
+        qint64 ditMark = unit * w / 50;
+        bool good = (d.size() == 2 && h.size() == 2
+                     && d[0].upUs - d[0].downUs == ditMark && d[1].downUs - d[0].downUs == 2 * unit
+                     && h[0].upUs - h[0].downUs == 2 * unit + ditMark && h[1].downUs - h[0].downUs == 4 * unit);
+        out << "  " << w << "% dit " << (d.isEmpty() ? 0 : d[0].upUs - d[0].downUs) / 1000
+            << "/" << (d.size() < 2 ? 0 : d[1].downUs - d[0].upUs) / 1000
+            << " dah " << (h.isEmpty() ? 0 : h[0].upUs - h[0].downUs) / 1000
+            << "/" << (h.size() < 2 ? 0 : h[1].downUs - h[0].upUs) / 1000 << " ms";
+        weightOk = weightOk && good;
+    }
+    keyer.setWeight(50);
+    out << " " << (weightOk ? "OK" : "FAILED") << "\n";
+    ok = ok && weightOk;
+
+    // A word of PARIS takes 50 units at the speed, with Farnsworth the
+    // elements are at the character speed and the spaces make it up
+    TextKeyer text;
+    bool textOk = true;
+    out << "keyer: text";
+    static const int speeds[][2] = { { 20, 0 }, { 5, 18 }, { 10, 25 } };
+    for (const auto &speed : speeds) {
+        text.setWpm(speed[0]);
+        text.setCharWpm(speed[1]);
+        QVector<KeyerEdge> edges;
+        qint64 wordUs = text.schedule("PARIS ", 0, &edges);
+        qint64 charUnit = 1200000 / qMax(speed[0], speed[1]);
+        bool good = (qAbs(wordUs - 60000000 / speed[0]) <= 100 && edges.size() == 2 * 14
+                     && edges[1].atUs - edges[0].atUs == charUnit
+                     && edges[2].atUs - edges[1].atUs == charUnit);
+        out << "  " << speed[0] << "/" << qMax(speed[0], speed[1]) << " wpm word "
+            << wordUs / 1000 << " ms";
+        textOk = textOk && good;
+    }
+    out << " " << (textOk ? "OK" : "FAILED") << "\n";
+    return ok && textOk;
+}
+
+static qint64 percentile(QVector<qint64> values, double p)
+{
+    if ( values.isEmpty() )
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values[qMin(values.size() - 1, int(p * values.size()))];
+}
+
+// Key events through the loopback server with a simulated lossy link.
+// The key time is the send time, so the lateness at the server is the
+// key delay that would have been needed.
+static void benchmarkTransport(QTextStream &out)
+{
+    LoopbackKeyServer server;
+    if ( !server.listen() ) {
+        out << "transport: can't start the loopback server\n";
+        return;
+    }
+    out << "transport: 2% loss, 30 ms delay, 20 ms jitter, 200 ms retransmit\n";
+    out << "transport: sent  received  needed key delay p50/p99/max (ms)\n";
+    for (int udp=0; udp<2; udp++) {
+        QTcpSocket tcpSocket;
+        QUdpSocket udpSocket;
+        QAbstractSocket *socket = &tcpSocket;
+        if ( udp )
+            socket = &udpSocket;
+        socket->connectToHost(QHostAddress::LocalHost, server.serverPort());
+        if ( !socket->waitForConnected(1000) ) {
+            out << "transport: can't connect\n";
+            return;
+        }
+        server.resetStatistics();
+        NetImpairment impairment;
+        impairment.setLossPercent(2.0);
+        impairment.setDelayMs(30);
+        impairment.setJitterMs(20);
+        impairment.setRetransmitMs(200);
+        impairment.setSeed(4711);
+        UdpKeyStream stream;
+        struct Pending {
+            qint64 arrivalUs;
+            QByteArray data;
+        };
+        QList<Pending> pending;
+        char frame[KP_MAX_FRAME];
+        int sent = 0;
+        qint64 nextEdgeUs = KeyClock::nowUs();
+        while ( sent < BENCH_EDGES || !pending.isEmpty() ) {
+            qint64 now = KeyClock::nowUs();
+            int len = 0;
+            if ( sent < BENCH_EDGES && now >= nextEdgeUs ) {
+                KeyMessage msg;
+                msg.type = (sent & 1) ? KP_KEY_UP : KP_KEY_DOWN;
+                msg.seq = quint16(sent);
+                msg.text = false;
+                msg.timeUs = quint64(KeyClock::epochUs());
+                msg.remoteUs = msg.timeUs;
+                msg.version = 0;
+                if ( udp ) {
+                    len = stream.addEvent(msg, now, frame);
+                } else {
+                    len = KeyProtocol::encode(frame, msg);
+                }
+                sent++;
+                nextEdgeUs += BENCH_EDGE_US;
+            } else if ( udp ) {
+                len = stream.repeat(now, frame);
+            }
+            if ( len > 0 ) {
+                qint64 arrival = impairment.arrivalUs(now, !udp);
+                if ( arrival >= 0 ) {
+                    Pending p;
+                    p.arrivalUs = arrival;
+                    p.data = QByteArray(frame, len);
+                    pending.append(p);
+                }
+            }
+            for (int i=0; i<pending.size(); ) {
+                if ( pending[i].arrivalUs <= now ) {
+                    socket->write(pending[i].data);
+                    pending.removeAt(i);
+                } else {
+                    i++;
+                }
+            }
+            QCoreApplication::processEvents();
+        }
+        QElapsedTimer t;
+        t.start();
+        while ( t.elapsed() < 200 ) {
+            QCoreApplication::processEvents();
+        }
+        QVector<qint64> lateness = server.latenessUs();
+        out << (udp ? "transport: UDP " : "transport: TCP ") << sent
+            << "  " << lateness.size()
+            << "  " << percentile(lateness, 0.50) / 1000.0
+            << "/" << percentile(lateness, 0.99) / 1000.0
+            << "/" << percentile(lateness, 1.0) / 1000.0 << "\n";
+        socket->close();
+    }
+}
+
+#if defined(Q_OS_LINUX)
+// Edges from the input thread, preallocated so recording doesn't allocate
+class EdgeRecorder : public KeyEdgeHandler
+{
+public:
+    EdgeRecorder() : edgeUs(BENCH_EDGES), seenUs(BENCH_EDGES) { count.storeRelease(0); }
+    void keyEdge(bool down, qint64 us) override
+    {
+        Q_UNUSED(down);
+        qint64 now = KeyClock::nowUs();
+        int i = count.loadAcquire();
+        if ( i >= BENCH_EDGES )
+            return;
+        edgeUs[i] = us;
+        seenUs[i] = now;
+        count.storeRelease(i + 1);
+    }
+    QVector<qint64> edgeUs, seenUs;
+    QAtomicInt count;
+};
+
+static bool emitEvent(int fd, int type, int code, int value)
+{
+    struct input_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = quint16(type);
+    ev.code = quint16(code);
+    ev.value = value;
+    return write(fd, &ev, sizeof(ev)) == ssize_t(sizeof(ev));
+}
+#endif
+
+// Key edges from a virtual uinput device through the input device
+// backend. Compares the kernel event time used as the edge time with
+// the time the event was written, and shows how much later the thread
+// saw it, which is what timestamping on detection would have added.
+static void benchmarkEvdev(QTextStream &out)
+{
+#if defined(Q_OS_LINUX)
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+    if ( fd < 0 ) {
+        out << "evdev: can't open /dev/uinput, skipped\n";
+        return;
+    }
+    struct uinput_user_dev dev;
+    memset(&dev, 0, sizeof(dev));
+    strncpy(dev.name, "CW keyer benchmark", UINPUT_MAX_NAME_SIZE - 1);
+    dev.id.bustype = BUS_VIRTUAL;
+    char sysName[64];
+    memset(sysName, 0, sizeof(sysName));
+    if ( ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0 || ioctl(fd, UI_SET_KEYBIT, BTN_0) < 0
+         || write(fd, &dev, sizeof(dev)) != ssize_t(sizeof(dev))
+         || ioctl(fd, UI_DEV_CREATE) < 0 ) {
+        out << "evdev: can't create the uinput device\n";
+        close(fd);
+        return;
+    }
+    // Find the event node of the new device, udev needs a moment for it
+    QString node;
+    if ( ioctl(fd, UI_GET_SYSNAME(sizeof(sysName)), sysName) >= 0 ) {
+        QElapsedTimer t;
+        t.start();
+        while ( node.isEmpty() && t.elapsed() < 2000 ) {
+            QDir dir(QString("/sys/devices/virtual/input/") + sysName);
+            QStringList events = dir.entryList(QStringList() << "event*", QDir::Dirs);
+            if ( !events.isEmpty() && QFile::exists("/dev/input/" + events.first()) ) {
+                node = "/dev/input/" + events.first();
+            } else {
+                QThread::msleep(10);
+            }
+        }
+    }
+    qintptr handle = node.isEmpty() ? -1 : KeyInputThread::openEventDevice(node);
+    if ( handle < 0 ) {
+        out << "evdev: can't open the event device of the uinput device\n";
+        ioctl(fd, UI_DEV_DESTROY);
+        close(fd);
+        return;
+    }
+    EdgeRecorder recorder;
+    KeyInputThread input(&recorder);
+    input.setKeyLine(KeyInputThread::LineEvdev);
+    input.setKeyCode(BTN_0);
+    input.setDebounceUs(BENCH_EDGE_US / 2);
+    input.startSampling(handle);
+    QThread::msleep(50);
+
+    QVector<qint64> writtenUs;
+    qint64 next = KeyClock::nowUs();
+    for (int i=0; i<BENCH_EDGES; i++) {
+        while ( KeyClock::nowUs() < next ) {
+            QThread::usleep(100);
+        }
+        qint64 before = KeyClock::nowUs();
+        emitEvent(fd, EV_KEY, BTN_0, (i & 1) ? 0 : 1);
+        emitEvent(fd, EV_SYN, SYN_REPORT, 0);
+        writtenUs.append(before);
+        next += BENCH_EDGE_US;
+    }
+    QThread::msleep(100);
+    input.stopSampling();
+    KeyInputThread::closeEventDevice(handle);
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+
+    int received = recorder.count.loadAcquire();
+    QVector<qint64> stampError, wakeup;
+    for (int i=0; i<received && i<writtenUs.size(); i++) {
+        stampError.append(recorder.edgeUs[i] - writtenUs[i]);
+        wakeup.append(recorder.seenUs[i] - recorder.edgeUs[i]);
+    }
+    out << "evdev: sent " << writtenUs.size() << "  received " << received
+        << "  event time - write time p50/p99/max " << percentile(stampError, 0.50)
+        << "/" << percentile(stampError, 0.99) << "/" << percentile(stampError, 1.0) << " us"
+        << "  seen after the event p50/p99/max " << percentile(wakeup, 0.50)
+        << "/" << percentile(wakeup, 0.99) << "/" << percentile(wakeup, 1.0) << " us\n";
+#else
+    out << "evdev: Linux only, skipped\n";
+#endif
+}
+
+// Sleeps of KEY_POLL_US like the polling key input thread, recording how
+// much later than due the thread got to run
+class WakeupThread : public QThread
+{
+public:
+    bool realTime = false;
+    QVector<qint64> lateUs;
+
+protected:
+    void run() override
+    {
+        if ( realTime ) {
+            RealTime::enterThread(RT_KEY);
+        }
+        lateUs.reserve((BENCH_RUN_MS * 1000) / KEY_POLL_US);
+        qint64 end = KeyClock::nowUs() + BENCH_RUN_MS * 1000;
+        while ( KeyClock::nowUs() < end ) {
+            qint64 due = KeyClock::nowUs() + KEY_POLL_US;
+            QThread::usleep(KEY_POLL_US);
+            lateUs.append(KeyClock::nowUs() - due);
+        }
+    }
+};
+
+// Keeps a CPU busy until stopped
+class LoadThread : public QThread
+{
+public:
+    QAtomicInt stop;
+
+protected:
+    void run() override
+    {
+        volatile quint64 n = 0;
+        while ( stop.loadAcquire() == 0 ) {
+            n = n + 1;
+        }
+    }
+};
+
+// Wake up latency of a key thread on the default scheduler and in real
+// time mode, with load=<n> threads keeping the CPUs busy meanwhile
+static void benchmarkWakeup(QTextStream &out, const QStringList &options)
+{
+    int load = 0;
+    foreach (QString option, options) {
+        if ( option.startsWith("load=") ) {
+            load = option.mid(5).toInt();
+        }
+    }
+    RealTimeConfig saved = RealTime::config();
+    out << "wakeup: " << KEY_POLL_US << " us sleeps for " << BENCH_RUN_MS << " ms, "
+        << load << " busy threads\n";
+    out << "wakeup: mode  late p50/p99/max (us)\n";
+    for (int rt=0; rt<2; rt++) {
+        RealTimeConfig config = saved;
+        config.enabled = (rt != 0);
+        config.lockMemory = false;
+        RealTime::configure(config);
+        QList<LoadThread *> loaders;
+        for (int i=0; i<load; i++) {
+            LoadThread *t = new LoadThread();
+            t->start();
+            loaders.append(t);
+        }
+        WakeupThread thread;
+        thread.realTime = (rt != 0);
+        thread.start();
+        thread.wait();
+        foreach (LoadThread *t, loaders) {
+            t->stop.storeRelease(1);
+            t->wait();
+            delete t;
+        }
+        QString mode = rt ? RealTime::threadState(RT_KEY) : QString("default");
+        out << "wakeup: " << (mode.isEmpty() ? QString("real time not allowed") : mode)
+            << "  " << percentile(thread.lateUs, 0.50) << "/" << percentile(thread.lateUs, 0.99)
+            << "/" << percentile(thread.lateUs, 1.0) << "\n";
+        out.flush();
+    }
+    RealTime::configure(saved);
+}
+
+// Key down and key up durations in microseconds, alternating and
+// starting with a key down
+static QVector<qint64> synthKeying(const QByteArray &text, int wpm)
+{
+    TextKeyer keyer;
+    keyer.setWpm(wpm);
+    QVector<KeyerEdge> edges;
+    qint64 end = keyer.schedule(QString::fromLatin1(text), 0, &edges);
+    QVector<qint64> d;
+    for (int i=0; i<edges.size(); i++) {
+        d.append((i + 1 < edges.size() ? edges[i + 1].atUs : end) - edges[i].atUs);
+    }
+    return d;
+}
+
+// Recorded keying, durations in ms as above separated by white space
+static QVector<qint64> loadKeying(const QString &file)
+{
+    QVector<qint64> d;
+    QFile f(file);
+    if ( !f.open(QIODevice::ReadOnly) )
+        return d;
+    foreach (QByteArray item, f.readAll().simplified().split(' ')) {
+        bool ok;
+        double ms = item.toDouble(&ok);
+        if ( ok && ms > 0.0 )
+            d.append(qint64(ms * 1000.0));
+    }
+    return d;
+}
+
+struct FidelityOptions {
+    QList<int> wpm;
+    QByteArray text;
+    QString keyingFile;
+    int keyDelayMs;             // -1 for the delay estimator
+    bool tcp;
+    bool udp;
+    bool textProtocol;
+    NetImpairment sim;
+    double lossPercent;
+    int latencyMs;
+    int jitterMs;
+    double reorderPercent;
+    int destinations;           // Additional servers keyed at the same time
+    bool textKeyer;             // Synthetic keying through the text keyer
+};
+
+static FidelityOptions parseFidelityOptions(const QStringList &options)
+{
+    FidelityOptions o;
+    o.wpm << 15 << 25 << 40;
+    o.text = FIDELITY_TEXT;
+    o.keyDelayMs = -1;
+    o.tcp = true;
+    o.udp = true;
+    o.textProtocol = false;
+    o.lossPercent = 1.0;
+    o.latencyMs = 30;
+    o.jitterMs = 20;
+    o.reorderPercent = 1.0;
+    o.destinations = 0;
+    o.textKeyer = false;
+    foreach (QString option, options) {
+        QString key = option.section('=', 0, 0);
+        QString value = option.section('=', 1);
+        if ( key == "wpm" ) {
+            o.wpm.clear();
+            foreach (QString w, value.split(',')) {
+                if ( w.toInt() > 0 )
+                    o.wpm << w.toInt();
+            }
+        } else if ( key == "text" ) {
+            o.text = value.toLatin1();
+        } else if ( key == "keying" ) {
+            o.keyingFile = value;
+        } else if ( key == "keydelay" ) {
+            o.keyDelayMs = (value == "auto") ? -1 : value.toInt();
+        } else if ( key == "transport" ) {
+            o.tcp = value.contains("tcp");
+            o.udp = value.contains("udp");
+        } else if ( key == "protocol" ) {
+            o.textProtocol = (value == "text");
+        } else if ( key == "loss" ) {
+            o.lossPercent = value.toDouble();
+        } else if ( key == "latency" ) {
+            o.latencyMs = value.toInt();
+        } else if ( key == "jitter" ) {
+            o.jitterMs = value.toInt();
+        } else if ( key == "reorder" ) {
+            o.reorderPercent = value.toDouble();
+        } else if ( key == "destinations" ) {
+            o.destinations = qBound(0, value.toInt(), KE_MAX_SESSIONS - 1);
+        } else if ( key == "source" ) {
+            o.textKeyer = (value == "keyer");
+        }
+    }
+    o.sim.setLossPercent(o.lossPercent);
+    o.sim.setDelayMs(o.latencyMs);
+    o.sim.setJitterMs(o.jitterMs);
+    o.sim.setReorderPercent(o.reorderPercent);
+    o.sim.setRetransmitMs(200);
+    o.sim.setSeed(4711);
+    return o;
+}
+
+static void processEventsFor(qint64 us)
+{
+    qint64 end = KeyClock::nowUs() + us;
+    while ( KeyClock::nowUs() < end ) {
+        QCoreApplication::processEvents();
+    }
+}
+
+// Keying through a complete KeyEngine to the loopback server, which
+// plays every event at its key time. Compares the played key with the
+// local one. Additional destinations get the same key from their own
+// loopback servers, only the first server is measured so their cost
+// shows up as added latency there.
+static void runFidelity(QTextStream &out, const FidelityOptions &o, bool udp,
+                        const QString &label, const QVector<qint64> &durations, int wpm = 0)
+{
+    LoopbackKeyServer server;
+    if ( !server.listen() ) {
+        out << "fidelity: can't start the loopback server\n";
+        return;
+    }
+    KeyEngine engine;
+    engine.setTransportUdp(udp);
+    engine.setOfferBinary(!o.textProtocol);
+    engine.setNetImpairment(o.sim);
+    QList<LoopbackKeyServer *> others;
+    for (int i=0; i<o.destinations; i++) {
+        LoopbackKeyServer *other = new LoopbackKeyServer();
+        if ( other->listen() ) {
+            engine.addDestination("127.0.0.1", other->serverPort(), udp);
+        }
+        others.append(other);
+    }
+    engine.connectToServer("127.0.0.1", server.serverPort());
+    qint64 until = KeyClock::nowUs() + 2000000;
+    int connected = 0;
+    while ( KeyClock::nowUs() < until ) {
+        QCoreApplication::processEvents();
+        connected = engine.isConnected() ? 1 : 0;
+        for (int i=0; i<engine.destinationCount(); i++) {
+            connected += engine.destination(i)->isConnected() ? 1 : 0;
+        }
+        if ( connected == engine.destinationCount() + 1 )
+            break;
+    }
+    if ( !engine.isConnected() ) {
+        out << "fidelity: can't connect\n";
+        qDeleteAll(others);
+        return;
+    }
+    // Let the clock and delay estimators settle first
+    if ( o.keyDelayMs < 0 ) {
+        engine.setAutoKeyDelay(true);
+        engine.measureKeyDelay();
+        processEventsFor(2000000);
+    } else {
+        engine.setKeyDelayMs(o.keyDelayMs);
+        for (int i=0; i<20; i++) {
+            engine.ping();
+            processEventsFor(100000);
+        }
+    }
+    server.resetStatistics();
+
+    QVector<qint64> edges;
+    qint64 t = KeyClock::nowUs() + 50000;
+    bool keyer = o.textKeyer && wpm > 0;
+    if ( keyer ) {
+        // Same schedule as the engine's, which sends it ahead
+        engine.setKeyerWpm(wpm);
+        t = KeyClock::nowUs() + KE_KEYER_START_MS * 1000;
+        engine.sendText(QString::fromLatin1(o.text));
+    }
+    foreach (qint64 d, durations) {
+        edges.append(t);
+        t += d;
+    }
+    for (int i=0; i<edges.size(); ) {
+        if ( KeyClock::nowUs() >= edges[i] ) {
+            if ( !keyer ) {
+                engine.keyEdge((i & 1) == 0, edges[i]);
+            }
+            i++;
+        }
+        QCoreApplication::processEvents();
+    }
+    // Until the last one has been played, retransmits included
+    processEventsFor(qint64(engine.keyDelayMs()) * 1000 + 1000000);
+
+    // Find every sent edge at the server
+    const QVector<LoopbackKeyServer::KeyEventRecord> &events = server.keyEvents();
+    qint64 anchor = KeyClock::epochUs() - KeyClock::nowUs();
+    QVector<qint64> expected(edges.size()), played(edges.size());
+    int lost = 0, late = 0;
+    QVector<qint64> added;
+    for (int i=0; i<edges.size(); i++) {
+        expected[i] = anchor + edges[i];
+        if ( o.textProtocol ) {
+            expected[i] = ((expected[i] / 1000) % 4294967295) * 1000;
+        }
+        played[i] = -1;
+        foreach (const LoopbackKeyServer::KeyEventRecord &e, events) {
+            if ( e.down == ((i & 1) == 0) && qAbs(e.timeUs - expected[i]) <= FIDELITY_MATCH_US ) {
+                played[i] = e.playedUs;
+                if ( e.arrivalUs > e.keyTimeUs )
+                    late++;
+                break;
+            }
+        }
+        if ( played[i] < 0 ) {
+            lost++;
+        } else {
+            added.append(played[i] - expected[i]);
+        }
+    }
+    QVector<qint64> error;
+    qint64 errorSum = 0;
+    for (int i=0; i+1<edges.size(); i++) {
+        if ( played[i] < 0 || played[i+1] < 0 )
+            continue;
+        qint64 e = qAbs((played[i+1] - played[i]) - (edges[i+1] - edges[i]));
+        error.append(e);
+        errorSum += e;
+    }
+    int received = edges.size() - lost;
+    out << "fidelity: " << (udp ? "UDP " : "TCP ") << label
+        << "  key delay " << engine.keyDelayMs() << " ms"
+        << "  edges " << edges.size() << "  lost " << lost
+        << "  late " << (received ? 100.0 * late / received : 0.0) << "%"
+        << "  duration error mean/p95/max "
+        << (error.isEmpty() ? 0.0 : errorSum / 1000.0 / error.size())
+        << "/" << percentile(error, 0.95) / 1000.0
+        << "/" << percentile(error, 1.0) / 1000.0 << " ms"
+        << "  added latency p50/p99 " << percentile(added, 0.50) / 1000.0
+        << "/" << percentile(added, 0.99) / 1000.0 << " ms";
+    if ( engine.serverAcks() ) {
+        // What the client learned from the acks, should match the above
+        KeyAckStats a = engine.ackStatistics();
+        out << "  acked " << a.acked << " late " << a.late;
+    }
+    if ( !others.isEmpty() ) {
+        out << "  destinations " << connected - 1 << "/" << others.size();
+    }
+    out << "\n";
+    out.flush();
+    engine.disconnectFromServer();
+    qDeleteAll(others);
+}
+
+// How faithfully the key is reproduced at the server, for synthetic
+// keying at several speeds or recorded keying, over a simulated link
+static void benchmarkFidelity(QTextStream &out, const QStringList &options)
+{
+    FidelityOptions o = parseFidelityOptions(options);
+    out << "fidelity: " << o.lossPercent << "% loss, " << o.latencyMs << " ms latency, "
+        << o.jitterMs << " ms jitter, " << o.reorderPercent << "% reordered, "
+        << (o.textProtocol ? "text" : "binary") << " protocol, key delay ";
+    if ( o.keyDelayMs < 0 ) {
+        out << "from the estimator\n";
+    } else {
+        out << o.keyDelayMs << " ms\n";
+    }
+    out.flush();
+    for (int udp=0; udp<2; udp++) {
+        if ( (udp && !o.udp) || (!udp && !o.tcp) )
+            continue;
+        if ( !o.keyingFile.isEmpty() ) {
+            QVector<qint64> durations = loadKeying(o.keyingFile);
+            if ( durations.isEmpty() ) {
+                out << "fidelity: no keying in " << o.keyingFile << "\n";
+                return;
+            }
+            runFidelity(out, o, udp != 0, o.keyingFile, durations);
+            continue;
+        }
+        foreach (int wpm, o.wpm) {
+            runFidelity(out, o, udp != 0, QString("%1 wpm%2").arg(wpm).arg(o.textKeyer ? " keyer" : ""),
+                        synthKeying(o.text, wpm), wpm);
+        }
+    }
+}
+
+class DetectedEdges : public KeyEdgeHandler
+{
+public:
+    void keyEdge(bool down, qint64 edgeUs) override
+    {
+        Edge e;
+        e.down = down;
+        e.edgeUs = edgeUs;
+        e.detectedUs = detector->analysedUntilUs();
+        edges.append(e);
+    }
+    struct Edge {
+        bool down;
+        qint64 edgeUs;
+        qint64 detectedUs;
+    };
+    ToneDetector *detector = nullptr;
+    QVector<Edge> edges;
+};
+
+// Keyed tone with raised cosine ramps centred on the key edges and white
+// noise through the audio key detector, in 10 ms periods like a capture.
+// Reports the error of the detected edge times, the latency from the
+// edge until it is detected and the processing cost of one channel.
+static void benchmarkAudioKey(QTextStream &out)
+{
+    const int rates[] = { 44100, 48000 };
+    out << "audiokey: " << AUDIOKEY_WPM << " wpm " << FIDELITY_TEXT << ", tone "
+        << AUDIOKEY_LEVEL << ", noise " << AUDIOKEY_NOISE << " of full scale\n";
+    for (int rate : rates) {
+        QAudioFormat format;
+        format.setSampleRate(rate);
+        format.setChannelCount(1);
+        format.setSampleSize(16);
+        format.setCodec("audio/pcm");
+        format.setByteOrder(QAudioFormat::LittleEndian);
+        format.setSampleType(QAudioFormat::SignedInt);
+
+        // The key edges, then the signal
+        QVector<qint64> edges;
+        qint64 t = 20000;
+        foreach (qint64 d, synthKeying(FIDELITY_TEXT, AUDIOKEY_WPM)) {
+            edges.append(t);
+            t += d;
+        }
+        int count = int(((t + 20000) * rate) / 1000000);
+        QVector<qint16> samples(count);
+        std::mt19937 random(4711);
+        std::normal_distribution<double> noise(0.0, AUDIOKEY_NOISE);
+        int next = 0;
+        for (int i=0; i<count; i++) {
+            qint64 us = (qint64(i) * 1000000) / rate;
+            while ( next < edges.size() && us >= edges[next] + AUDIOKEY_RAMP_US / 2 ) {
+                next++;
+            }
+            // Gain 1 while down, ramping through the edge
+            double gain = (next & 1) ? 1.0 : 0.0;
+            if ( next < edges.size() && us >= edges[next] - AUDIOKEY_RAMP_US / 2 ) {
+                double r = double(us - edges[next] + AUDIOKEY_RAMP_US / 2) / AUDIOKEY_RAMP_US;
+                double up = 0.5 - 0.5 * qCos(M_PI * r);
+                gain = (next & 1) ? 1.0 - up : up;
+            }
+            double v = AUDIOKEY_LEVEL * gain * qSin((2.0 * M_PI * 700 * i) / rate) + noise(random);
+            samples[i] = qint16(qBound(-32768.0, v * 32767.0, 32767.0));
+        }
+
+        DetectedEdges detected;
+        ToneDetector detector(format, &detected);
+        detected.detector = &detector;
+        detector.setFrequency(700);
+        int period = rate / 100;
+        for (int i=0; i<count; i+=period) {
+            detector.process(samples.constData() + i, qMin(period, count - i),
+                             (qint64(i) * 1000000) / rate);
+        }
+
+        QVector<qint64> error, latency;
+        int found = 0;
+        for (int i=0; i<edges.size(); i++) {
+            foreach (const DetectedEdges::Edge &e, detected.edges) {
+                if ( e.down == ((i & 1) == 0) && qAbs(e.edgeUs - edges[i]) <= AUDIOKEY_MATCH_US ) {
+                    error.append(qAbs(e.edgeUs - edges[i]));
+                    latency.append(e.detectedUs - edges[i]);
+                    found++;
+                    break;
+                }
+            }
+        }
+        qint64 errorSum = 0;
+        foreach (qint64 e, error) {
+            errorSum += e;
+        }
+
+        // Processing cost without the edge bookkeeping above
+        detector.reset();
+        detector.resetStatistics();
+        QElapsedTimer timer;
+        timer.start();
+        while ( timer.elapsed() < BENCH_RUN_MS ) {
+            for (int i=0; i<count; i+=period) {
+                detector.process(samples.constData() + i, qMin(period, count - i),
+                                 (qint64(i) * 1000000) / rate);
+            }
+        }
+        double audioNs = (detector.samplesProcessed() * 1000000000.0) / rate;
+        quint64 blocks = qMax(Q_UINT64_C(1), detector.samplesProcessed() / quint64(detector.blockSamples()));
+        out << "audiokey: " << rate << " Hz  block " << detector.blockSamples()
+            << "  edges " << found << "/" << edges.size()
+            << " (" << detected.edges.size() << " detected)"
+            << "  edge error mean/p95/max "
+            << (error.isEmpty() ? 0.0 : errorSum / 1000.0 / error.size())
+            << "/" << percentile(error, 0.95) / 1000.0
+            << "/" << percentile(error, 1.0) / 1000.0 << " ms"
+            << "  detection latency p50/p99 " << percentile(latency, 0.50) / 1000.0
+            << "/" << percentile(latency, 0.99) / 1000.0 << " ms"
+            << "  " << detector.busyNs() / qint64(blocks) << " ns/block, "
+            << (100.0 * detector.busyNs()) / audioNs << "% of a core per channel\n";
+        out.flush();
+    }
+}
+
+int runBenchmarks(const QStringList &arguments)
+{
+    QTextStream out(stdout);
+    int result = 0;
+    // "name=value" are options, the rest benchmark names
+    QStringList names, options;
+    foreach (QString a, arguments) {
+        if ( a.contains('=') ) {
+            options << a;
+        } else {
+            names << a;
+        }
+    }
+    if ( names.isEmpty() || names.contains("tone") ) {
+        benchmarkTone(out);
+    }
+    if ( names.isEmpty() || names.contains("parser") ) {
+        if ( !benchmarkParser(out) )
+            result = 1;
+    }
+    if ( names.isEmpty() || names.contains("keyer") ) {
+        if ( !checkKeyers(out) )
+            result = 1;
+    }
+    if ( names.isEmpty() || names.contains("transport") ) {
+        benchmarkTransport(out);
+    }
+    if ( names.isEmpty() || names.contains("fidelity") ) {
+        benchmarkFidelity(out, options);
+    }
+    if ( names.isEmpty() || names.contains("audiokey") ) {
+        benchmarkAudioKey(out);
+    }
+    if ( names.contains("evdev") ) {
+        benchmarkEvdev(out);
+    }
+    if ( names.isEmpty() || names.contains("wakeup") ) {
+        benchmarkWakeup(out, options);
+    }
+    out.flush();
+    return result;
+}
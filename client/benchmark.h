@@ -19,16 +19,14 @@
 // be used in advertising or otherwise to promote the sale, use or other dealings
 // in this Software without prior written authorization of the copyright holder.
 
-#include <QCoreApplication>
-#include "mainwindow.h"
-//#include "myudp.h"
-
-#include <QApplication>
-
-int main(int argc, char *argv[])
-{
-    QApplication a(argc, argv);
-    MainWindow w;
-    w.show();
-    return a.exec();
-}
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QStringList>
+
+// Run the named micro-benchmarks (or all of them if the list is empty)
+// and print the results on stdout. Started with "--benchmark [name ...]
+// [option=value ...]" on the command line, no window is opened.
+int runBenchmarks(const QStringList &arguments);
+
+#endif // BENCHMARK_H
@@ -0,0 +1,42 @@
+QT       += core gui multimedia
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++11
+TARGET = CW_keyer_client
+
+# You can make your code fail to compile if it uses deprecated APIs.
+# In order to do so, uncomment the following line.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+include(../engine/engine.pri)
+
+SOURCES += \
+    benchmark.cpp \
+    main.cpp \
+    mainwindow.cpp \
+    metricsdialog.cpp \
+    tonedetector.cpp \
+    tonegenerator.cpp
+
+HEADERS += \
+    benchmark.h \
+    mainwindow.h \
+    metricsdialog.h \
+    tonedetector.h \
+    tonegenerator.h
+
+FORMS += \
+    mainwindow.ui \
+    metricsdialog.ui
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
+
+RESOURCES += \
+    icons.qrc
+
+DISTFILES += \
+    ../Images/MorseKeyIcon2.png
@@ -0,0 +1,71 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QCoreApplication>
+#include "mainwindow.h"
+#include "benchmark.h"
+#include "loopbackserver.h"
+#include "keyclock.h"
+#include "processstats.h"
+//#include "myudp.h"
+
+#include <QApplication>
+#include <QTimer>
+#include <cstring>
+#include <cstdlib>
+
+int main(int argc, char *argv[])
+{
+    // Start the clock for the startup report
+    KeyClock::nowUs();
+    // "--benchmark [name ...]" runs the micro-benchmarks without a window
+    // "--loopback-server [port]" runs a local stand-in key server
+    // "--startup-report" print startup time and memory use and exit
+    bool startupReport = false;
+    for (int i=1; i<argc; i++) {
+        if ( !strcmp(argv[i], "--startup-report") ) {
+            startupReport = true;
+        }
+        if ( !strcmp(argv[i], "--benchmark") ) {
+            QCoreApplication a(argc, argv);
+            return runBenchmarks(a.arguments().mid(i+1));
+        }
+        if ( !strcmp(argv[i], "--loopback-server") ) {
+            QCoreApplication a(argc, argv);
+            LoopbackKeyServer server;
+            quint16 port = (i + 1 < argc) ? quint16(atoi(argv[i+1])) : 5000;
+            if ( !server.listen(QHostAddress::Any, port) ) {
+                return 1;
+            }
+            return a.exec();
+        }
+    }
+    QApplication a(argc, argv);
+    MainWindow w;
+    w.show();
+    if ( startupReport ) {
+        QTimer::singleShot(0, []() {
+            ProcessStats::printStartupReport("CW_keyer_client");
+            QCoreApplication::quit();
+        });
+    }
+    return a.exec();
+}
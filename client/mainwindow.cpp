@@ -0,0 +1,775 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QDateTime>
+#include <QTimer>
+#include <QSerialPort>
+#include <QSerialPortInfo>
+#include <QByteArray>
+#include <QtMath>
+#include <QAudioOutput>
+#include <QAudioFormat>
+#include <QAudioDeviceInfo>
+#include <QSettings>
+#include <QThread>
+#include "mainwindow.h"
+#include "./ui_mainwindow.h"
+#include "realtime.h"
+#include <algorithm>
+
+
+MainWindow::MainWindow(QWidget *parent) :
+    QMainWindow(parent),
+    ui(new Ui::MainWindow)
+{
+    ui->setupUi(this);
+    // Setup a program Icon
+    setWindowIcon(QIcon(":/icon/Images/MorseKeyIcon_3.png"));
+
+    // Keying, timing and the connection to the key server
+    engine = new KeyEngine(this);
+
+    // Setup a timer to show the statistics of the engine
+    QTimer* timer = new QTimer(this);
+    timer->connect(timer,
+                   SIGNAL(timeout()),
+                   this,
+                   SLOT(updateStatistics()));
+    timer->start(1000);
+
+    // Setup audio to be used as side tone. The tone is generated as a
+    // stream on demand by the ToneGenerator, keying is done by gating the
+    // generator so the audio output is kept running all the time.
+
+    // Create an output with our premade QAudioFormat (See example in QAudioOutput)
+    // Set up the format, eg.
+    audioFormat.setSampleRate(SAMPLE_RATE);
+    audioFormat.setChannelCount(1);
+    audioFormat.setSampleSize(SAMPLE_BITS);
+    audioFormat.setCodec("audio/pcm");
+    audioFormat.setByteOrder(QAudioFormat::LittleEndian);
+    audioFormat.setSampleType(QAudioFormat::SignedInt);
+    tone = new ToneGenerator(audioFormat, this);
+    tone->setFrequency(TONE_FREQ);
+    tone->setMetrics(&engine->metrics());
+    updateAudioDeviceList();
+    setupAudio();
+    SideToneEnabled = false;
+
+    // default initial delay to be used if "Set Delay Time" has not been activated
+    ui->keyDelay->setValue(engine->keyDelayMs());
+
+    // initialize the list of available COM-ports
+    updateComPortList();
+
+    // Setup colors to key connect buttons
+    ui->ConnectToKeyNetwork->setStyleSheet("background-color: red;");
+    ui->ConnectToKeyPort->setStyleSheet("background-color: red;");
+
+    // Load settings from file system from last open session
+    loadSettings();
+    updateKeyLine();
+
+    // The real time mode comes with the settings, the side tone moves to
+    // its own thread then
+    if ( RealTime::isEnabled() ) {
+        startAudioThread();
+        setupAudio();
+    }
+}
+
+MainWindow::~MainWindow()
+{
+    // Save all settings from this session before closing
+    saveSettings();
+    if ( audioKeyInput != nullptr ) {
+        audioKeyInput->stop();
+    }
+    runOnAudioThread([this]() {
+        delete audio;
+        audio = nullptr;
+    });
+    if ( audioThread != nullptr ) {
+        audioThread->quit();
+        audioThread->wait();
+        delete audioContext;
+    }
+    delete metricsDialog;
+    delete engine;
+    delete ui;
+}
+
+// Filled from the engine's port watcher, which enumerates the ports on
+// its own thread and follows hotplug events
+void MainWindow::updateComPortList()
+{
+    //qDebug() << "on_keyPortDevice_highlighted";
+    // Refilling the list must not change the key port name
+    ui->keyPortDevice->blockSignals(true);
+    ui->keyPortDevice->clear();
+    bool input = ui->KeyOnHID->isChecked();
+    this->ui->keyPortDevice->addItem(input ? "Select input device" : "Select Key port");
+    foreach (KeyPortInfo i, engine->keyPorts(input)) {
+        this->ui->keyPortDevice->addItem(i.name+" "+i.description);
+    }
+    ui->keyPortDevice->blockSignals(false);
+}
+
+void MainWindow::updateAudioDeviceList()
+{
+    audioDevices = QAudioDeviceInfo::availableDevices(QAudio::AudioOutput);
+    // Don't restart the audio for every item added
+    ui->audioDevice->blockSignals(true);
+    ui->audioDevice->clear();
+    ui->audioDevice->addItem("Default audio device");
+    foreach (QAudioDeviceInfo i, audioDevices) {
+        ui->audioDevice->addItem(i.deviceName());
+    }
+    ui->audioDevice->blockSignals(false);
+}
+
+void MainWindow::startAudioThread()
+{
+    // An output made so far belongs to this thread, the next setupAudio()
+    // makes one on the side tone thread
+    if ( audio != nullptr ) {
+        audio->stop();
+        delete audio;
+        audio = nullptr;
+    }
+    audioThread = new QThread(this);
+    audioContext = new QObject();
+    audioContext->moveToThread(audioThread);
+    audioThread->start(QThread::TimeCriticalPriority);
+    runOnAudioThread([]() { RealTime::enterThread(RT_AUDIO); });
+}
+
+// Run f on the side tone thread and wait for it, right here when there
+// is none. QAudioOutput pulls the tone on the thread that created it.
+void MainWindow::runOnAudioThread(const std::function<void()> &f)
+{
+    if ( audioThread != nullptr ) {
+        QMetaObject::invokeMethod(audioContext, f, Qt::BlockingQueuedConnection);
+    } else {
+        f();
+    }
+}
+
+void MainWindow::setupAudio()
+{
+    QAudioDeviceInfo device = QAudioDeviceInfo::defaultOutputDevice();
+    int index = ui->audioDevice->currentIndex() - 1;
+    if ( index >= 0 && index < audioDevices.size() ) {
+        if ( audioDevices[index].isFormatSupported(audioFormat) ) {
+            device = audioDevices[index];
+        } else {
+            qDebug() << "Audio format not supported by" << audioDevices[index].deviceName();
+        }
+    }
+    int bufferBytes = BUFFER_SIZE;
+    if ( lowLatencyAudio ) {
+        // Keep only two small periods in the device buffer. The stream is
+        // never suspended, the tone generator gates the tone instead.
+        int periodBytes = ((SAMPLE_RATE * audioPeriodMs) / 1000) * (SAMPLE_BITS/8);
+        bufferBytes = 2 * periodBytes;
+    }
+    tone->setTimedGating(lowLatencyAudio);
+    tone->setPeriodUs(0);
+    tone->setQueuedUs(0);
+    runOnAudioThread([this, device, bufferBytes]() {
+        if ( audio != nullptr ) {
+            audio->stop();
+            delete audio;
+        }
+        audio = new QAudioOutput(device, audioFormat);
+        audio->setBufferSize(bufferBytes);
+        audio->setNotifyInterval(250);
+        // The device buffer is only asked on the thread of the output
+        connect(audio, &QAudioOutput::notify, audio, [this]() {
+            tone->setQueuedUs(int((qint64(audio->bufferSize() - audio->bytesFree()) * 1000000)
+                                  / (SAMPLE_RATE * (SAMPLE_BITS/8))));
+        });
+        audio->start(tone);
+        tone->setPeriodUs(int((qint64(audio->periodSize()) * 1000000) / (SAMPLE_RATE * (SAMPLE_BITS/8))));
+    });
+    connect(audio,
+            SIGNAL(notify()),
+            this,
+            SLOT(on_AudioNotify()));
+    tone->resetEdgeLatency();
+}
+
+// Capture from AudioKeyDevice (the default input if empty) and key the
+// engine from the tone in it
+void MainWindow::setupAudioKey()
+{
+    if ( audioKeyInput != nullptr ) {
+        audioKeyInput->stop();
+        delete audioKeyInput;
+        audioKeyInput = nullptr;
+    }
+    delete toneDetector;
+    toneDetector = nullptr;
+    if ( !ui->keyAudio->isChecked() )
+        return;
+    QAudioDeviceInfo device = QAudioDeviceInfo::defaultInputDevice();
+    foreach (QAudioDeviceInfo i, QAudioDeviceInfo::availableDevices(QAudio::AudioInput)) {
+        if ( i.deviceName() == audioKeyDevice ) {
+            device = i;
+        }
+    }
+    QAudioFormat format = audioFormat;
+    if ( !device.isFormatSupported(format) ) {
+        format = device.nearestFormat(format);
+    }
+    if ( format.sampleSize() != 16 || format.sampleType() != QAudioFormat::SignedInt ) {
+        qDebug() << "No 16 bit audio input on" << device.deviceName();
+        return;
+    }
+    toneDetector = new ToneDetector(format, engine, this);
+    toneDetector->setFrequency(audioKeyFrequency);
+    toneDetector->setMinLevel(float(qPow(10.0, audioKeyMinLevelDb / 20.0)));
+    audioKeyInput = new QAudioInput(device, format, this);
+    // Small periods, each one is analysed as soon as it arrives
+    audioKeyInput->setBufferSize((format.sampleRate() * format.channelCount() * 2 * 10) / 1000);
+    audioKeyInput->start(toneDetector);
+}
+
+void MainWindow::loadSettings() {
+
+    QSettings settings(SettingsPath + "/" + SettingsFile, QSettings::IniFormat);
+    settings.beginGroup("MAIN");
+    quint32 val = settings.value("keyNetPort", "").toUInt();
+    ui->keyNetPort->setValue(val);
+    QString str = settings.value("keyIP", "").toString();
+    ui->keyIP->setText(str);
+    str = settings.value("KeyPort", "").toString();
+    ui->KeyPortName->setText(str);
+    str = settings.value("KeyTransport", "").toString();
+    ui->keyUdp->setChecked(!QString::compare(str, "UDP"));
+    engine->loadSettings(settings);
+    ui->keyerWpm->setValue(engine->keyerWpm());
+    ui->keyerCharWpm->setValue(engine->keyerCharWpm());
+    ui->paddleMode->setCurrentIndex(int(engine->paddleMode()));
+    str = settings.value("AutoKeyDelay", "").toString();
+    ui->autoKeyDelay->setChecked(!QString::compare(str, "true"));
+    str = settings.value("KeyInput", "").toString();
+    if ( !QString::compare(str, "CTS") ) {
+        ui->KeyOnCTS->setChecked(true);
+        ui->KeyOnDSR->setChecked(false);
+    } else if ( !QString::compare(str, "DSR") ) {
+        ui->KeyOnCTS->setChecked(false);
+        ui->KeyOnDSR->setChecked(true);
+    } else if ( !QString::compare(str, "HID") ) {
+        ui->KeyOnHID->setChecked(true);
+    }
+    str = settings.value("KeyInvert", "").toString();
+    if ( !QString::compare(str, "Inverted") ) {
+        ui->keyPortInvert->setChecked(true);
+    } else {
+        ui->keyPortInvert->setChecked(false);
+    }
+    str = settings.value("UseSideTone", "").toString();
+    if (!QString::compare(str, "true")) {
+        ui->sideTone->setChecked(true);
+    } else {
+        ui->sideTone->setChecked(false);
+    }
+    str = settings.value("KeyThread", "").toString();
+    if (!QString::compare(str, "true")) {
+        ui->keyThread->setChecked(true);
+    } else {
+        ui->keyThread->setChecked(false);
+    }
+    qint32 ival = settings.value("KeyDebounce", 45).toInt();
+    ui->keyDebounce->setValue(ival);
+    ival = settings.value("SideToneVolume", "").toInt();
+    ui->verticalSlider->setValue(ival);
+    val = settings.value("SideToneFrequency", "").toInt();
+    ui->toneFreqBox->setValue(val);
+    ival = settings.value("AudioPeriod", 5).toInt();
+    ui->audioPeriod->setValue(ival);
+    str = settings.value("LowLatencyAudio", "").toString();
+    if (!QString::compare(str, "true")) {
+        ui->lowLatencyAudio->setChecked(true);
+    } else {
+        ui->lowLatencyAudio->setChecked(false);
+    }
+    str = settings.value("AudioDevice", "").toString();
+    ival = ui->audioDevice->findText(str);
+    if ( ival > 0 ) {
+        ui->audioDevice->setCurrentIndex(ival);
+    }
+    audioKeyDevice = settings.value("AudioKeyDevice", "").toString();
+    audioKeyFrequency = settings.value("AudioKeyFrequency", TONE_FREQ).toInt();
+    audioKeyMinLevelDb = settings.value("AudioKeyMinLevel", -40.0).toDouble();
+    str = settings.value("AudioKey", "").toString();
+    ui->keyAudio->setChecked(!QString::compare(str, "true"));
+    settings.endGroup();
+}
+
+void MainWindow::saveSettings()
+{
+    QSettings settings(SettingsPath + "/" + SettingsFile, QSettings::IniFormat);
+    settings.beginGroup("MAIN");
+    settings.setValue("keyNetPort",  ui->keyNetPort->value());
+    settings.setValue("keyIP",  ui->keyIP->text());
+    settings.setValue("KeyPort",  ui->KeyPortName->text().toLatin1());
+    if ( ui->autoKeyDelay->isChecked() ) {
+        settings.setValue("AutoKeyDelay", "true");
+    } else {
+        settings.setValue("AutoKeyDelay", "false");
+    }
+    engine->saveSettings(settings);
+    if ( ui->keyUdp->isChecked() ) {
+        settings.setValue("KeyTransport", "UDP");
+    } else {
+        settings.setValue("KeyTransport", "TCP");
+    }
+    if ( ui->KeyOnCTS->isChecked() ) {
+        settings.setValue("KeyInput",  "CTS");
+    } else if ( ui->KeyOnHID->isChecked() ) {
+        settings.setValue("KeyInput",  "HID");
+    } else {
+        settings.setValue("KeyInput",  "DSR");
+    }
+    if ( ui->keyPortInvert->isChecked() ) {
+        settings.setValue("KeyInvert",  "Inverted");
+    } else {
+        settings.setValue("KeyInvert",  "NotInverted");
+    }
+    if ( ui->keyThread->isChecked() ) {
+        settings.setValue("KeyThread", "true");
+    } else {
+        settings.setValue("KeyThread", "false");
+    }
+    settings.setValue("KeyDebounce", ui->keyDebounce->value());
+    if ( ui->sideTone->isChecked() ) {
+        settings.setValue("UseSideTone", "true");
+    } else {
+        settings.setValue("UseSideTone", "false");
+    }
+    settings.setValue("SideToneVolume", ui->verticalSlider->value());
+    settings.setValue("SideToneFrequency", ui->toneFreqBox->value());
+    settings.setValue("AudioPeriod", ui->audioPeriod->value());
+    if ( ui->lowLatencyAudio->isChecked() ) {
+        settings.setValue("LowLatencyAudio", "true");
+    } else {
+        settings.setValue("LowLatencyAudio", "false");
+    }
+    if ( ui->audioDevice->currentIndex() > 0 ) {
+        settings.setValue("AudioDevice", ui->audioDevice->currentText());
+    } else {
+        settings.setValue("AudioDevice", "");
+    }
+    if ( ui->keyAudio->isChecked() ) {
+        settings.setValue("AudioKey", "true");
+    } else {
+        settings.setValue("AudioKey", "false");
+    }
+    settings.setValue("AudioKeyDevice", audioKeyDevice);
+    settings.setValue("AudioKeyFrequency", audioKeyFrequency);
+    settings.setValue("AudioKeyMinLevel", audioKeyMinLevelDb);
+    settings.endGroup();
+}
+
+void MainWindow::on_AudioNotify()
+{
+    //qDebug() << "on_AudioNotify, state:" << audio->state();
+    if ( tone->edgeLatencyCount() == 0 )
+        return;
+    // Key edge to first tone sample, the device buffer queued in front
+    // of it is already in each sample
+    ui->sideToneLatency->display(tone->lastEdgeLatencyUs() / 1000.0);
+    ui->sideToneLatency->setToolTip(
+                QString("Key to side tone latency (ms) over %1 key downs\nmin %2  avg %3  max %4")
+                .arg(tone->edgeLatencyCount())
+                .arg(tone->minEdgeLatencyUs() / 1000.0, 0, 'f', 1)
+                .arg(tone->avgEdgeLatencyUs() / 1000.0, 0, 'f', 1)
+                .arg(tone->maxEdgeLatencyUs() / 1000.0, 0, 'f', 1));
+}
+
+void MainWindow::updateStatistics()
+{
+    updateSendStatistics();
+}
+
+void MainWindow::on_keyButton_pressed()
+{
+    QStringList s;
+        engine->keyDown();
+}
+
+void MainWindow::on_keyButton_released()
+{
+    engine->keyUp();
+}
+
+
+void MainWindow::on_toneButton_pressed()
+{
+    tone->setKeyed(true);
+}
+
+void MainWindow::on_toneButton_released()
+{
+    tone->setKeyed(false);
+}
+
+void MainWindow::keyEdge(bool down, qint64 edgeUs)
+{
+    if ( SideToneEnabled ) {
+        tone->setKeyed(down, edgeUs * 1000);
+    }
+}
+
+void MainWindow::keyPortsChanged()
+{
+    updateComPortList();
+}
+
+// Yellow while an unplugged key port is waited for
+void MainWindow::keyPortChanged(bool open, const QString &name)
+{
+    if ( open ) {
+        ui->KeyPortName->setText(name);
+        ui->ConnectToKeyPort->setStyleSheet("background-color: green;");
+    } else {
+        ui->ConnectToKeyPort->setStyleSheet("background-color: yellow;");
+    }
+}
+
+void MainWindow::connectionChanged(KeyConnectionState state)
+{
+    // Yellow while the engine is trying to (re)connect
+    switch ( state ) {
+    case KC_CONNECTED:
+        ui->ConnectToKeyNetwork->setStyleSheet("background-color: green;");
+        break;
+    case KC_CONNECTING:
+    case KC_RECONNECTING:
+        ui->ConnectToKeyNetwork->setStyleSheet("background-color: yellow;");
+        break;
+    default:
+        ui->ConnectToKeyNetwork->setStyleSheet("background-color: red;");
+        break;
+    }
+}
+
+void MainWindow::pingMeasured()
+{
+    ui->packetLatency->display(engine->lastOneWayMs());
+    ui->packetLatencyMin->display(engine->minOneWayMs());
+    ui->packetLatencyMax->display(engine->maxOneWayMs());
+    ui->statusbar->showMessage(
+                QString("Clock offset %1 ms  skew %2 ppm  uncertainty %3 ms  (%4 samples)")
+                .arg(engine->clockOffsetUs() / 1000.0, 0, 'f', 2)
+                .arg(engine->clockSkewPpm(), 0, 'f', 1)
+                .arg(engine->clockUncertaintyUs() / 1000.0, 0, 'f', 2)
+                .arg(engine->clockSamples()));
+
+    const DelayEstimator &delay = engine->delayStatistics();
+    ui->recommendedDelay->display(engine->recommendedKeyDelayMs());
+    ui->recommendedDelay->setToolTip(
+                QString("Recommended key delay (ms) for %1% in time\n"
+                        "one way delay mean %2  dev %3  min %4  max %5 over %6 pings")
+                .arg(engine->onTimeTarget() * 100.0)
+                .arg(delay.meanUs() / 1000.0, 0, 'f', 1)
+                .arg(delay.deviationUs() / 1000.0, 0, 'f', 1)
+                .arg(delay.minUs() / 1000.0, 0, 'f', 1)
+                .arg(delay.maxUs() / 1000.0, 0, 'f', 1)
+                .arg(delay.sampleCount()));
+}
+
+void MainWindow::keyDelayChanged(int ms)
+{
+    ui->keyDelay->setValue(ms);
+}
+
+void MainWindow::updateSendStatistics()
+{
+    KeySenderStats s = engine->sendStatistics();
+    QString tip = QString("Send queue %1 (max %2)  stalled %3 (max %4)\n"
+                          "queue latency avg %5  max %6 ms\n"
+                          "write latency avg %7  max %8 ms\n"
+                          "sent %9  dropped %10  overflows %11  stalls %12")
+            .arg(s.ringDepth).arg(s.ringMaxDepth)
+            .arg(s.pendingDepth).arg(s.pendingMaxDepth)
+            .arg(s.queueAvgUs / 1000.0, 0, 'f', 2).arg(s.queueMaxUs / 1000.0, 0, 'f', 2)
+            .arg(s.writeAvgUs / 1000.0, 0, 'f', 2).arg(s.writeMaxUs / 1000.0, 0, 'f', 2)
+            .arg(s.sent).arg(s.dropped).arg(s.overflows).arg(s.stalls);
+    if ( engine->serverAcks() ) {
+        KeyAckStats a = engine->ackStatistics();
+        tip.append(QString("\nacked %1  late %2  slack %3 ms  min %4 ms")
+                   .arg(a.acked).arg(a.late)
+                   .arg(a.lastSlackUs / 1000.0, 0, 'f', 1)
+                   .arg(a.minSlackUs / 1000.0, 0, 'f', 1));
+    }
+    for (int i=0; i<engine->destinationCount(); i++) {
+        KeySession *session = engine->destination(i);
+        tip.append(QString("\n%1:%2  %3  key delay %4 ms  one way %5 ms")
+                   .arg(session->host()).arg(session->port())
+                   .arg(session->isConnected() ? "connected" : "not connected")
+                   .arg(session->keyDelayMs()).arg(session->lastOneWayMs()));
+    }
+    if ( engine->reconnectCount() > 0 ) {
+        tip.append(QString("\nreconnects %1  resent %2%3")
+                   .arg(engine->reconnectCount()).arg(engine->resentCount())
+                   .arg(engine->sessionResumed() ? "  resumed" : ""));
+    }
+    // What batching saves and what it costs, over the last minute
+    KeyMetricSummary writes = engine->metrics().summary(KM_WRITE_BYTES, KM_MINUTE_US);
+    tip.append(QString("\npackets %1/s  %2 bytes per key event")
+               .arg(writes.count / 60.0, 0, 'f', 1)
+               .arg(s.keyEvents ? double(s.keyBytes) / s.keyEvents : 0.0, 0, 'f', 1));
+    if ( engine->batchPercent() > 0 ) {
+        KeyMetricSummary hold = engine->metrics().summary(KM_BATCH_HOLD, KM_MINUTE_US);
+        tip.append(QString("  batches %1  added latency avg %2  p99 %3 ms")
+                   .arg(s.batches)
+                   .arg(hold.mean / 1000.0, 0, 'f', 1)
+                   .arg(hold.p99 / 1000.0, 0, 'f', 1));
+    }
+    // Time the client itself adds to what the kernel timestamps measure
+    if ( engine->isStamped() ) {
+        KeyMetricSummary tx = engine->metrics().summary(KM_TX_STACK, KM_MINUTE_US);
+        KeyMetricSummary rx = engine->metrics().summary(KM_RX_STACK, KM_MINUTE_US);
+        tip.append(QString("\nkernel timestamps: ping to kernel p50 %1  p99 %2 ms, kernel to read p50 %3  p99 %4 ms")
+                   .arg(tx.p50 / 1000.0, 0, 'f', 2).arg(tx.p99 / 1000.0, 0, 'f', 2)
+                   .arg(rx.p50 / 1000.0, 0, 'f', 2).arg(rx.p99 / 1000.0, 0, 'f', 2));
+    }
+    KeyMetricSummary keyWake = engine->metrics().summary(KM_WAKE_KEY, KM_MINUTE_US);
+    KeyMetricSummary sendWake = engine->metrics().summary(KM_WAKE_SEND, KM_MINUTE_US);
+    tip.append(QString("\nwake up p99 key %1  send %2 ms  (%3)")
+               .arg(keyWake.p99 / 1000.0, 0, 'f', 2)
+               .arg(sendWake.p99 / 1000.0, 0, 'f', 2)
+               .arg(RealTime::report()));
+    ui->ConnectToKeyNetwork->setToolTip(tip);
+}
+
+void MainWindow::on_autoKeyDelay_stateChanged(int arg1)
+{
+    engine->setAutoKeyDelay(arg1 != 0);
+}
+
+void MainWindow::on_SetKeyDelay_clicked()
+{
+    engine->measureKeyDelay();
+}
+
+void MainWindow::on_KeyPortName_textChanged(const QString &arg1)
+{
+    ui->ConnectToKeyPort->setChecked(false);
+    keyPort = ui->KeyPortName->text().toLatin1();
+}
+
+void MainWindow::on_ShowComPortList_clicked()
+{
+    // The list follows hotplug events, this catches anything they missed
+    // and the list is refilled again when the scan has finished
+    engine->rescanKeyPorts();
+    updateComPortList();
+}
+
+
+void MainWindow::on_sideTone_stateChanged(int arg1)
+{
+    SideToneEnabled = (arg1 != 0);
+    if ( !SideToneEnabled ) {
+        tone->setKeyed(false);
+    }
+}
+
+void MainWindow::on_keyPortInvert_stateChanged(int arg1)
+{
+    engine->setKeyInverted(arg1 != 0);
+}
+
+void MainWindow::on_KeyOnCTS_toggled(bool checked)
+{
+    Q_UNUSED(checked);
+    updateKeyLine();
+}
+
+void MainWindow::on_KeyOnDSR_toggled(bool checked)
+{
+    Q_UNUSED(checked);
+    updateKeyLine();
+}
+
+void MainWindow::on_KeyOnHID_toggled(bool checked)
+{
+    Q_UNUSED(checked);
+    updateKeyLine();
+    updateComPortList();
+}
+
+void MainWindow::updateKeyLine()
+{
+    if ( ui->KeyOnHID->isChecked() ) {
+        engine->setKeyLine(KeyInputThread::LineEvdev);
+    } else if ( ui->KeyOnDSR->isChecked() && !ui->KeyOnCTS->isChecked() ) {
+        engine->setKeyLine(KeyInputThread::LineDSR);
+    } else {
+        engine->setKeyLine(KeyInputThread::LineCTS);
+    }
+    // Switching between a serial port and an input device closes it
+    if ( !engine->isKeyPortOpen() && !engine->isKeyPortWaiting() ) {
+        ui->ConnectToKeyPort->setStyleSheet("background-color: red;");
+    }
+}
+
+void MainWindow::on_keyThread_stateChanged(int arg1)
+{
+    engine->setKeyThread(arg1 != 0);
+}
+
+void MainWindow::on_paddleMode_currentIndexChanged(int index)
+{
+    engine->setPaddleMode(KeyInputThread::PaddleMode(index));
+}
+
+void MainWindow::on_keyDebounce_valueChanged(int arg1)
+{
+    engine->setKeyDebounceUs(arg1 * 1000);
+}
+
+void MainWindow::on_verticalSlider_valueChanged(int value)
+{
+    //qDebug() << "Volume:" << value;
+    qreal linearVolume = QAudio::convertVolume(value / qreal(100.0), QAudio::LogarithmicVolumeScale, QAudio::LinearVolumeScale);
+    //qDebug() << "LogVol:" << linearVolume;
+    tone->setVolume(linearVolume);
+}
+
+void MainWindow::on_toneFreqBox_valueChanged(int arg1)
+{
+    tone->setFrequency(arg1);
+}
+
+
+void MainWindow::on_audioDevice_currentIndexChanged(int index)
+{
+    //qDebug() << "Audio device selected: [" << index << "]" << ui->audioDevice->currentText();
+    Q_UNUSED(index);
+    setupAudio();
+}
+
+void MainWindow::on_lowLatencyAudio_stateChanged(int arg1)
+{
+    lowLatencyAudio = (arg1 != 0);
+    setupAudio();
+}
+
+void MainWindow::on_audioPeriod_valueChanged(int arg1)
+{
+    audioPeriodMs = arg1;
+    if ( lowLatencyAudio ) {
+        setupAudio();
+    }
+}
+
+
+void MainWindow::on_keyPortDevice_currentIndexChanged(const QString &arg1)
+{
+    QString qstr;
+    QStringList list = arg1.split(" ");
+    qstr = list[0];
+    //qDebug() << "on_keyPortDevice_currentIndexChanged to:" << arg1;
+    //qDebug() << qstr;
+
+    ui->KeyPortName->setText(qstr);
+
+}
+
+
+
+void MainWindow::on_ConnectToKeyNetwork_clicked()
+{
+    if ( engine->isServerOpen() ) {
+        //qDebug()<<"KeyNet open, closing";
+        engine->disconnectFromServer();
+    } else {
+        //qDebug()<<"KeyNet not open, opening";
+        engine->connectToServer(ui->keyIP->text(), quint16(ui->keyNetPort->value()));
+    }
+}
+
+void MainWindow::on_keyUdp_stateChanged(int arg1)
+{
+    // Changing transport reconnects over the other one
+    engine->setTransportUdp(arg1 != 0);
+}
+
+void MainWindow::on_ConnectToKeyPort_clicked()
+{
+    if ( engine->isKeyPortOpen() || engine->isKeyPortWaiting() ) {
+        engine->closeKeyPort();
+        ui->ConnectToKeyPort->setStyleSheet("background-color: red;");
+    } else {
+        if ( engine->openKeyPort(ui->KeyPortName->text()) ) {
+            ui->ConnectToKeyPort->setStyleSheet("background-color: green;");
+        }
+    }
+
+}
+
+
+
+void MainWindow::on_keyAudio_stateChanged(int arg1)
+{
+    Q_UNUSED(arg1);
+    setupAudioKey();
+}
+
+void MainWindow::on_keyerText_returnPressed()
+{
+    engine->sendText(ui->keyerText->text() + " ");
+    ui->keyerText->clear();
+}
+
+void MainWindow::on_keyerWpm_valueChanged(int arg1)
+{
+    engine->setKeyerWpm(arg1);
+}
+
+void MainWindow::on_keyerCharWpm_valueChanged(int arg1)
+{
+    engine->setKeyerCharWpm(arg1);
+}
+
+void MainWindow::on_keyerStop_clicked()
+{
+    engine->stopText();
+}
+
+void MainWindow::on_keyDelay_valueChanged(int arg1)
+{
+    engine->setKeyDelayMs(arg1);
+}
+
+void MainWindow::on_showStatistics_clicked()
+{
+    if ( !metricsDialog ) {
+        metricsDialog = new MetricsDialog(&engine->metrics(), this);
+    }
+    metricsDialog->show();
+    metricsDialog->raise();
+}
@@ -23,13 +23,19 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
-//#include <QUdpSocket>
-#include <QTcpSocket>
 #include <QSerialPort>
-#include <QBuffer>
 #include <QAudioOutput>
+#include <QAudioInput>
 #include <QAudioFormat>
+#include <QAudioDeviceInfo>
 #include <QStandardPaths>
+#include <QThread>
+#include <QAtomicInt>
+#include <functional>
+#include "tonegenerator.h"
+#include "tonedetector.h"
+#include "keyengine.h"
+#include "metricsdialog.h"
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
@@ -37,10 +43,7 @@ QT_END_NAMESPACE
 
 #define TONE_FREQ 700
 #define SAMPLE_RATE 44100
-#define FREQ_CONST ((2.0 * M_PI) / ((SAMPLE_RATE*1.0)/(TONE_FREQ*1.0)))
 #define SAMPLE_BITS 16
-#define TG_MAX_VAL ((pow(2, SAMPLE_BITS)/2)-1)
-#define SAMPLE_TIME 10
 #define BUFFER_SIZE 8192
 //2048
 
@@ -49,10 +52,7 @@ QT_END_NAMESPACE
 
 #define QT_NO_DEBUG_OUTPUT
 
-#define CW_MAX_DELAY 300
-#define CW_MIN_DELAY 25
-
-class MainWindow : public QMainWindow
+class MainWindow : public QMainWindow, public KeyEngineHandler
 {
     Q_OBJECT
 
@@ -60,6 +60,14 @@ public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
 
+    // Called by the engine, keyEdge() on the key input thread
+    void keyEdge(bool down, qint64 edgeUs) override;
+    void connectionChanged(KeyConnectionState state) override;
+    void pingMeasured() override;
+    void keyDelayChanged(int ms) override;
+    void keyPortsChanged() override;
+    void keyPortChanged(bool open, const QString &name) override;
+
 private slots:
 
     // Buttons and fields
@@ -81,15 +89,25 @@ private slots:
 
     // Functions
     void on_AudioNotify();
-    void audioTimerEvent();
-    void msEvent();
-    void readyReadKeyTcp();
-    void readyReadKeySerial();
-    void KeyUp();
-    void KeyDown();
-    void RadioPing();
+    void updateStatistics();
 
     void on_keyDelay_valueChanged(int arg1);
+    void on_lowLatencyAudio_stateChanged(int arg1);
+    void on_audioPeriod_valueChanged(int arg1);
+    void on_keyThread_stateChanged(int arg1);
+    void on_paddleMode_currentIndexChanged(int index);
+    void on_keyDebounce_valueChanged(int arg1);
+    void on_keyUdp_stateChanged(int arg1);
+    void on_autoKeyDelay_stateChanged(int arg1);
+    void on_KeyOnCTS_toggled(bool checked);
+    void on_KeyOnDSR_toggled(bool checked);
+    void on_KeyOnHID_toggled(bool checked);
+    void on_showStatistics_clicked();
+    void on_keyAudio_stateChanged(int arg1);
+    void on_keyerText_returnPressed();
+    void on_keyerWpm_valueChanged(int arg1);
+    void on_keyerCharWpm_valueChanged(int arg1);
+    void on_keyerStop_clicked();
 
 private:
     Ui::MainWindow *ui;
@@ -97,27 +115,34 @@ private:
     void saveSettings();
     void sort(QList<QSerialPortInfo> list, int column, Qt::SortOrder order = Qt::AscendingOrder);
     void updateComPortList();
-
-    quint32 KeyDeBounceCnt = 0;
+    void updateAudioDeviceList();
+    void setupAudio();
+    void startAudioThread();
+    void runOnAudioThread(const std::function<void()> &f);
+    void setupAudioKey();
+    void updateKeyLine();
+    void updateSendStatistics();
+
+    KeyEngine* engine;
+    MetricsDialog* metricsDialog = nullptr;
     QString SettingsPath = QStandardPaths::writableLocation(QStandardPaths::ConfigLocation);
     QString SettingsFile = "remotecwclient.ini";
-    QTcpSocket *tcpKeySocket;
-    QSerialPort *keySerialPort;
     QByteArray keyPort;
-    quint32 hostPort;
-    QByteArray hostAddress;
-    bool KeyIsDownLast;
-    bool keyPortStatus;
-    QByteArray* bytebuf;
-    QAudioOutput* audio;
-    QBuffer* input;
+    QAudioOutput* audio = nullptr;
+    QAudioFormat audioFormat;
+    QList<QAudioDeviceInfo> audioDevices;
+    ToneGenerator* tone;
+    bool lowLatencyAudio = false;
+    int audioPeriodMs = 5;
+    // Side tone thread in real time mode, the audio output lives on it
+    QThread* audioThread = nullptr;
+    QObject* audioContext = nullptr;
+    // Keying from a tone on an audio input
+    QAudioInput* audioKeyInput = nullptr;
+    ToneDetector* toneDetector = nullptr;
+    QString audioKeyDevice;
+    int audioKeyFrequency = TONE_FREQ;
+    double audioKeyMinLevelDb = -40.0;
     bool SideToneEnabled;
-    quint32 packetDelay = 0;
-    quint32 SetKeyDelayCnt = 0;
-    unsigned long remdiff = 0;
-    QTimer* audioTimer;
-    qint32 audioTimerCnt = 0;
-    bool TimeToRestartAudio = false;
-    bool keyPortInverted = false;
 };
 #endif // MAINWINDOW_H
@@ -0,0 +1,117 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTimer>
+#include <QFileDialog>
+#include <QMessageBox>
+#include "metricsdialog.h"
+#include "ui_metricsdialog.h"
+#include "keypathtrace.h"
+
+MetricsDialog::MetricsDialog(KeyMetrics *metrics, QWidget *parent) :
+    QDialog(parent),
+    ui(new Ui::MetricsDialog),
+    metrics(metrics)
+{
+    ui->setupUi(this);
+    ui->table->setRowCount(KM_COUNT);
+    ui->table->setColumnCount(5);
+    ui->table->setHorizontalHeaderLabels(QStringList() << "Count" << "p50" << "p95" << "p99" << "Max");
+    for (int i=0; i<KM_COUNT; i++) {
+        QString label = KeyMetrics::description(KeyMetric(i));
+        label.append(i == KM_SEND_QUEUE ? "" : " (ms)");
+        ui->table->setVerticalHeaderItem(i, new QTableWidgetItem(label));
+        for (int c=0; c<5; c++) {
+            QTableWidgetItem *item = new QTableWidgetItem();
+            item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            ui->table->setItem(i, c, item);
+        }
+    }
+
+    QTimer* timer = new QTimer(this);
+    timer->connect(timer,
+                   SIGNAL(timeout()),
+                   this,
+                   SLOT(refresh()));
+    timer->start(1000);
+    refresh();
+}
+
+MetricsDialog::~MetricsDialog()
+{
+    delete ui;
+}
+
+qint64 MetricsDialog::windowUs() const
+{
+    switch ( ui->window->currentIndex() ) {
+    case 0: return KM_MINUTE_US;
+    case 1: return KM_QUARTER_US;
+    default: return 0;
+    }
+}
+
+void MetricsDialog::refresh()
+{
+    if ( !isVisible() )
+        return;
+    for (int i=0; i<KM_COUNT; i++) {
+        KeyMetricSummary s = metrics->summary(KeyMetric(i), windowUs());
+        QList<qint64> values;
+        values << s.p50 << s.p95 << s.p99 << s.max;
+        ui->table->item(i, 0)->setText(QString::number(s.count));
+        for (int c=0; c<values.size(); c++) {
+            if ( i == KM_SEND_QUEUE ) {
+                ui->table->item(i, c + 1)->setText(QString::number(values[c]));
+            } else {
+                ui->table->item(i, c + 1)->setText(QString::number(values[c] / 1000.0, 'f', 2));
+            }
+        }
+    }
+}
+
+void MetricsDialog::on_window_currentIndexChanged(int index)
+{
+    Q_UNUSED(index);
+    refresh();
+}
+
+void MetricsDialog::on_exportButton_clicked()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, "Export statistics", QString(),
+                                                    "CSV (*.csv);;JSON (*.json)");
+    if ( fileName.isEmpty() )
+        return;
+    if ( !metrics->writeFile(fileName, windowUs()) ) {
+        QMessageBox::warning(this, "Export statistics", "Could not write " + fileName);
+    }
+}
+
+void MetricsDialog::on_keyPathButton_clicked()
+{
+    QString fileName = QFileDialog::getSaveFileName(this, "Save key path trace", QString(),
+                                                    "Chrome trace (*.json)");
+    if ( fileName.isEmpty() )
+        return;
+    if ( !KeyPathTrace::writeChromeTrace(fileName) ) {
+        QMessageBox::warning(this, "Save key path trace", "Could not write " + fileName);
+    }
+}
@@ -0,0 +1,55 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef METRICSDIALOG_H
+#define METRICSDIALOG_H
+
+#include <QDialog>
+#include "keymetrics.h"
+
+QT_BEGIN_NAMESPACE
+namespace Ui { class MetricsDialog; }
+QT_END_NAMESPACE
+
+// Table of p50/p95/p99 of the key metrics, refreshed every second while
+// shown
+class MetricsDialog : public QDialog
+{
+    Q_OBJECT
+
+public:
+    MetricsDialog(KeyMetrics *metrics, QWidget *parent = nullptr);
+    ~MetricsDialog();
+
+private slots:
+    void refresh();
+    void on_window_currentIndexChanged(int index);
+    void on_exportButton_clicked();
+    void on_keyPathButton_clicked();
+
+private:
+    qint64 windowUs() const;
+
+    Ui::MetricsDialog *ui;
+    KeyMetrics *metrics;
+};
+
+#endif // METRICSDIALOG_H
@@ -0,0 +1,201 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QtMath>
+#include <cstring>
+#include "tonedetector.h"
+#include "keyclock.h"
+
+ToneDetector::ToneDetector(const QAudioFormat &format, KeyEdgeHandler *handler, QObject *parent) :
+    QIODevice(parent),
+    edgeHandler(handler)
+{
+    sampleRate = format.sampleRate();
+    channels = qMax(1, format.channelCount());
+    blockLength = qMax(TD_LANES, int((qint64(sampleRate) * TD_BLOCK_US) / 1000000));
+    paddedLength = ((blockLength + TD_LANES - 1) / TD_LANES) * TD_LANES;
+    block.fill(0.0f, paddedLength);
+    setFrequency(toneHz);
+    open(QIODevice::WriteOnly);
+}
+
+// The window is folded into the tables, scaled so a full scale tone
+// measures 1.0
+void ToneDetector::setFrequency(int hz)
+{
+    toneHz = hz;
+    cosTable.fill(0.0f, paddedLength);
+    sinTable.fill(0.0f, paddedLength);
+    double windowSum = 0;
+    for (int i=0; i<blockLength; i++) {
+        windowSum += 0.5 - 0.5 * qCos((2.0 * M_PI * (i + 0.5)) / blockLength);
+    }
+    for (int i=0; i<blockLength; i++) {
+        double w = 0.5 - 0.5 * qCos((2.0 * M_PI * (i + 0.5)) / blockLength);
+        double phase = (2.0 * M_PI * hz * i) / sampleRate;
+        double scale = 2.0 * w / (windowSum * 32768.0);
+        cosTable[i] = float(qCos(phase) * scale);
+        sinTable[i] = float(qSin(phase) * scale);
+    }
+}
+
+void ToneDetector::reset()
+{
+    blockPos = 0;
+    peakLevel = 0;
+    floorLevel = -1;
+    lastLevel = 0;
+    lastCentreUs = 0;
+    keyDown = false;
+    lastEdgeUs = 0;
+    analysedUs = 0;
+    anchored = false;
+    streamSamples = 0;
+}
+
+void ToneDetector::resetStatistics()
+{
+    sampleCnt = 0;
+    busyTimeNs = 0;
+    edges = 0;
+}
+
+void ToneDetector::process(const qint16 *samples, int count, qint64 firstSampleUs)
+{
+    qint64 startNs = KeyClock::nowNs();
+    float *b = block.data();
+    for (int i=0; i<count; ) {
+        if ( blockPos == 0 ) {
+            blockStartUs = firstSampleUs + (qint64(i) * 1000000) / sampleRate;
+        }
+        int n = qMin(count - i, blockLength - blockPos);
+        for (int j=0; j<n; j++) {
+            b[blockPos + j] = float(samples[i + j]);
+        }
+        blockPos += n;
+        i += n;
+        if ( blockPos == blockLength ) {
+            analyseBlock();
+            blockPos = 0;
+        }
+    }
+    sampleCnt += quint64(count);
+    busyTimeNs += KeyClock::nowNs() - startNs;
+}
+
+void ToneDetector::analyseBlock()
+{
+    // Correlation with the windowed tone, TD_LANES independent sums
+    const float *b = block.constData();
+    const float *c = cosTable.constData();
+    const float *s = sinTable.constData();
+    float re[TD_LANES], im[TD_LANES];
+    for (int j=0; j<TD_LANES; j++) {
+        re[j] = 0.0f;
+        im[j] = 0.0f;
+    }
+    for (int i=0; i<paddedLength; i+=TD_LANES) {
+        for (int j=0; j<TD_LANES; j++) {
+            re[j] += b[i + j] * c[i + j];
+            im[j] += b[i + j] * s[i + j];
+        }
+    }
+    float sumRe = 0.0f, sumIm = 0.0f;
+    for (int j=0; j<TD_LANES; j++) {
+        sumRe += re[j];
+        sumIm += im[j];
+    }
+    float level = qSqrt(sumRe * sumRe + sumIm * sumIm);
+
+    qint64 blockUs = (qint64(blockLength) * 1000000) / sampleRate;
+    qint64 centreUs = blockStartUs + blockUs / 2;
+    analysedUs = blockStartUs + blockUs;
+
+    // The tone level decays by half in about two seconds, the noise
+    // floor follows the level down at once and up slowly while key up
+    peakLevel = qMax(level, peakLevel * 0.9995f);
+    if ( floorLevel < 0 || level < floorLevel ) {
+        floorLevel = level;
+    } else if ( !keyDown ) {
+        floorLevel += (level - floorLevel) * 0.002f;
+    }
+    float span = peakLevel - floorLevel;
+    float onLevel = qMax(minLevel, floorLevel + TD_ON_FRACTION * span);
+    float offLevel = qMax(minLevel * (TD_OFF_FRACTION / TD_ON_FRACTION), floorLevel + TD_OFF_FRACTION * span);
+
+    bool down = keyDown ? level > offLevel : level >= onLevel;
+    if ( down != keyDown && lastCentreUs != 0 ) {
+        // Where the level crossed the middle between the two centres
+        float threshold = floorLevel + TD_EDGE_FRACTION * span;
+        float frac = 1.0f;
+        if ( level != lastLevel ) {
+            frac = qBound(0.0f, (threshold - lastLevel) / (level - lastLevel), 1.0f);
+        }
+        qint64 edgeUs = lastCentreUs + qint64(frac * (centreUs - lastCentreUs));
+        edgeUs = qMax(edgeUs, lastEdgeUs + 1);
+        keyDown = down;
+        lastEdgeUs = edgeUs;
+        edges++;
+        edgeHandler->keyEdge(down, edgeUs);
+    } else {
+        keyDown = down;
+    }
+    lastLevel = level;
+    lastCentreUs = centreUs;
+}
+
+qint64 ToneDetector::readData(char *data, qint64 maxlen)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxlen);
+    return 0;
+}
+
+// The samples arrive some time after they were captured. The earliest
+// arrival relative to the sample count is the best estimate of the
+// capture time, it is allowed to drift by TD_ANCHOR_LEAK_PPM.
+qint64 ToneDetector::writeData(const char *data, qint64 len)
+{
+    qint64 now = KeyClock::nowUs();
+    int frames = int(len / (2 * channels));
+    if ( frames <= 0 )
+        return len;
+    const qint16 *samples = reinterpret_cast<const qint16 *>(data);
+    if ( channels > 1 ) {
+        if ( channelBuffer.size() < frames ) {
+            channelBuffer.resize(frames);
+        }
+        for (int i=0; i<frames; i++) {
+            channelBuffer[i] = samples[i * channels];
+        }
+        samples = channelBuffer.constData();
+    }
+    qint64 frameUs = (qint64(frames) * 1000000) / sampleRate;
+    qint64 candidate = now - (qint64(streamSamples + quint64(frames)) * 1000000) / sampleRate;
+    anchorUs += (frameUs * TD_ANCHOR_LEAK_PPM) / 1000000;
+    if ( !anchored || candidate < anchorUs ) {
+        anchorUs = candidate;
+        anchored = true;
+    }
+    process(samples, frames, anchorUs + (qint64(streamSamples) * 1000000) / sampleRate);
+    streamSamples += quint64(frames);
+    return len;
+}
@@ -0,0 +1,127 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef TONEDETECTOR_H
+#define TONEDETECTOR_H
+
+#include <QIODevice>
+#include <QAudioFormat>
+#include <QVector>
+#include "keyinputthread.h"
+
+// Analysis block, sets the time resolution and the bandwidth (about
+// 2 / TD_BLOCK_US with the Hann window, 1 kHz for 2 ms)
+#define TD_BLOCK_US 2000
+// Partial sums of the block correlation, one SIMD register of floats.
+// Independent lanes let the compiler vectorise without -ffast-math.
+#define TD_LANES 8
+// Key down/up thresholds between the noise floor and the tone level
+#define TD_ON_FRACTION 0.5f
+#define TD_OFF_FRACTION 0.3f
+// Edges are timed where the level crosses this fraction, the middle of
+// a symmetric key shaping ramp, so key down and key up are not biased
+// apart by the hysteresis
+#define TD_EDGE_FRACTION 0.5f
+// Default minimum tone level that keys, -40 dBFS
+#define TD_MIN_LEVEL 0.01f
+// Largest drift between the sound card clock and KeyClock that the
+// capture time anchor follows
+#define TD_ANCHOR_LEAK_PPM 200
+
+// Keying from a CW tone on an audio input, e.g. an SDR or a soft keyer
+// through a loopback device. Push mode sink for QAudioInput: the 16 bit
+// samples are cut in blocks of TD_BLOCK_US and the level at the tone
+// frequency is measured with a Hann windowed single bin DFT, the same
+// result as a Goertzel filter but without its serial recursion. The key
+// follows the level with hysteresis between a tracked noise floor and a
+// tracked tone level, and edge times are interpolated between the block
+// centres to well below a block. Only the first channel is used.
+class ToneDetector : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    ToneDetector(const QAudioFormat &format, KeyEdgeHandler *handler, QObject *parent = nullptr);
+
+    void setFrequency(int hz);
+    int frequency() const { return toneHz; }
+    // Fraction of full scale
+    void setMinLevel(float level) { minLevel = level; }
+    void reset();
+
+    // Samples of one channel, 'firstSampleUs' is the KeyClock time
+    // samples[0] was captured. writeData() estimates it from the time
+    // the samples arrive.
+    void process(const qint16 *samples, int count, qint64 firstSampleUs);
+
+    bool isKeyDown() const { return keyDown; }
+    // Tone level of the last block, fraction of full scale
+    float level() const { return lastLevel; }
+    // KeyClock time of the end of the last analysed block
+    qint64 analysedUntilUs() const { return analysedUs; }
+    int blockSamples() const { return blockLength; }
+
+    // Statistics
+    quint64 samplesProcessed() const { return sampleCnt; }
+    qint64 busyNs() const { return busyTimeNs; }
+    int edgeCount() const { return edges; }
+    void resetStatistics();
+
+    bool isSequential() const override { return true; }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    void analyseBlock();
+
+    KeyEdgeHandler *edgeHandler;
+    int sampleRate;
+    int channels;
+    int toneHz = 700;
+    int blockLength;
+    // Block length rounded up to whole lanes, the tail of the tables is 0
+    int paddedLength;
+    QVector<float> cosTable;
+    QVector<float> sinTable;
+    QVector<float> block;
+    QVector<qint16> channelBuffer;
+    int blockPos = 0;
+    qint64 blockStartUs = 0;
+    float minLevel = TD_MIN_LEVEL;
+    float peakLevel = 0;
+    float floorLevel = -1;
+    float lastLevel = 0;
+    qint64 lastCentreUs = 0;
+    bool keyDown = false;
+    qint64 lastEdgeUs = 0;
+    qint64 analysedUs = 0;
+    // Capture time of the stream's first sample
+    bool anchored = false;
+    qint64 anchorUs = 0;
+    quint64 streamSamples = 0;
+    quint64 sampleCnt = 0;
+    qint64 busyTimeNs = 0;
+    int edges = 0;
+};
+
+#endif // TONEDETECTOR_H
@@ -0,0 +1,252 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QElapsedTimer>
+#include <QtMath>
+#include <cstring>
+#include "tonegenerator.h"
+#include "keyclock.h"
+
+ToneGenerator::ToneGenerator(const QAudioFormat &format, QObject *parent) :
+    QIODevice(parent)
+{
+    sampleRate = format.sampleRate();
+
+    // One period of the sine, with a guard entry so the interpolation
+    // never has to wrap the index
+    for (int i=0; i<TG_TABLE_SIZE; i++) {
+        wavetable[i] = float(qSin((2.0 * M_PI * i) / TG_TABLE_SIZE) * 32767.0);
+    }
+    wavetable[TG_TABLE_SIZE] = wavetable[0];
+
+    // Raised cosine ramp used both for attack (walked upwards) and
+    // release (walked downwards), avoids key clicks in the side tone
+    rampLength = qMax(1, (sampleRate * TG_RAMP_MS) / 1000);
+    rampTable.resize(rampLength + 1);
+    for (int i=0; i<=rampLength; i++) {
+        rampTable[i] = float(0.5 - 0.5 * qCos((M_PI * i) / rampLength));
+    }
+
+    setFrequency(700);
+    setVolume(1.0);
+    keyed.storeRelease(0);
+    timedGating.storeRelease(0);
+    periodUs.storeRelease(0);
+    queuedUs.storeRelease(0);
+    resetEdgeLatency();
+    open(QIODevice::ReadOnly);
+}
+
+void ToneGenerator::setFrequency(int hz)
+{
+    // Only the phase increment changes, the running phase is kept so
+    // there is no discontinuity in the waveform
+    phaseInc.storeRelease(quint32((hz * 4294967296.0) / sampleRate));
+}
+
+void ToneGenerator::setVolume(qreal linearVolume)
+{
+    volume.storeRelease(int(qBound(0.0, linearVolume, 1.0) * 65536.0));
+}
+
+void ToneGenerator::setKeyed(bool down)
+{
+    setKeyed(down, KeyClock::nowNs());
+}
+
+void ToneGenerator::setKeyed(bool down, qint64 edgeNs)
+{
+    QMutexLocker locker(&gateLock);
+    if ( (keyed.loadAcquire() != 0) == down )
+        return;
+    keyed.storeRelease(down ? 1 : 0);
+    int head = gateHead.loadAcquire();
+    int next = (head + 1) % TG_GATE_QUEUE;
+    if ( next == gateTail.loadAcquire() ) {
+        // Audio has stalled, the edge is picked up from 'keyed' instead
+        return;
+    }
+    gateQueue[head].down = down;
+    gateQueue[head].edgeNs = edgeNs;
+    gateHead.storeRelease(next);
+}
+
+bool ToneGenerator::isKeyed() const
+{
+    return keyed.loadAcquire() != 0;
+}
+
+int ToneGenerator::avgEdgeLatencyUs() const
+{
+    int cnt = edgeLatCnt.loadAcquire();
+    if ( cnt == 0 )
+        return 0;
+    return int(edgeLatSum.loadAcquire() / cnt);
+}
+
+void ToneGenerator::resetEdgeLatency()
+{
+    edgeLatLast.storeRelease(0);
+    edgeLatMin.storeRelease(0);
+    edgeLatMax.storeRelease(0);
+    edgeLatSum.storeRelease(0);
+    edgeLatCnt.storeRelease(0);
+}
+
+void ToneGenerator::recordEdgeLatency(int us)
+{
+    int cnt = edgeLatCnt.loadAcquire();
+    if ( cnt == 0 || us < edgeLatMin.loadAcquire() )
+        edgeLatMin.storeRelease(us);
+    if ( cnt == 0 || us > edgeLatMax.loadAcquire() )
+        edgeLatMax.storeRelease(us);
+    edgeLatLast.storeRelease(us);
+    edgeLatSum.storeRelease(edgeLatSum.loadAcquire() + us);
+    edgeLatCnt.storeRelease(cnt + 1);
+}
+
+void ToneGenerator::resetStatistics()
+{
+    sampleCnt = 0;
+    callbackCnt = 0;
+    busyTimeNs = 0;
+}
+
+qint64 ToneGenerator::bytesAvailable() const
+{
+    // The tone never runs out, report 100mS worth of samples
+    return (sampleRate / 10) * qint64(sizeof(qint16)) + QIODevice::bytesAvailable();
+}
+
+qint64 ToneGenerator::readData(char *data, qint64 maxlen)
+{
+    QElapsedTimer t;
+    t.start();
+    int samples = int(maxlen / qint64(sizeof(qint16)));
+    qint64 nowNs = KeyClock::nowNs();
+    int period = periodUs.loadAcquire();
+    if ( metrics && period > 0 && lastBlockNs >= 0 ) {
+        metrics->record(KM_WAKE_AUDIO, qMax(Q_INT64_C(0), (nowNs - lastBlockNs) / 1000 - period));
+    }
+    // Without a period the output is being set up, start over
+    lastBlockNs = (period > 0) ? nowNs : -1;
+    render(reinterpret_cast<qint16 *>(data), samples, nowNs);
+    if ( soundIdx >= 0 ) {
+        // The block is handed over now, the first sound plays later in it
+        // and after what the device has queued in front of it
+        qint64 ns = KeyClock::nowNs() - soundEdgeNs + (qint64(soundIdx) * 1000000000) / sampleRate;
+        recordEdgeLatency(int(ns / 1000) + queuedUs.loadAcquire());
+        soundIdx = -1;
+    }
+    sampleCnt += quint64(samples);
+    callbackCnt++;
+    busyTimeNs += t.nsecsElapsed();
+    return qint64(samples) * qint64(sizeof(qint16));
+}
+
+qint64 ToneGenerator::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(len);
+    return 0;
+}
+
+void ToneGenerator::render(qint16 *out, int samples, qint64 nowNs)
+{
+    // The block covers the key input time from one block ago until now
+    const qint64 blockStartNs = nowNs - (qint64(samples) * 1000000000) / sampleRate;
+    const bool timed = (timedGating.loadAcquire() != 0);
+    int pos = 0;
+
+    while ( gateTail.loadAcquire() != gateHead.loadAcquire() ) {
+        int tail = gateTail.loadAcquire();
+        const GateEvent &ev = gateQueue[tail];
+        int idx = pos;
+        if ( timed ) {
+            qint64 offs = ((ev.edgeNs - blockStartNs) * sampleRate) / 1000000000;
+            idx = int(qBound(qint64(pos), offs, qint64(samples)));
+            if ( idx >= samples )
+                break;      // Belongs to the next block
+        }
+        renderGated(out, pos, idx);
+        pos = idx;
+        gateDown = ev.down;
+        // Measured when it is heard, a short tap may end before that
+        edgeNs = ev.down ? ev.edgeNs : -1;
+        gateTail.storeRelease((tail + 1) % TG_GATE_QUEUE);
+    }
+    // Catch up if edges were dropped on a full queue. A producer holding
+    // the lock has set keyed but not queued its edge yet, the edge comes
+    // with the next block.
+    if ( gateLock.tryLock() ) {
+        if ( gateTail.loadAcquire() == gateHead.loadAcquire() ) {
+            gateDown = (keyed.loadAcquire() != 0);
+        }
+        gateLock.unlock();
+    }
+    renderGated(out, pos, samples);
+}
+
+// Render from..to of the block, noting the first non-zero sample after
+// a key down edge
+void ToneGenerator::renderGated(qint16 *out, int from, int to)
+{
+    renderSpan(&out[from], to - from);
+    if ( edgeNs < 0 )
+        return;
+    for (int i=from; i<to; i++) {
+        if ( out[i] != 0 ) {
+            soundIdx = i;
+            soundEdgeNs = edgeNs;
+            edgeNs = -1;
+            return;
+        }
+    }
+}
+
+void ToneGenerator::renderSpan(qint16 *out, int samples)
+{
+    const quint32 inc = phaseInc.loadAcquire();
+    const float vol = float(volume.loadAcquire()) / 65536.0f;
+    const bool down = gateDown;
+    const float fracScale = 1.0f / float(1 << (32 - TG_TABLE_BITS));
+    int i = 0;
+
+    while ( i < samples ) {
+        if ( !down && rampPos == 0 ) {
+            // Silent, just keep the oscillator running
+            memset(&out[i], 0, size_t(samples - i) * sizeof(qint16));
+            phase += inc * quint32(samples - i);
+            break;
+        }
+        if ( down && rampPos < rampLength ) {
+            rampPos++;
+        } else if ( !down ) {
+            rampPos--;
+        }
+        quint32 idx = phase >> (32 - TG_TABLE_BITS);
+        float frac = float(phase & ((1u << (32 - TG_TABLE_BITS)) - 1)) * fracScale;
+        float s = wavetable[idx] + (wavetable[idx + 1] - wavetable[idx]) * frac;
+        out[i] = qint16(s * rampTable[rampPos] * vol);
+        phase += inc;
+        i++;
+    }
+}
@@ -0,0 +1,140 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef TONEGENERATOR_H
+#define TONEGENERATOR_H
+
+#include <QIODevice>
+#include <QAtomicInt>
+#include <QAudioFormat>
+#include <QVector>
+#include <QMutex>
+#include "keymetrics.h"
+
+// Wavetable oscillator, 2^TG_TABLE_BITS entries per period
+#define TG_TABLE_BITS 10
+#define TG_TABLE_SIZE (1 << TG_TABLE_BITS)
+// Length of the raised cosine attack and release ramps
+#define TG_RAMP_MS 5
+// Key edges that can be queued between two audio callbacks
+#define TG_GATE_QUEUE 16
+
+// Pull mode side tone source for QAudioOutput. Samples are produced on
+// demand from a phase accumulator, so frequency and volume can be changed
+// at any time without rebuilding a buffer and without phase jumps.
+// Keying is done by gating the tone with shaped ramps, the audio stream
+// itself is left running.
+class ToneGenerator : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    ToneGenerator(const QAudioFormat &format, QObject *parent = nullptr);
+
+    void setFrequency(int hz);
+    void setVolume(qreal linearVolume);
+    void setKeyed(bool down);
+    void setKeyed(bool down, qint64 edgeNs);
+    bool isKeyed() const;
+
+    // With timed gating every key edge is placed at its own sample
+    // position in the next block, using the KeyClock time of the edge.
+    // This costs one period of latency but removes the jitter of the
+    // audio callback, used in low latency mode with small periods.
+    void setTimedGating(bool on) { timedGating.storeRelease(on ? 1 : 0); }
+
+    // Key down edge to the first non-zero tone sample, in microseconds:
+    // when its block was handed to the audio device plus its place in
+    // the block, plus the audio queued in the device buffer at the time.
+    int lastEdgeLatencyUs() const { return edgeLatLast.loadAcquire(); }
+    int minEdgeLatencyUs() const { return edgeLatMin.loadAcquire(); }
+    int maxEdgeLatencyUs() const { return edgeLatMax.loadAcquire(); }
+    int avgEdgeLatencyUs() const;
+    int edgeLatencyCount() const { return edgeLatCnt.loadAcquire(); }
+    void resetEdgeLatency();
+
+    // How much later than one audio period after the previous one each
+    // block is asked for, recorded as the side tone wake up latency.
+    // Set before the audio output is started.
+    void setMetrics(KeyMetrics *m) { metrics = m; }
+    void setPeriodUs(int us) { periodUs.storeRelease(us); }
+    // Audio queued in the device buffer, set from the output's notify
+    // and added to each edge latency as it is recorded
+    void setQueuedUs(int us) { queuedUs.storeRelease(us); }
+
+    // Statistics, updated by every readData() call
+    quint64 samplesGenerated() const { return sampleCnt; }
+    quint64 callbackCount() const { return callbackCnt; }
+    qint64 busyNs() const { return busyTimeNs; }
+    void resetStatistics();
+
+    qint64 bytesAvailable() const override;
+    bool isSequential() const override { return true; }
+
+protected:
+    qint64 readData(char *data, qint64 maxlen) override;
+    qint64 writeData(const char *data, qint64 len) override;
+
+private:
+    struct GateEvent {
+        bool down;
+        qint64 edgeNs;
+    };
+    void render(qint16 *out, int samples, qint64 nowNs);
+    void renderGated(qint16 *out, int from, int to);
+    void renderSpan(qint16 *out, int samples);
+    void recordEdgeLatency(int us);
+
+    int sampleRate;
+    float wavetable[TG_TABLE_SIZE + 1];
+    QVector<float> rampTable;
+    int rampLength;
+    int rampPos = 0;
+    quint32 phase = 0;
+    QAtomicInteger<quint32> phaseInc;
+    QAtomicInt volume;          // Q16 fixed point, 65536 == full scale
+    QAtomicInt keyed;
+    QAtomicInt timedGating;
+    bool gateDown = false;
+    qint64 edgeNs = -1;         // Key down edge not heard yet
+    qint64 soundEdgeNs = 0;     // Edge of the first sound in this block
+    int soundIdx = -1;
+    // Queue of key edges, the audio side reads it without locking,
+    // producers (key button, key port) are serialised by gateLock
+    QMutex gateLock;
+    GateEvent gateQueue[TG_GATE_QUEUE];
+    QAtomicInt gateHead;
+    QAtomicInt gateTail;
+    QAtomicInt edgeLatLast;
+    QAtomicInt edgeLatMin;
+    QAtomicInt edgeLatMax;
+    QAtomicInt edgeLatCnt;
+    QAtomicInteger<qint64> edgeLatSum;
+    KeyMetrics *metrics = nullptr;
+    QAtomicInt periodUs;
+    QAtomicInt queuedUs;
+    qint64 lastBlockNs = -1;
+    quint64 sampleCnt = 0;
+    quint64 callbackCnt = 0;
+    qint64 busyTimeNs = 0;
+};
+
+#endif // TONEGENERATOR_H
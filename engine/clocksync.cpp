@@ -0,0 +1,142 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <algorithm>
+#include <cmath>
+#include "clocksync.h"
+
+ClockSync::ClockSync()
+{
+    reset();
+}
+
+void ClockSync::reset()
+{
+    count = 0;
+    newest = -1;
+    minRttUs = 0;
+    base = 0.0;
+    skew = 0.0;
+    refUs = 0.0;
+    residualVar = 0.0;
+    sxx = 0.0;
+    used = 0;
+}
+
+void ClockSync::addSample(qint64 sendUs, qint64 recvUs, qint64 offsetUs)
+{
+    Sample s;
+    s.rttUs = recvUs - sendUs;
+    if ( s.rttUs < 0 )
+        return;
+    s.midUs = sendUs + s.rttUs / 2;
+    s.offsetUs = offsetUs;
+    s.bucket = s.midUs / CS_BUCKET_US;
+    if ( count > 0 && samples[newest].bucket == s.bucket ) {
+        // Keep only the fastest sample of the bucket
+        if ( s.rttUs >= samples[newest].rttUs )
+            return;
+        samples[newest] = s;
+    } else {
+        newest = (newest + 1) % CS_BUCKETS;
+        samples[newest] = s;
+        if ( count < CS_BUCKETS )
+            count++;
+    }
+    fit();
+}
+
+void ClockSync::fit()
+{
+    for (int i=0; i<count; i++) {
+        rtts[i] = samples[i].rttUs;
+    }
+    minRttUs = *std::min_element(rtts, rtts + count);
+    std::nth_element(rtts, rtts + count / 2, rtts + count);
+    qint64 limit = std::max(rtts[count / 2], minRttUs + CS_RTT_MARGIN_US);
+
+    double sx = 0.0, sy = 0.0;
+    double first = 0.0, last = 0.0;
+    int n = 0;
+    // Relative to the newest sample to keep the numbers small
+    const double t0 = double(samples[newest].midUs);
+    for (int i=0; i<count; i++) {
+        if ( samples[i].rttUs > limit )
+            continue;
+        double x = double(samples[i].midUs) - t0;
+        if ( n == 0 || x < first ) first = x;
+        if ( n == 0 || x > last ) last = x;
+        sx += x;
+        sy += double(samples[i].offsetUs);
+        n++;
+    }
+    double xm = sx / n;
+    double ym = sy / n;
+    double sxy = 0.0;
+    sxx = 0.0;
+    for (int i=0; i<count; i++) {
+        if ( samples[i].rttUs > limit )
+            continue;
+        double dx = double(samples[i].midUs) - t0 - xm;
+        sxx += dx * dx;
+        sxy += dx * (double(samples[i].offsetUs) - ym);
+    }
+    used = n;
+    refUs = t0 + xm;
+    base = ym;
+    if ( n < 3 || (last - first) < double(CS_MIN_SPAN_US) || sxx <= 0.0 ) {
+        // Not enough to see the skew yet, trust the fastest sample
+        skew = 0.0;
+        residualVar = 0.0;
+        for (int i=0; i<count; i++) {
+            if ( samples[i].rttUs == minRttUs ) {
+                base = double(samples[i].offsetUs);
+                refUs = double(samples[i].midUs);
+            }
+        }
+        used = 1;
+        return;
+    }
+    skew = sxy / sxx;
+    double ss = 0.0;
+    for (int i=0; i<count; i++) {
+        if ( samples[i].rttUs > limit )
+            continue;
+        double r = double(samples[i].offsetUs) - (base + skew * (double(samples[i].midUs) - refUs));
+        ss += r * r;
+    }
+    residualVar = ss / (n - 2);
+}
+
+qint64 ClockSync::offsetUs(qint64 localUs) const
+{
+    if ( count == 0 )
+        return 0;
+    return qint64(std::llround(base + skew * (double(localUs) - refUs)));
+}
+
+qint64 ClockSync::uncertaintyUs(qint64 localUs) const
+{
+    if ( used < 3 )
+        return minRttUs / 2;
+    double dx = double(localUs) - refUs;
+    return qint64(std::sqrt(residualVar * (1.0 / used + (dx * dx) / sxx)));
+}
@@ -0,0 +1,88 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <QtGlobal>
+
+// Ping samples are kept per CS_BUCKET_US, the fastest one in each
+#define CS_BUCKETS 64
+#define CS_BUCKET_US Q_INT64_C(10000000)
+// Samples this much slower than the fastest are still trusted
+#define CS_RTT_MARGIN_US 1000
+// Time span needed before the skew is estimated
+#define CS_MIN_SPAN_US Q_INT64_C(30000000)
+
+// NTP style estimate of the server clock relative to the local KeyClock
+// time base. Every ping gives an offset sample, (server time) - (middle
+// of the round trip). The fastest sample of every 10 s is kept, the
+// slower half of those is ignored as they carry queueing delay, and a
+// line is fitted through the rest. The slope is the skew between the two
+// clocks, so the offset can be predicted between and long after pings.
+class ClockSync
+{
+public:
+    ClockSync();
+
+    void reset();
+    // Local send and receive time of a ping and the server's offset
+    // at the middle of it, all in microseconds
+    void addSample(qint64 sendUs, qint64 recvUs, qint64 offsetUs);
+
+    bool isValid() const { return count > 0; }
+    int sampleCount() const { return count; }
+    // Server time minus local time at localUs
+    qint64 offsetUs(qint64 localUs) const;
+    // Server clock rate relative to the local clock, parts per million
+    double skewPpm() const { return skew * 1e6; }
+    // Standard error of offsetUs(localUs) from the scatter of the fit.
+    // With too few samples half the fastest round trip is returned, the
+    // most the path asymmetry can move the offset.
+    qint64 uncertaintyUs(qint64 localUs) const;
+    // Half of the fastest round trip seen, the one way delay a key
+    // event can be expected to have at best
+    qint64 minOneWayUs() const { return minRttUs / 2; }
+
+private:
+    struct Sample {
+        qint64 midUs;
+        qint64 offsetUs;
+        qint64 rttUs;
+        qint64 bucket;
+    };
+    void fit();
+
+    Sample samples[CS_BUCKETS];
+    qint64 rtts[CS_BUCKETS];
+    int count;
+    int newest;
+    qint64 minRttUs;
+    // offset(t) = base + skew * (t - refUs)
+    double base;
+    double skew;
+    double refUs;
+    double residualVar;
+    double sxx;
+    int used;
+};
+
+#endif // CLOCKSYNC_H
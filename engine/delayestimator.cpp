@@ -0,0 +1,90 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <algorithm>
+#include <cmath>
+#include "delayestimator.h"
+
+DelayEstimator::DelayEstimator()
+{
+    reset();
+}
+
+void DelayEstimator::reset()
+{
+    count = 0;
+    next = 0;
+    mean = 0.0;
+    deviation = 0.0;
+}
+
+void DelayEstimator::addSample(qint64 oneWayUs)
+{
+    if ( count == 0 ) {
+        mean = double(oneWayUs);
+        deviation = double(oneWayUs) / 2.0;
+    } else {
+        // Gains 1/8 and 1/4 as in RFC 6298
+        double err = double(oneWayUs) - mean;
+        mean += err / 8.0;
+        deviation += (std::fabs(err) - deviation) / 4.0;
+    }
+    window[next] = oneWayUs;
+    next = (next + 1) % DE_WINDOW;
+    if ( count < DE_WINDOW )
+        count++;
+}
+
+qint64 DelayEstimator::minUs() const
+{
+    if ( count == 0 )
+        return 0;
+    return *std::min_element(window, window + count);
+}
+
+qint64 DelayEstimator::maxUs() const
+{
+    if ( count == 0 )
+        return 0;
+    return *std::max_element(window, window + count);
+}
+
+qint64 DelayEstimator::quantileUs(double p) const
+{
+    if ( count == 0 )
+        return 0;
+    int k = qBound(0, int(std::ceil(p * count)) - 1, count - 1);
+    std::copy(window, window + count, scratch);
+    std::nth_element(scratch, scratch + k, scratch + count);
+    return scratch[k];
+}
+
+qint64 DelayEstimator::recommendedDelayUs(double onTime) const
+{
+    if ( count == 0 )
+        return 0;
+    qint64 fastest = minUs();
+    if ( count < DE_MIN_SAMPLES ) {
+        // Too few samples for a percentile, be generous
+        return qMax(Q_INT64_C(0), qint64(mean + 4.0 * deviation) - fastest);
+    }
+    return quantileUs(onTime) - fastest;
+}
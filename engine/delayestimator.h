@@ -0,0 +1,65 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef DELAYESTIMATOR_H
+#define DELAYESTIMATOR_H
+
+#include <QtGlobal>
+
+// One way delay samples kept for the percentile estimate
+#define DE_WINDOW 256
+// Below this many samples the EWMA mean and deviation are used
+#define DE_MIN_SAMPLES 8
+
+// Always on estimate of the one way network delay. Keeps an EWMA of
+// mean and mean deviation (as TCP does for its RTO) and a sliding window
+// of the latest samples for percentiles. From that it recommends the
+// smallest key delay that gets a key event to the server in time with
+// a given probability, i.e. how far above the fastest packets the slow
+// ones arrive.
+class DelayEstimator
+{
+public:
+    DelayEstimator();
+
+    void reset();
+    void addSample(qint64 oneWayUs);
+
+    int sampleCount() const { return count; }
+    qint64 meanUs() const { return qint64(mean); }
+    qint64 deviationUs() const { return qint64(deviation); }
+    qint64 minUs() const;
+    qint64 maxUs() const;
+    // p in 0..1 over the sample window
+    qint64 quantileUs(double p) const;
+    // Smallest key delay for the on time probability onTime (0..1)
+    qint64 recommendedDelayUs(double onTime) const;
+
+private:
+    qint64 window[DE_WINDOW];
+    mutable qint64 scratch[DE_WINDOW];
+    int count;
+    int next;
+    double mean;
+    double deviation;
+};
+
+#endif // DELAYESTIMATOR_H
@@ -0,0 +1,17 @@
+# Link an application with the key engine library, include from its .pro
+
+QT += network serialport
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+win32:CONFIG(release, debug|release): KEYENGINE_DIR = $$OUT_PWD/../engine/release
+else:win32:CONFIG(debug, debug|release): KEYENGINE_DIR = $$OUT_PWD/../engine/debug
+else: KEYENGINE_DIR = $$OUT_PWD/../engine
+
+LIBS += -L$$KEYENGINE_DIR -lkeyengine
+win32-g++: PRE_TARGETDEPS += $$KEYENGINE_DIR/libkeyengine.a
+else:win32: PRE_TARGETDEPS += $$KEYENGINE_DIR/keyengine.lib
+else: PRE_TARGETDEPS += $$KEYENGINE_DIR/libkeyengine.a
+
+win32: LIBS += -lws2_32
@@ -0,0 +1,58 @@
+QT       = core network serialport
+
+TEMPLATE = lib
+CONFIG += staticlib c++11
+TARGET = keyengine
+
+# You can make your code fail to compile if it uses deprecated APIs.
+# In order to do so, uncomment the following line.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+SOURCES += \
+    clocksync.cpp \
+    delayestimator.cpp \
+    iambickeyer.cpp \
+    keyclock.cpp \
+    keyengine.cpp \
+    keyinputthread.cpp \
+    keymetrics.cpp \
+    keypathtrace.cpp \
+    keyportwatcher.cpp \
+    keyprotocol.cpp \
+    keysender.cpp \
+    keysession.cpp \
+    keytrace.cpp \
+    latencyhistogram.cpp \
+    loopbackserver.cpp \
+    metricsserver.cpp \
+    netimpairment.cpp \
+    processstats.cpp \
+    realtime.cpp \
+    sockettimestamps.cpp \
+    textkeyer.cpp \
+    udpkeystream.cpp
+
+HEADERS += \
+    clocksync.h \
+    delayestimator.h \
+    iambickeyer.h \
+    keyclock.h \
+    keyengine.h \
+    keyinputthread.h \
+    keymetrics.h \
+    keypathtrace.h \
+    keyportwatcher.h \
+    keyprotocol.h \
+    keysender.h \
+    keysession.h \
+    keytrace.h \
+    latencyhistogram.h \
+    loopbackserver.h \
+    metricsserver.h \
+    morse.h \
+    netimpairment.h \
+    processstats.h \
+    realtime.h \
+    sockettimestamps.h \
+    textkeyer.h \
+    udpkeystream.h
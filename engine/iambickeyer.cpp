@@ -0,0 +1,86 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+
+#include "iambickeyer.h"
+
+void IambicKeyer::reset()
+{
+    sending = false;
+    ditLatched = false;
+    dahLatched = false;
+    prevDit = false;
+    prevDah = false;
+}
+
+bool IambicKeyer::update(bool dit, bool dah, qint64 nowUs, KeyerElement *element)
+{
+    bool started = false;
+    if ( !sending ) {
+        if ( dit || dah ) {
+            // A dit first when both are pressed at once
+            start(!dit, nowUs, element);
+            started = true;
+        }
+    } else if ( nowUs >= nextStartUs ) {
+        bool other = lastDah ? (dit || ditLatched) : (dah || dahLatched);
+        bool same = lastDah ? dah : dit;
+        // Woken much too late the timing is lost anyway, rather than
+        // sending elements that should have started long ago
+        qint64 atUs = (nowUs - nextStartUs > unitUs()) ? nowUs : nextStartUs;
+        if ( other ) {
+            start(!lastDah, atUs, element);
+            started = true;
+        } else if ( same ) {
+            start(lastDah, atUs, element);
+            started = true;
+        } else {
+            sending = false;
+        }
+    }
+    if ( sending ) {
+        // The other lever while this element and its space are sent
+        if ( lastDah ) {
+            if ( dit && (modeB || (ditMemory && !prevDit)) )
+                ditLatched = true;
+        } else {
+            if ( dah && (modeB || (dahMemory && !prevDah)) )
+                dahLatched = true;
+        }
+    }
+    prevDit = dit;
+    prevDah = dah;
+    return started;
+}
+
+void IambicKeyer::start(bool dah, qint64 atUs, KeyerElement *element)
+{
+    qint64 unit = unitUs();
+    qint64 ditMark = unit * weight / 50;
+    qint64 mark = dah ? 2 * unit + ditMark : ditMark;
+    element->downUs = atUs;
+    element->upUs = atUs + mark;
+    nextStartUs = element->upUs + 2 * unit - ditMark;
+    lastDah = dah;
+    sending = true;
+    ditLatched = false;
+    dahLatched = false;
+}
@@ -0,0 +1,89 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+
+#ifndef IAMBICKEYER_H
+#define IAMBICKEYER_H
+
+#include <QtGlobal>
+
+// Weighting in percent of the standard mark/space ratio, 50 is standard
+#define IK_WEIGHT_MIN 25
+#define IK_WEIGHT_MAX 75
+
+// An element of the paddle keyer, known in full when it starts
+struct KeyerElement {
+    qint64 downUs;
+    qint64 upUs;
+};
+
+// Iambic keyer for a paddle with a dit and a dah lever, driven by the
+// lever positions and the time. Squeezing both levers sends alternating
+// elements. What comes next is decided when the element and the space
+// after it have been sent, from the levers at that moment and what was
+// latched while the element was sent:
+//  - dit and dah memory: the other lever pressed during the element is
+//    remembered and sent after it, even if it was released in time
+//  - mode B: the other lever held at any time during the element, also
+//    in a squeeze, is remembered, so releasing a squeeze sends one more
+//    element. Mode A stops after the current element.
+// Weighting lengthens the marks and shortens the spaces by the same
+// time, a dit and its space always take two units.
+class IambicKeyer
+{
+public:
+    void setWpm(int wpm) { speedWpm = qMax(1, wpm); }
+    int wpm() const { return speedWpm; }
+    void setWeight(int percent) { weight = qBound(IK_WEIGHT_MIN, percent, IK_WEIGHT_MAX); }
+    void setModeB(bool on) { modeB = on; }
+    void setMemory(bool dit, bool dah) { ditMemory = dit; dahMemory = dah; }
+    qint64 unitUs() const { return 1200000 / speedWpm; }
+
+    // Nothing is sent and nothing is due
+    bool isIdle() const { return !sending; }
+    // When update() has to be called again at the latest, -1 when only
+    // a lever change matters
+    qint64 nextUs() const { return sending ? nextStartUs : -1; }
+    void reset();
+
+    // The levers at nowUs. Returns true with the element to send when
+    // one starts, from idle at nowUs, otherwise right after the space
+    // of the previous one.
+    bool update(bool dit, bool dah, qint64 nowUs, KeyerElement *element);
+
+private:
+    void start(bool dah, qint64 atUs, KeyerElement *element);
+
+    int speedWpm = 20;
+    int weight = 50;
+    bool modeB = false;
+    bool ditMemory = true;
+    bool dahMemory = true;
+    bool sending = false;
+    bool lastDah = false;
+    qint64 nextStartUs = 0;
+    bool ditLatched = false;
+    bool dahLatched = false;
+    bool prevDit = false;
+    bool prevDah = false;
+};
+
+#endif // IAMBICKEYER_H
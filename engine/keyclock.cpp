@@ -0,0 +1,81 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QAtomicInteger>
+#include "keyclock.h"
+
+static QElapsedTimer startedTimer()
+{
+    QElapsedTimer t;
+    t.start();
+    return t;
+}
+
+// Replay time in ns and its epoch anchor, -1 when running on the real
+// clock
+static QAtomicInteger<qint64> replayNs(-1);
+static QAtomicInteger<qint64> replayAnchorUs(0);
+
+qint64 KeyClock::nowNs()
+{
+    qint64 replay = replayNs.loadAcquire();
+    if ( replay >= 0 )
+        return replay;
+    // Initialised on first use, thread safe since C++11
+    static const QElapsedTimer timer = startedTimer();
+    return timer.nsecsElapsed();
+}
+
+qint64 KeyClock::epochUs()
+{
+    return epochAnchorUs() + nowUs();
+}
+
+qint64 KeyClock::epochAnchorUs()
+{
+    if ( replayNs.loadAcquire() >= 0 )
+        return replayAnchorUs.loadAcquire();
+    static const qint64 anchorUs = QDateTime::currentMSecsSinceEpoch() * 1000 - nowUs();
+    return anchorUs;
+}
+
+void KeyClock::startReplay(qint64 epochAnchorUs, qint64 nowUs)
+{
+    replayAnchorUs.storeRelease(epochAnchorUs);
+    replayNs.storeRelease(nowUs * 1000);
+}
+
+void KeyClock::setReplayUs(qint64 nowUs)
+{
+    replayNs.storeRelease(nowUs * 1000);
+}
+
+void KeyClock::stopReplay()
+{
+    replayNs.storeRelease(-1);
+}
+
+bool KeyClock::isReplaying()
+{
+    return replayNs.loadAcquire() >= 0;
+}
@@ -0,0 +1,49 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYCLOCK_H
+#define KEYCLOCK_H
+
+#include <QtGlobal>
+
+// Monotonic time base shared by key sampling, side tone and network.
+// Counts from the first call, is not affected by wall clock steps.
+class KeyClock
+{
+public:
+    static qint64 nowNs();
+    static qint64 nowUs() { return nowNs() / 1000; }
+    // Microseconds since the epoch, following nowUs() from the wall clock
+    // time of the first call
+    static qint64 epochUs();
+    // epochUs() minus nowUs()
+    static qint64 epochAnchorUs();
+
+    // Replaying a trace, the whole process then runs on the time set
+    // here instead of the real clock. epochAnchorUs is epoch minus
+    // KeyClock time of the recording.
+    static void startReplay(qint64 epochAnchorUs, qint64 nowUs);
+    static void setReplayUs(qint64 nowUs);
+    static void stopReplay();
+    static bool isReplaying();
+};
+
+#endif // KEYCLOCK_H
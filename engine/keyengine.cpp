@@ -0,0 +1,809 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTimer>
+#include <QSettings>
+#include <QSerialPort>
+#include <QStringList>
+#include <QDebug>
+#include <cstring>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include "keyengine.h"
+#include "keyclock.h"
+#include "keypathtrace.h"
+#include "metricsserver.h"
+#include "realtime.h"
+
+KeyEngine::KeyEngine(KeyEngineHandler *handler) :
+    handler(handler),
+    keyInput(this)
+{
+    tracing.storeRelease(0);
+    keySeq.storeRelease(0);
+    liveKeyDown.storeRelease(0);
+    primary = new KeySession(this);
+    primary->setTrace(&trace, &tracing);
+    primary->setMetrics(&keyMetrics);
+    sessions.append(primary);
+    keyInput.setMetrics(&keyMetrics);
+    // The key port is polled on this thread when there is no key thread
+    KeyPathTrace::nameThread("engine");
+
+    keySerialPort = new QSerialPort();
+
+    // Polls the key port when it is not sampled on its own thread, and
+    // drives pings and repeats
+    timer = new QTimer();
+    QObject::connect(timer, &QTimer::timeout, [this]() { tick(); });
+    timer->start(KE_TICK_MS);
+    portWatcher.startWatching();
+}
+
+KeyEngine::~KeyEngine()
+{
+    // Closing the sockets below is not reported
+    handler = nullptr;
+    timer->stop();
+    stopTrace();
+    closeKeyPort();
+    portWatcher.stopWatching();
+    qDeleteAll(sessions);
+    delete metricsServer;
+    delete timer;
+    delete keySerialPort;
+}
+
+void KeyEngine::loadSettings(QSettings &settings)
+{
+    udpRedundancy = settings.value("UdpRedundancy", 4).toInt();
+    QString str = settings.value("StallPolicy", "Flush").toString();
+    KeySender::StallPolicy policy = !QString::compare(str, "Drop") ? KeySender::DropExpired : KeySender::FlushBulk;
+    double onTime = settings.value("OnTimePercent", 99.0).toDouble() / 100.0;
+    int batch = settings.value("BatchPercent", 0).toInt();
+    bool stamps = !QString::compare(settings.value("KernelTimestamps", "false").toString(), "true");
+    KeyPathTrace::setEnabled(!QString::compare(settings.value("KeyPathTrace", "true").toString(), "true"));
+    foreach (KeySession *session, sessions) {
+        session->setRedundancy(udpRedundancy);
+        session->setStallPolicy(policy);
+        session->setOnTimeTarget(onTime);
+        session->setBatchPercent(batch);
+        session->setKernelTimestamps(stamps);
+    }
+    setKeyCode(settings.value("KeyCode", 0).toInt());
+    keyPortStableId = settings.value("KeyPortId", "").toString();
+    setKeyerWpm(settings.value("KeyerWpm", 20).toInt());
+    setKeyerCharWpm(settings.value("KeyerCharWpm", 0).toInt());
+    setKeyerLeadMs(settings.value("KeyerLeadMs", KE_KEYER_LEAD_MS).toInt());
+    setPaddleWeight(settings.value("PaddleWeight", 50).toInt());
+    setPaddleMemory(!QString::compare(settings.value("PaddleDitMemory", "true").toString(), "true"),
+                    !QString::compare(settings.value("PaddleDahMemory", "true").toString(), "true"));
+    QString paddleStr = settings.value("Paddle", "Off").toString();
+    if ( !QString::compare(paddleStr, "IambicA") ) {
+        setPaddleMode(KeyInputThread::PaddleIambicA);
+    } else if ( !QString::compare(paddleStr, "IambicB") ) {
+        setPaddleMode(KeyInputThread::PaddleIambicB);
+    } else {
+        setPaddleMode(KeyInputThread::PaddleOff);
+    }
+    NetImpairment sim;
+    sim.setLossPercent(settings.value("SimLossPercent", 0).toDouble());
+    sim.setDelayMs(settings.value("SimDelayMs", 0).toInt());
+    sim.setJitterMs(settings.value("SimJitterMs", 0).toInt());
+    sim.setReorderPercent(settings.value("SimReorderPercent", 0).toDouble());
+    primary->setNetImpairment(sim);
+    RealTimeConfig rt;
+    rt.enabled = !QString::compare(settings.value("RealTime", "false").toString(), "true");
+    rt.roundRobin = !QString::compare(settings.value("RealTimePolicy", "FIFO").toString(), "RR");
+    rt.priority = settings.value("RealTimePriority", RT_DEFAULT_PRIORITY).toInt();
+    rt.cpu[RT_KEY] = settings.value("KeyCpu", -1).toInt();
+    rt.cpu[RT_SEND] = settings.value("SendCpu", -1).toInt();
+    rt.cpu[RT_AUDIO] = settings.value("AudioCpu", -1).toInt();
+    rt.lockMemory = !QString::compare(settings.value("LockMemory", "true").toString(), "true");
+    RealTime::configure(rt);
+    // Restarted to get the new scheduling
+    if ( keyInput.isRunning() ) {
+        setKeyThread(keyThread);
+    }
+    foreach (KeySession *session, sessions) {
+        session->restartSending();
+    }
+    setMetricsPort(quint16(settings.value("MetricsPort", 0).toUInt()));
+    QString traceFile = settings.value("TraceFile", "").toString();
+    if ( !traceFile.isEmpty() && !startTrace(traceFile) ) {
+        qDebug() << "Can't write trace" << traceFile;
+    }
+    // Additional servers as host:port or host:port/udp, comma separated
+    while ( destinationCount() > 0 ) {
+        removeDestination(0);
+    }
+    foreach (const QString &entry, settings.value("Destinations", "").toString().split(',')) {
+        QString dest = entry.trimmed();
+        if ( dest.isEmpty() )
+            continue;
+        bool udp = dest.endsWith("/udp", Qt::CaseInsensitive);
+        if ( udp ) {
+            dest.chop(4);
+        }
+        int colon = dest.lastIndexOf(':');
+        quint16 port = (colon > 0) ? dest.mid(colon + 1).toUShort() : 0;
+        if ( port == 0 || addDestination(dest.left(colon), port, udp) < 0 ) {
+            qDebug() << "Destination" << entry << "ignored";
+        }
+    }
+}
+
+void KeyEngine::saveSettings(QSettings &settings)
+{
+    settings.setValue("OnTimePercent", primary->onTimeTarget() * 100.0);
+    settings.setValue("BatchPercent", primary->batchPercent());
+    settings.setValue("KernelTimestamps", primary->kernelTimestamps() ? "true" : "false");
+    settings.setValue("KeyPathTrace", KeyPathTrace::isEnabled() ? "true" : "false");
+    if ( primary->stallPolicy() == KeySender::DropExpired ) {
+        settings.setValue("StallPolicy", "Drop");
+    } else {
+        settings.setValue("StallPolicy", "Flush");
+    }
+    settings.setValue("MetricsPort", metricsServerPort);
+    settings.setValue("KeyCode", keyInputCode);
+    settings.setValue("KeyPortId", keyPortStableId);
+    settings.setValue("KeyerWpm", textKeyer.wpm());
+    settings.setValue("KeyerCharWpm", textKeyer.charWpm());
+    settings.setValue("KeyerLeadMs", keyerLeadMs);
+    if ( paddle == KeyInputThread::PaddleIambicA ) {
+        settings.setValue("Paddle", "IambicA");
+    } else if ( paddle == KeyInputThread::PaddleIambicB ) {
+        settings.setValue("Paddle", "IambicB");
+    } else {
+        settings.setValue("Paddle", "Off");
+    }
+    settings.setValue("PaddleWeight", paddleWeightPercent);
+    settings.setValue("PaddleDitMemory", paddleDitMemory ? "true" : "false");
+    settings.setValue("PaddleDahMemory", paddleDahMemory ? "true" : "false");
+    RealTimeConfig rt = RealTime::config();
+    settings.setValue("RealTime", rt.enabled ? "true" : "false");
+    settings.setValue("RealTimePolicy", rt.roundRobin ? "RR" : "FIFO");
+    settings.setValue("RealTimePriority", rt.priority);
+    settings.setValue("KeyCpu", rt.cpu[RT_KEY]);
+    settings.setValue("SendCpu", rt.cpu[RT_SEND]);
+    settings.setValue("AudioCpu", rt.cpu[RT_AUDIO]);
+    settings.setValue("LockMemory", rt.lockMemory ? "true" : "false");
+    QStringList destinations;
+    for (int i=0; i<destinationCount(); i++) {
+        KeySession *session = destination(i);
+        destinations.append(QString("%1:%2%3").arg(session->host()).arg(session->port())
+                            .arg(session->transportUdp() ? "/udp" : ""));
+    }
+    settings.setValue("Destinations", destinations.join(","));
+}
+
+void KeyEngine::tick()
+{
+    if ( portWatcher.hasChanges() ) {
+        keyPortHotplug();
+    }
+    if ( keyPortStatus && keyLine != KeyInputThread::LineEvdev && !keyInput.isRunning() ) {
+        pollKeyPort();
+    }
+    qint64 now = KeyClock::nowUs();
+    if ( !keyerEdges.isEmpty() ) {
+        sendKeyerEdges(now);
+    }
+    foreach (KeySession *session, sessions) {
+        session->tick(now);
+    }
+}
+
+void KeyEngine::pollKeyPort()
+{
+    bool KeyIsDown;
+    qint64 now = KeyClock::nowUs();
+    if ( now < keyDebounceUntilUs )
+        return;
+    QSerialPort::PinoutSignals pinoutSignals = keySerialPort->pinoutSignals();
+    if ( keyLine == KeyInputThread::LineDSR ) {
+        KeyIsDown = (pinoutSignals & QSerialPort::DataSetReadySignal ? true : false);
+    } else {
+        KeyIsDown = (pinoutSignals & QSerialPort::ClearToSendSignal ? true : false);
+    }
+    if ( keyPortInverted )
+        KeyIsDown = !KeyIsDown;
+    if ( KeyIsDown != KeyIsDownLast ) {
+        keyDebounceUntilUs = now + keyDebounceUs;
+        KeyPathTrace::record(KPS_DETECTED, now, KeyIsDown, 0, now);
+        KeyPathTrace::record(KPS_DEBOUNCED, now, KeyIsDown);
+        keyEdge(KeyIsDown, now);
+        KeyIsDownLast = KeyIsDown;
+    }
+}
+
+void KeyEngine::connectToServer(const QString &host, quint16 port)
+{
+    primary->connectToServer(host, port);
+    for (int i=0; i<destinationCount(); i++) {
+        destination(i)->connectToServer(destination(i)->host(), destination(i)->port());
+    }
+}
+
+void KeyEngine::disconnectFromServer()
+{
+    foreach (KeySession *session, sessions) {
+        session->disconnectFromServer();
+    }
+}
+
+void KeyEngine::setOfferBinary(bool on)
+{
+    offerBinary = on;
+    foreach (KeySession *session, sessions) {
+        session->setOfferBinary(on);
+    }
+}
+
+int KeyEngine::addDestination(const QString &host, quint16 port, bool udp)
+{
+    if ( sessions.size() >= KE_MAX_SESSIONS )
+        return -1;
+    // Same settings as the main server
+    KeySession *session = new KeySession(this);
+    session->setRedundancy(udpRedundancy);
+    session->setStallPolicy(primary->stallPolicy());
+    session->setOnTimeTarget(primary->onTimeTarget());
+    session->setBatchPercent(primary->batchPercent());
+    session->setKernelTimestamps(primary->kernelTimestamps());
+    session->setOfferBinary(offerBinary);
+    session->setKeyDelayMs(primary->keyDelayMs());
+    session->setAutoKeyDelay(primary->isAutoKeyDelay());
+    session->setTransportUdp(udp);
+    session->setServer(host, port);
+    sessionsLock.lock();
+    sessions.append(session);
+    sessionsLock.unlock();
+    if ( primary->isServerOpen() ) {
+        session->connectToServer(host, port);
+    }
+    return sessions.size() - 2;
+}
+
+void KeyEngine::removeDestination(int index)
+{
+    if ( index < 0 || index >= destinationCount() )
+        return;
+    sessionsLock.lock();
+    KeySession *session = sessions.takeAt(index + 1);
+    sessionsLock.unlock();
+    delete session;
+}
+
+bool KeyEngine::openKeyPort(const QString &name)
+{
+    closeKeyPort();
+    if ( !openPort(name) )
+        return false;
+    keyPortWanted = true;
+    keyPortName = name;
+    // Keep the one from the settings until the watcher knows the port
+    QString id = portWatcher.stableId(name);
+    if ( !id.isEmpty() ) {
+        keyPortStableId = id;
+    }
+    return true;
+}
+
+void KeyEngine::closeKeyPort()
+{
+    keyPortWanted = false;
+    releaseKeyPort();
+}
+
+bool KeyEngine::openPort(const QString &name)
+{
+    if ( keyLine == KeyInputThread::LineEvdev ) {
+        keyEventHandle = KeyInputThread::openEventDevice(name);
+        keyPortStatus = keyEventHandle >= 0;
+        if ( keyPortStatus ) {
+            setKeyThread(keyThread);
+        }
+        return keyPortStatus;
+    }
+    keySerialPort->setPortName(name);
+    keySerialPort->setBaudRate(QSerialPort::Baud115200);
+    keySerialPort->setParity(QSerialPort::Parity::NoParity);
+    keySerialPort->setDataBits(QSerialPort::DataBits::Data8);
+    keySerialPort->setStopBits(QSerialPort::StopBits::OneStop);
+    keySerialPort->setFlowControl(QSerialPort::FlowControl::UnknownFlowControl);
+    keyPortStatus = keySerialPort->open(QSerialPort::OpenModeFlag::ReadWrite);
+    if ( keyPortStatus ) {
+        keySerialPort->write("The serial port is open!");
+        setKeyThread(keyThread);
+    }
+    return keyPortStatus;
+}
+
+void KeyEngine::releaseKeyPort()
+{
+    keyInput.stopSampling();
+    if ( keyEventHandle >= 0 ) {
+        KeyInputThread::closeEventDevice(keyEventHandle);
+        keyEventHandle = -1;
+    }
+    if ( keyPortStatus ) {
+        keySerialPort->close();
+        keyPortStatus = false;
+    }
+}
+
+// Close the key port when it is unplugged, and open it again when a
+// device with its stable id, or its name, is plugged in
+void KeyEngine::keyPortHotplug()
+{
+    bool input = (keyLine == KeyInputThread::LineEvdev);
+    QString node = input ? QFileInfo(keyPortName).canonicalFilePath() : keyPortName;
+    foreach (const KeyPortChange &change, portWatcher.takeChanges()) {
+        const KeyPortInfo &port = change.port;
+        if ( !keyPortWanted || port.input != input )
+            continue;
+        bool ours = (!keyPortStableId.isEmpty() && port.stableId == keyPortStableId)
+                || port.name == keyPortName || port.name == node;
+        if ( !ours )
+            continue;
+        if ( !change.added && keyPortStatus ) {
+            releaseKeyPort();
+            // Don't leave the rig keyed
+            if ( liveKeyDown.loadAcquire() != 0 ) {
+                keyEdge(false, KeyClock::nowUs());
+            }
+            KeyIsDownLast = false;
+            if ( handler ) {
+                handler->keyPortChanged(false, keyPortName);
+            }
+        } else if ( change.added && !keyPortStatus && openPort(port.name) ) {
+            // Keep a by-id link of an input device that points to it again
+            if ( !input || QFileInfo(keyPortName).canonicalFilePath() != port.name ) {
+                keyPortName = port.name;
+            }
+            if ( handler ) {
+                handler->keyPortChanged(true, keyPortName);
+            }
+        }
+    }
+    if ( handler ) {
+        handler->keyPortsChanged();
+    }
+}
+
+void KeyEngine::setKeyLine(KeyInputThread::KeyLine line)
+{
+    // A serial port and an input device can't stand in for each other
+    if ( keyPortStatus && (line == KeyInputThread::LineEvdev) != (keyLine == KeyInputThread::LineEvdev) ) {
+        closeKeyPort();
+    }
+    keyLine = line;
+    keyInput.setKeyLine(line);
+}
+
+void KeyEngine::setKeyInverted(bool on)
+{
+    keyPortInverted = on;
+    keyInput.setInverted(on);
+}
+
+void KeyEngine::setKeyDebounceUs(int us)
+{
+    keyDebounceUs = us;
+    keyInput.setDebounceUs(us);
+}
+
+void KeyEngine::setKeyCode(int code)
+{
+    keyInputCode = code;
+    keyInput.setKeyCode(code);
+}
+
+void KeyEngine::setKeyThread(bool on)
+{
+    keyThread = on;
+    if ( keyPortStatus && keyLine == KeyInputThread::LineEvdev ) {
+        // There is nothing to poll, the input device is always read on
+        // the thread
+        keyInput.setKeyLine(keyLine);
+        keyInput.setInverted(keyPortInverted);
+        keyInput.setDebounceUs(keyDebounceUs);
+        keyInput.setKeyCode(keyInputCode);
+        keyInput.startSampling(keyEventHandle);
+    } else if ( (on || paddle != KeyInputThread::PaddleOff) && keyPortStatus ) {
+        // The paddle keyer is timed on the thread
+        keyInput.setKeyLine(keyLine);
+        keyInput.setInverted(keyPortInverted);
+        keyInput.setDebounceUs(keyDebounceUs);
+        keyInput.startSampling(qintptr(keySerialPort->handle()));
+    } else {
+        keyInput.stopSampling();
+    }
+}
+
+void KeyEngine::setPaddleMode(KeyInputThread::PaddleMode mode)
+{
+    if ( mode == paddle )
+        return;
+    paddle = mode;
+    keyInput.setPaddleMode(mode);
+    // Started again as the paddle keyer or the straight key
+    if ( keyPortStatus && keyLine != KeyInputThread::LineEvdev ) {
+        setKeyThread(keyThread);
+    }
+}
+
+void KeyEngine::setPaddleWeight(int percent)
+{
+    paddleWeightPercent = qBound(IK_WEIGHT_MIN, percent, IK_WEIGHT_MAX);
+    keyInput.setPaddleWeight(paddleWeightPercent);
+}
+
+void KeyEngine::setPaddleMemory(bool dit, bool dah)
+{
+    paddleDitMemory = dit;
+    paddleDahMemory = dah;
+    keyInput.setPaddleMemory(dit, dah);
+}
+
+void KeyEngine::setKeyerWpm(int wpm)
+{
+    textKeyer.setWpm(wpm);
+    keyInput.setPaddleWpm(textKeyer.wpm());
+}
+
+void KeyEngine::keyDown()
+{
+    keyEdge(true, KeyClock::nowUs());
+}
+
+void KeyEngine::keyUp()
+{
+    keyEdge(false, KeyClock::nowUs());
+}
+
+void KeyEngine::sendText(const QString &text)
+{
+    qint64 now = KeyClock::nowUs();
+    if ( keyerEdges.isEmpty() ) {
+        // Started as late as the lead already covers the key delay
+        qint64 delayUs = qint64(primary->keyDelayMs() - CW_MIN_DELAY) * 1000;
+        keyerAheadUs = qBound(qint64(KE_KEYER_START_MS) * 1000, delayUs, qint64(keyerLeadMs) * 1000);
+        keyerEndUs = now;
+    }
+    // Text added later waits for the run's lead too
+    qint64 start = qMax(keyerEndUs, now + keyerAheadUs);
+    keyerEndUs = textKeyer.schedule(text, start, &keyerEdges);
+}
+
+void KeyEngine::stopText()
+{
+    // A key down that has been sent gets its key up
+    int keep = keyerSent + (keyerSent & 1);
+    if ( keep < keyerEdges.size() ) {
+        keyerEdges.resize(keep);
+    }
+}
+
+void KeyEngine::sendKeyerEdges(qint64 now)
+{
+    qint64 aheadUs = now + qint64(keyerLeadMs) * 1000;
+    while ( keyerSent < keyerEdges.size() && keyerEdges[keyerSent].atUs <= aheadUs ) {
+        const KeyerEdge &e = keyerEdges[keyerSent];
+        // Sent from the next tick, the run has a little less lead
+        if ( keyerSent == 0 ) {
+            keyerAheadUs = qMin(keyerAheadUs, qMax(Q_INT64_C(0), e.atUs - now));
+        }
+        // Traced as sent, the edge itself is the sessions' input
+        if ( tracing.loadAcquire() ) {
+            trace.record(KT_KEYER, now, e.atUs - now, e.down ? 1 : 0, keyerAheadUs);
+        }
+        sendKeyEvent(e.down, e.atUs, keyerAheadUs);
+        keyerSent++;
+    }
+    while ( keyerPlayed < keyerSent && keyerEdges[keyerPlayed].atUs <= now ) {
+        const KeyerEdge &e = keyerEdges[keyerPlayed];
+        if ( handler ) {
+            handler->keyEdge(e.down, e.atUs);
+        }
+        keyerPlayed++;
+    }
+    if ( keyerPlayed == keyerEdges.size() ) {
+        keyerEdges.clear();
+        keyerSent = 0;
+        keyerPlayed = 0;
+    }
+}
+
+void KeyEngine::keyEdge(bool down, qint64 edgeUs)
+{
+    liveKeyDown.storeRelease(down ? 1 : 0);
+    if ( tracing.loadAcquire() ) {
+        trace.record(down ? KT_KEY_DOWN : KT_KEY_UP, edgeUs);
+    }
+    if ( handler ) {
+        handler->keyEdge(down, edgeUs);
+    }
+    sendKeyEvent(down, edgeUs);
+}
+
+// Both key events are sent now, the local key up follows at upUs
+void KeyEngine::keyElement(qint64 downUs, qint64 upUs)
+{
+    liveKeyDown.storeRelease(1);
+    if ( tracing.loadAcquire() ) {
+        trace.record(KT_ELEMENT, downUs, upUs - downUs);
+    }
+    if ( handler ) {
+        handler->keyEdge(true, downUs);
+    }
+    sendKeyElement(downUs, upUs);
+}
+
+void KeyEngine::keyElementEnd(qint64 upUs)
+{
+    liveKeyDown.storeRelease(0);
+    if ( handler ) {
+        handler->keyEdge(false, upUs);
+    }
+}
+
+// With a zero key time, each session fills in its own
+KeyMessage KeyEngine::keyEvent(bool down, qint64 edgeUs)
+{
+    // The edge may have been detected a moment ago on the key input
+    // thread, send the time of the edge and not the time of sending.
+    // Exactly the anchor away so the edge can be found again from it.
+    KeyMessage msg;
+    msg.type = down ? KP_KEY_DOWN : KP_KEY_UP;
+    msg.seq = quint16(keySeq.fetchAndAddOrdered(1));
+    msg.text = false;
+    msg.version = 0;
+    msg.timeUs = quint64(KeyClock::epochAnchorUs() + edgeUs);
+    msg.remoteUs = 0;
+    return msg;
+}
+
+// Encoded once with a zero key time, each session only fills in its
+// own. Called on the key input thread, the sessions' send workers do the
+// writes.
+void KeyEngine::sendKeyEvent(bool down, qint64 edgeUs, qint64 aheadUs)
+{
+    KeyMessage msg = keyEvent(down, edgeUs);
+    char frame[KP_MAX_FRAME];
+    int len = KeyProtocol::encode(frame, msg);
+    KeyPathTrace::record(KPS_ENCODED, edgeUs, down, msg.seq);
+    QMutexLocker locker(&sessionsLock);
+    foreach (KeySession *session, sessions) {
+        session->sendKeyEvent(msg, frame, len, edgeUs, aheadUs);
+    }
+}
+
+void KeyEngine::sendKeyElement(qint64 downUs, qint64 upUs)
+{
+    KeyMessage down = keyEvent(true, downUs);
+    KeyMessage up = keyEvent(false, upUs);
+    KeyPathTrace::record(KPS_ENCODED, downUs, true, down.seq);
+    KeyPathTrace::record(KPS_ENCODED, upUs, false, up.seq);
+    QMutexLocker locker(&sessionsLock);
+    foreach (KeySession *session, sessions) {
+        session->sendKeyElement(down, up, downUs, upUs);
+    }
+}
+
+void KeyEngine::setKeyDelayMs(int ms)
+{
+    foreach (KeySession *session, sessions) {
+        session->setKeyDelayMs(ms);
+    }
+}
+
+void KeyEngine::setAutoKeyDelay(bool on)
+{
+    foreach (KeySession *session, sessions) {
+        session->setAutoKeyDelay(on);
+    }
+}
+
+void KeyEngine::measureKeyDelay()
+{
+    foreach (KeySession *session, sessions) {
+        session->measureKeyDelay();
+    }
+}
+
+void KeyEngine::sessionStateChanged(KeySession *session, KeyConnectionState state)
+{
+    if ( !handler )
+        return;
+    if ( session == primary ) {
+        handler->connectionChanged(state);
+    } else {
+        handler->destinationChanged(sessions.indexOf(session) - 1, state);
+    }
+}
+
+void KeyEngine::sessionMeasured(KeySession *session)
+{
+    if ( handler && session == primary ) {
+        handler->pingMeasured();
+    }
+}
+
+void KeyEngine::sessionKeyDelayChanged(KeySession *session, int ms)
+{
+    if ( handler && session == primary ) {
+        handler->keyDelayChanged(ms);
+    }
+}
+
+int KeyEngine::minOneWayMs()
+{
+    return int(keyMetrics.summary(KM_ONE_WAY, KM_MINUTE_US).min / 1000);
+}
+
+int KeyEngine::maxOneWayMs()
+{
+    return int(keyMetrics.summary(KM_ONE_WAY, KM_MINUTE_US).max / 1000);
+}
+
+bool KeyEngine::setMetricsPort(quint16 port)
+{
+    metricsServerPort = port;
+    if ( port == 0 ) {
+        delete metricsServer;
+        metricsServer = nullptr;
+        return true;
+    }
+    if ( !metricsServer ) {
+        metricsServer = new MetricsServer(&keyMetrics);
+    }
+    if ( metricsServer->serverPort() == port )
+        return true;
+    if ( !metricsServer->listen(port) ) {
+        qDebug() << "Metrics port" << port << "not available";
+        return false;
+    }
+    return true;
+}
+
+bool KeyEngine::startTrace(const QString &fileName)
+{
+    stopTrace();
+    if ( !trace.open(fileName) )
+        return false;
+    // The acks in the trace name key events by it
+    trace.record(KT_SEQ, KeyClock::nowUs(), keySeq.loadAcquire() & 0xFFFF);
+    tracing.storeRelease(1);
+    primary->traceConfig();
+    return true;
+}
+
+void KeyEngine::stopTrace()
+{
+    tracing.storeRelease(0);
+    trace.close();
+}
+
+KeyTraceReplayResult KeyEngine::replayTrace(const QString &fileName)
+{
+    KeyTraceReplayResult result;
+    memset(&result, 0, sizeof(result));
+    KeyTraceReader reader;
+    if ( !reader.open(fileName) )
+        return result;
+    result.ok = true;
+    stopTrace();
+    // Pings and key port polling would run on the replayed clock
+    timer->stop();
+    QElapsedTimer elapsed;
+    elapsed.start();
+    KeyClock::startReplay(reader.epochAnchorUs(), reader.startUs());
+    KeyTraceRecord rec;
+    qint64 lastUs = reader.startUs();
+    // Key times sent for the last edge or element not checked yet
+    int sentToCheck = 0;
+    while ( reader.next(rec) ) {
+        // A key time sent is recorded at its edge, which for the text
+        // keyer is still ahead
+        lastUs = qMax(lastUs, rec.timeUs);
+        if ( rec.tag != KT_SENT ) {
+            KeyClock::setReplayUs(rec.timeUs);
+            primary->applyPendingKeyDelay();
+        }
+        switch ( rec.tag ) {
+        case KT_KEY_DOWN:
+        case KT_KEY_UP:
+            keyEdge(rec.tag == KT_KEY_DOWN, rec.timeUs);
+            result.edges++;
+            sentToCheck = 1;
+            break;
+        case KT_ELEMENT:
+            keyElement(rec.timeUs, rec.timeUs + rec.a);
+            result.edges += 2;
+            sentToCheck = 2;
+            break;
+        case KT_KEYER:
+            // Only to the sessions, the side tone isn't replayed
+            sendKeyEvent(rec.b != 0, rec.timeUs + rec.a, rec.c);
+            result.edges++;
+            sentToCheck = 1;
+            break;
+        case KT_PONG:
+        case KT_PONG_TEXT: {
+            KeyMessage msg;
+            msg.type = KP_PONG;
+            msg.seq = 0;
+            msg.version = 0;
+            msg.text = (rec.tag == KT_PONG_TEXT);
+            qint64 rxUs = KeyClock::epochUs();
+            if ( msg.text ) {
+                msg.timeUs = quint64(rec.a);
+                msg.remoteUs = quint64(rec.b);
+            } else {
+                msg.timeUs = quint64(rxUs - rec.a);
+                msg.remoteUs = msg.timeUs + quint64(rec.b);
+            }
+            primary->receiveMessage(msg, rxUs);
+            result.pongs++;
+            break;
+        }
+        case KT_SENT: {
+            // An element's key down comes first, before its key up's
+            sentToCheck--;
+            qint64 diff = qAbs(primary->lastSentOffsetUs(qMax(0, sentToCheck)) - rec.a);
+            if ( diff != 0 )
+                result.mismatches++;
+            result.maxDiffUs = qMax(result.maxDiffUs, diff);
+            result.sent++;
+            break;
+        }
+        case KT_CONFIG:
+            primary->restoreConfig(int(rec.a), int(rec.b), rec.c / 10000.0);
+            break;
+        case KT_MEASURE:
+            primary->measureKeyDelay();
+            break;
+        case KT_SEQ:
+            keySeq.storeRelease(int(rec.a));
+            break;
+        case KT_ACK: {
+            KeyMessage msg;
+            msg.type = KP_ACKS;
+            msg.seq = quint16(rec.a);
+            msg.text = false;
+            msg.timeUs = quint64(rec.b + rec.c);
+            msg.remoteUs = quint64(rec.b);
+            msg.version = 0;
+            primary->receiveMessage(msg, KeyClock::epochUs());
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    KeyClock::stopReplay();
+    result.traceUs = lastUs - reader.startUs();
+    result.elapsedUs = elapsed.nsecsElapsed() / 1000;
+    timer->start(KE_TICK_MS);
+    return result;
+}
@@ -0,0 +1,313 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYENGINE_H
+#define KEYENGINE_H
+
+#include <QString>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QList>
+#include "keyinputthread.h"
+#include "keyportwatcher.h"
+#include "keysession.h"
+#include "keymetrics.h"
+#include "keytrace.h"
+#include "textkeyer.h"
+
+class QTimer;
+class QSettings;
+class QSerialPort;
+class MetricsServer;
+
+// Poll interval of the engine timer
+#define KE_TICK_MS 1
+// Servers keyed at the same time, the main one included
+#define KE_MAX_SESSIONS 8
+// How far ahead of their edges the text keyer sends key events, and the
+// time from starting a text until its first edge
+#define KE_KEYER_LEAD_MS 2000
+#define KE_KEYER_START_MS 20
+
+// Receiver of what happens in the engine. Called on the thread that
+// runs the engine, except keyEdge() which is called on the key input
+// thread when that samples the key port and must not block.
+class KeyEngineHandler
+{
+public:
+    virtual ~KeyEngineHandler() {}
+    virtual void keyEdge(bool down, qint64 edgeUs) { Q_UNUSED(down); Q_UNUSED(edgeUs); }
+    virtual void connectionChanged(KeyConnectionState state) { Q_UNUSED(state); }
+    // After every round trip sample, a pong or an acknowledged key
+    // event, the statistics below have been updated
+    virtual void pingMeasured() {}
+    // The engine changed the key delay on its own
+    virtual void keyDelayChanged(int ms) { Q_UNUSED(ms); }
+    // An additional destination, see addDestination()
+    virtual void destinationChanged(int index, KeyConnectionState state) { Q_UNUSED(index); Q_UNUSED(state); }
+    // Serial ports or input devices were plugged in or removed
+    virtual void keyPortsChanged() {}
+    // The key port was unplugged, or it came back and was opened again,
+    // possibly under another name
+    virtual void keyPortChanged(bool open, const QString &name) { Q_UNUSED(open); Q_UNUSED(name); }
+};
+
+// Outcome of replaying a trace through the engine
+struct KeyTraceReplayResult {
+    bool ok;                // The trace could be read
+    quint32 edges;
+    quint32 pongs;
+    quint32 sent;           // Key times compared with the recording
+    quint32 mismatches;     // Key times that differ from the recording
+    qint64 maxDiffUs;
+    qint64 traceUs;         // Length of the recording
+    qint64 elapsedUs;       // Time the replay took
+};
+
+// The key, timing and transport core of the client without any user
+// interface. Samples the key port, sends timestamped key events and
+// pings to the key server and follows the network delay and the server
+// clock. The same key can go to additional servers at the same time,
+// each in its own KeySession. The API is plain C++, results are
+// reported to a KeyEngineHandler. Needs a running Qt event loop,
+// QCoreApplication is enough.
+class KeyEngine : public KeyEdgeHandler, public KeySessionHandler
+{
+public:
+    KeyEngine(KeyEngineHandler *handler = nullptr);
+    ~KeyEngine();
+
+    // Settings that have no place in the user interface: UdpRedundancy,
+    // StallPolicy, OnTimePercent, BatchPercent, KernelTimestamps,
+    // KeyPathTrace, MetricsPort, TraceFile, Destinations, KeyPortId (the
+    // stable id of the key port), PaddleWeight, PaddleDitMemory,
+    // PaddleDahMemory, the real time mode (RealTime, RealTimePolicy, RealTimePriority,
+    // KeyCpu, SendCpu, AudioCpu, LockMemory) and the Sim* network
+    // simulation. The group is already selected.
+    void loadSettings(QSettings &settings);
+    void saveSettings(QSettings &settings);
+
+    // Key server. Once asked to connect the engine keeps reconnecting in
+    // the background until disconnectFromServer(). A connection to the
+    // same server keeps the clock and delay estimates, resumes the
+    // session and resends key events that were not acknowledged and can
+    // still be played in time.
+    void setTransportUdp(bool udp) { primary->setTransportUdp(udp); }
+    bool transportUdp() const { return primary->transportUdp(); }
+    void connectToServer(const QString &host, quint16 port);
+    void disconnectFromServer();
+    bool isServerOpen() const { return primary->isServerOpen(); }
+    bool isConnected() const { return primary->isConnected(); }
+    KeyConnectionState connectionState() const { return primary->connectionState(); }
+    bool sessionResumed() const { return primary->sessionResumed(); }
+    int reconnectCount() const { return primary->reconnectCount(); }
+    int resentCount() const { return primary->resentCount(); }
+    // Offer the binary protocol to a TCP server, off keeps to KD/KU/P
+    void setOfferBinary(bool on);
+    // Replace the simulated network conditions of the main server,
+    // normally from the Sim* settings
+    void setNetImpairment(const NetImpairment &sim) { primary->setNetImpairment(sim); }
+
+    // Additional servers keyed together with the main one, e.g. a backup
+    // rig or an SDR monitor. Each has its own transport, clock offset and
+    // key delay, they connect and disconnect with the main server. The
+    // key delay setting applies to all. Returns the index, -1 when there
+    // are KE_MAX_SESSIONS already.
+    int addDestination(const QString &host, quint16 port, bool udp);
+    void removeDestination(int index);
+    int destinationCount() const { return sessions.size() - 1; }
+    KeySession *destination(int index) const { return sessions[index + 1]; }
+
+    // Key port, CTS or DSR of a serial port, or with LineEvdev a Linux
+    // input device such as /dev/input/event3. An input device is always
+    // read on its own thread. An open key port that is unplugged is
+    // opened again as soon as a device with the same stable id (see
+    // KeyPortInfo) comes back, until closeKeyPort().
+    bool openKeyPort(const QString &name);
+    void closeKeyPort();
+    bool isKeyPortOpen() const { return keyPortStatus; }
+    // Unplugged, waiting for it to come back
+    bool isKeyPortWaiting() const { return keyPortWanted && !keyPortStatus; }
+    QString keyPortId() const { return keyPortStableId; }
+    // Serial ports, or input devices, as last seen by the port watcher.
+    // Enumerating is done on the watcher's thread, this never blocks.
+    QList<KeyPortInfo> keyPorts(bool input) const { return portWatcher.ports(input); }
+    void rescanKeyPorts() { portWatcher.rescan(); }
+    void setKeyLine(KeyInputThread::KeyLine line);
+    void setKeyInverted(bool on);
+    void setKeyDebounceUs(int us);
+    // Key of the input device that keys, 0 for any
+    void setKeyCode(int code);
+    int keyCode() const { return keyInputCode; }
+    // Sample the key port on its own thread instead of the engine timer
+    void setKeyThread(bool on);
+    // Iambic keying with a paddle on the serial key port, always sampled
+    // on the key input thread. The key line is the dit lever, the other
+    // modem line the dah lever, the speed is the keyer speed. Every
+    // element is sent whole when it starts, its key up together with its
+    // key down, so a late key up can't stretch it.
+    void setPaddleMode(KeyInputThread::PaddleMode mode);
+    KeyInputThread::PaddleMode paddleMode() const { return paddle; }
+    // Percent, 50 is the standard weighting
+    void setPaddleWeight(int percent);
+    int paddleWeight() const { return paddleWeightPercent; }
+    void setPaddleMemory(bool dit, bool dah);
+
+    // Keying from elsewhere than the key port, e.g. a button
+    void keyDown();
+    void keyUp();
+
+    // Keying from text, appended to what is being sent. The schedule is
+    // known in advance, so the key events are sent up to the keyer lead
+    // ahead of their edges and arrive that much earlier than live keying
+    // would. The local side, keyEdge() of the handler, follows on time.
+    // A run starts up to the key delay late, and every event of it is
+    // sent at least that much ahead, which is taken off the key delay:
+    // the rig follows the side tone closely instead of a key delay
+    // behind. Stopping can't recall what has been sent already.
+    void sendText(const QString &text);
+    void stopText();
+    bool isSendingText() const { return !keyerEdges.isEmpty(); }
+    // Of the paddle keyer too
+    void setKeyerWpm(int wpm);
+    int keyerWpm() const { return textKeyer.wpm(); }
+    // Farnsworth character speed, 0 for the same as the speed
+    void setKeyerCharWpm(int wpm) { textKeyer.setCharWpm(wpm); }
+    int keyerCharWpm() const { return textKeyer.charWpm(); }
+    void setKeyerLeadMs(int ms) { keyerLeadMs = qMax(0, ms); }
+
+    void setKeyDelayMs(int ms);
+    int keyDelayMs() const { return primary->keyDelayMs(); }
+    void setAutoKeyDelay(bool on);
+    // Burst of pings, then the recommended key delay is applied
+    void measureKeyDelay();
+    int recommendedKeyDelayMs() const { return primary->recommendedKeyDelayMs(); }
+    double onTimeTarget() const { return primary->onTimeTarget(); }
+    void ping() { primary->ping(); }
+
+    // Statistics of the main server, only read from the thread running
+    // the engine. Min and max are over the last minute.
+    int lastOneWayMs() const { return primary->lastOneWayMs(); }
+    int minOneWayMs();
+    int maxOneWayMs();
+    const DelayEstimator &delayStatistics() const { return primary->delayStatistics(); }
+    qint64 clockOffsetUs() { return primary->clockOffsetUs(); }
+    double clockSkewPpm() { return primary->clockSkewPpm(); }
+    qint64 clockUncertaintyUs() { return primary->clockUncertaintyUs(); }
+    int clockSamples() { return primary->clockSamples(); }
+    KeySenderStats sendStatistics() { return primary->sendStatistics(); }
+    int batchPercent() const { return primary->batchPercent(); }
+    // The key socket has kernel timestamps (KernelTimestamps)
+    bool isStamped() const { return primary->isStamped(); }
+    // The server acknowledges key events, the key delay follows the
+    // real margin at the server then
+    bool serverAcks() const { return primary->serverAcks(); }
+    KeyAckStats ackStatistics() { return primary->ackStatistics(); }
+    // Latency histograms of the main server, safe to read from any thread
+    KeyMetrics &metrics() { return keyMetrics; }
+    // Prometheus endpoint on localhost, 0 turns it off
+    bool setMetricsPort(quint16 port);
+    quint16 metricsPort() const { return metricsServerPort; }
+
+    // Record key edges, pongs and the key times sent to the main server
+    // to a trace file
+    bool startTrace(const QString &fileName);
+    void stopTrace();
+    // Feed a recorded trace through the key delay and clock logic on
+    // the recorded time line, as fast as it goes, and compare the key
+    // times with the recorded ones. For a fresh engine that is not
+    // connected, the process runs on the trace time meanwhile.
+    KeyTraceReplayResult replayTrace(const QString &fileName);
+
+    // Called on the key input thread
+    void keyEdge(bool down, qint64 edgeUs) override;
+    void keyElement(qint64 downUs, qint64 upUs) override;
+    void keyElementEnd(qint64 upUs) override;
+
+    // Called by the sessions
+    void sessionStateChanged(KeySession *session, KeyConnectionState state) override;
+    void sessionMeasured(KeySession *session) override;
+    void sessionKeyDelayChanged(KeySession *session, int ms) override;
+
+private:
+    void tick();
+    void pollKeyPort();
+    bool openPort(const QString &name);
+    void releaseKeyPort();
+    void keyPortHotplug();
+    void sendKeyerEdges(qint64 now);
+    KeyMessage keyEvent(bool down, qint64 edgeUs);
+    void sendKeyEvent(bool down, qint64 edgeUs, qint64 aheadUs = 0);
+    void sendKeyElement(qint64 downUs, qint64 upUs);
+
+    KeyEngineHandler *handler;
+    QTimer *timer;
+
+    // Key port
+    QSerialPort *keySerialPort;
+    KeyInputThread keyInput;
+    bool keyPortStatus = false;
+    bool keyPortWanted = false;
+    QString keyPortName;
+    QString keyPortStableId;
+    KeyPortWatcher portWatcher;
+    bool keyThread = false;
+    KeyInputThread::KeyLine keyLine = KeyInputThread::LineCTS;
+    qintptr keyEventHandle = -1;
+    int keyInputCode = 0;
+    bool keyPortInverted = false;
+    KeyInputThread::PaddleMode paddle = KeyInputThread::PaddleOff;
+    int paddleWeightPercent = 50;
+    bool paddleDitMemory = true;
+    bool paddleDahMemory = true;
+    bool KeyIsDownLast = false;
+    QAtomicInt liveKeyDown;         // Last edge of keyEdge()
+    qint64 keyDebounceUntilUs = 0;
+    qint32 keyDebounceUs = 45000;
+
+    // Key servers, the main one first. Changed on the engine thread,
+    // the lock keeps the key input thread out meanwhile.
+    KeySession *primary;
+    QList<KeySession *> sessions;
+    QMutex sessionsLock;
+    QAtomicInt keySeq;
+    int udpRedundancy = 4;
+    bool offerBinary = true;
+
+    KeyMetrics keyMetrics;
+    MetricsServer *metricsServer = nullptr;
+    quint16 metricsServerPort = 0;
+
+    KeyTraceWriter trace;
+    QAtomicInt tracing;
+
+    // Text keyer, edges up to keyerSent have gone to the sessions, the
+    // ones before keyerPlayed also to the handler
+    TextKeyer textKeyer;
+    QVector<KeyerEdge> keyerEdges;
+    int keyerSent = 0;
+    int keyerPlayed = 0;
+    qint64 keyerEndUs = 0;
+    qint64 keyerAheadUs = 0;     // Every event of the run is sent this early
+    int keyerLeadMs = KE_KEYER_LEAD_MS;
+};
+
+#endif // KEYENGINE_H
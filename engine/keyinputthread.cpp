@@ -0,0 +1,519 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include "keyinputthread.h"
+#include "keyclock.h"
+#include "keypathtrace.h"
+#include "realtime.h"
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <errno.h>
+#endif
+#if defined(Q_OS_LINUX)
+#include <signal.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/input.h>
+#include <QFile>
+#endif
+
+#if defined(Q_OS_LINUX)
+// Older kernel headers only have the timeval
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+// Beyond this the event and reference clocks don't agree, the event
+// time is not used
+#define KEY_EVENT_MAX_AGE_US 1000000
+// How often a thread that can't be woken by the signal checks for stop
+// while waiting for an input event
+#define KEY_STOP_POLL_MS 50
+#endif
+
+#if defined(Q_OS_LINUX)
+// Only used to interrupt a blocking TIOCMIWAIT when stopping
+static void wakeSignalHandler(int)
+{
+}
+
+// Installed once for the process, and only if SIGUSR2 is left at its
+// default. A handler of the application's own is never replaced.
+static bool installWakeSignal()
+{
+    static const bool installed = []() {
+        struct sigaction old;
+        if ( sigaction(SIGUSR2, nullptr, &old) < 0 )
+            return false;
+        if ( (old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL )
+            return false;
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = wakeSignalHandler;
+        // No SA_RESTART, the ioctl has to return with EINTR
+        sa.sa_flags = 0;
+        sigemptyset(&sa.sa_mask);
+        return sigaction(SIGUSR2, &sa, nullptr) == 0;
+    }();
+    return installed;
+}
+#endif
+
+KeyInputThread::KeyInputThread(KeyEdgeHandler *handler, QObject *parent) :
+    QThread(parent),
+    edgeHandler(handler)
+{
+    keyLine.storeRelease(int(LineCTS));
+    inverted.storeRelease(0);
+    debounceUs.storeRelease(45000);
+    keyCode.storeRelease(0);
+    modemWait.storeRelease(0);
+    paddleMode.storeRelease(int(PaddleOff));
+    paddleWpm.storeRelease(20);
+    paddleWeight.storeRelease(50);
+    paddleMemory.storeRelease(3);
+#if defined(Q_OS_LINUX)
+    wakeSignal = installWakeSignal();
+#endif
+}
+
+KeyInputThread::~KeyInputThread()
+{
+    stopSampling();
+}
+
+void KeyInputThread::startSampling(qintptr handle)
+{
+    stopSampling();
+    portHandle = handle;
+    stopRequested.storeRelease(0);
+#if defined(Q_OS_LINUX)
+    threadIdValid.storeRelease(0);
+#endif
+    start(QThread::TimeCriticalPriority);
+}
+
+void KeyInputThread::stopSampling()
+{
+    if ( !isRunning() )
+        return;
+    stopRequested.storeRelease(1);
+#if defined(Q_OS_LINUX)
+    // Kick the thread out of TIOCMIWAIT or read(), retry in case the signal was
+    // delivered just before the thread entered the ioctl
+    while ( !wait(10) ) {
+        if ( wakeSignal && threadIdValid.loadAcquire() != 0 )
+            pthread_kill(threadId, SIGUSR2);
+    }
+#else
+    wait();
+#endif
+}
+
+void KeyInputThread::run()
+{
+#if defined(Q_OS_LINUX)
+    threadId = pthread_self();
+    threadIdValid.storeRelease(1);
+#endif
+    RealTime::enterThread(RT_KEY);
+    KeyPathTrace::nameThread("key input");
+    // Take the current key position as the start, it is not an edge
+    bool down;
+    if ( readLine(&down) ) {
+        reportedDown = down;
+    }
+    seenDown = reportedDown;
+    lockoutUntilUs = 0;
+    if ( paddleMode.loadAcquire() != PaddleOff && keyLine.loadAcquire() != LineEvdev ) {
+        runPaddle();
+        return;
+    }
+#if defined(Q_OS_LINUX)
+    if ( keyLine.loadAcquire() == LineEvdev ) {
+        runEvdev();
+        return;
+    }
+    if ( runModemWait() )
+        return;
+#endif
+    runPolling();
+}
+
+qintptr KeyInputThread::openEventDevice(const QString &path)
+{
+#if defined(Q_OS_LINUX)
+    // Blocking, stopSampling() interrupts the read
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if ( fd < 0 )
+        return -1;
+    // Must be an input device with keys
+    unsigned long types = 0;
+    if ( ioctl(fd, EVIOCGBIT(0, sizeof(types)), &types) < 0 || !(types & (1UL << EV_KEY)) ) {
+        ::close(fd);
+        return -1;
+    }
+    // Timestamps on the same clock as KeyClock instead of the wall clock
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+    return qintptr(fd);
+#else
+    Q_UNUSED(path);
+    return -1;
+#endif
+}
+
+void KeyInputThread::closeEventDevice(qintptr handle)
+{
+#if defined(Q_OS_LINUX)
+    if ( handle >= 0 )
+        ::close(int(handle));
+#else
+    Q_UNUSED(handle);
+#endif
+}
+
+bool KeyInputThread::readLine(bool *down)
+{
+    bool active;
+#if defined(Q_OS_LINUX)
+    if ( keyLine.loadAcquire() == LineEvdev ) {
+        unsigned char keys[KEY_MAX / 8 + 1];
+        memset(keys, 0, sizeof(keys));
+        if ( ioctl(int(portHandle), EVIOCGKEY(sizeof(keys)), keys) < 0 )
+            return false;
+        int code = keyCode.loadAcquire();
+        active = false;
+        for (int i=0; i<=KEY_MAX; i++) {
+            if ( (code == 0 || code == i) && (keys[i / 8] & (1 << (i % 8))) ) {
+                active = true;
+                break;
+            }
+        }
+        *down = (inverted.loadAcquire() != 0) ? !active : active;
+        return true;
+    }
+#endif
+#if defined(Q_OS_WIN)
+    DWORD status;
+    if ( !GetCommModemStatus(HANDLE(portHandle), &status) )
+        return false;
+    if ( keyLine.loadAcquire() == LineDSR ) {
+        active = (status & MS_DSR_ON) != 0;
+    } else {
+        active = (status & MS_CTS_ON) != 0;
+    }
+#else
+    int status;
+    if ( ioctl(int(portHandle), TIOCMGET, &status) < 0 )
+        return false;
+    if ( keyLine.loadAcquire() == LineDSR ) {
+        active = (status & TIOCM_DSR) != 0;
+    } else {
+        active = (status & TIOCM_CTS) != 0;
+    }
+#endif
+    *down = (inverted.loadAcquire() != 0) ? !active : active;
+    return true;
+}
+
+// Both modem lines, the key line is the dit lever
+bool KeyInputThread::readPaddle(bool *dit, bool *dah)
+{
+    bool cts, dsr;
+#if defined(Q_OS_WIN)
+    DWORD status;
+    if ( !GetCommModemStatus(HANDLE(portHandle), &status) )
+        return false;
+    cts = (status & MS_CTS_ON) != 0;
+    dsr = (status & MS_DSR_ON) != 0;
+#else
+    int status;
+    if ( ioctl(int(portHandle), TIOCMGET, &status) < 0 )
+        return false;
+    cts = (status & TIOCM_CTS) != 0;
+    dsr = (status & TIOCM_DSR) != 0;
+#endif
+    bool invert = (inverted.loadAcquire() != 0);
+    bool ditOnDsr = (keyLine.loadAcquire() == LineDSR);
+    *dit = (ditOnDsr ? dsr : cts) != invert;
+    *dah = (ditOnDsr ? cts : dsr) != invert;
+    return true;
+}
+
+// Report the key position if it has changed and the debounce time after
+// the previous edge has passed. Returns true when an edge was reported.
+bool KeyInputThread::checkLine()
+{
+    // Timestamp as close to the detection as possible
+    qint64 now = KeyClock::nowUs();
+    bool down;
+    if ( !readLine(&down) )
+        return false;
+    return reportEdge(down, now);
+}
+
+bool KeyInputThread::reportEdge(bool down, qint64 edgeUs)
+{
+    if ( down != seenDown ) {
+        // Each change of the line once, not every poll during the lockout
+        seenDown = down;
+        KeyPathTrace::record(edgeUs < lockoutUntilUs ? KPS_BOUNCE : KPS_DETECTED, edgeUs, down, 0, edgeUs);
+    }
+    if ( down == reportedDown || edgeUs < lockoutUntilUs )
+        return false;
+    reportedDown = down;
+    lockoutUntilUs = edgeUs + debounceUs.loadAcquire();
+    KeyPathTrace::record(KPS_DEBOUNCED, edgeUs, down);
+    edgeHandler->keyEdge(down, edgeUs);
+    return true;
+}
+
+// Sleep until the KeyClock time dueUs and record how late the thread
+// got to run
+void KeyInputThread::sleepUntil(qint64 dueUs)
+{
+    qint64 now = KeyClock::nowUs();
+    if ( dueUs > now ) {
+        QThread::usleep(quint64(dueUs - now));
+        now = KeyClock::nowUs();
+    }
+    if ( metrics ) {
+        metrics->record(KM_WAKE_KEY, now - dueUs);
+    }
+}
+
+#if defined(Q_OS_LINUX)
+// The event time on the KeyClock time line. The kernel stamps the event
+// on CLOCK_MONOTONIC (see openEventDevice()), or the wall clock if the
+// kernel can't, so its age is taken on the same clock.
+static qint64 eventTimeUs(const struct input_event &ev)
+{
+    qint64 now = KeyClock::nowUs();
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    qint64 ageUs = (qint64(ts.tv_sec) - qint64(ev.input_event_sec)) * 1000000
+            + ts.tv_nsec / 1000 - qint64(ev.input_event_usec);
+    if ( ageUs < 0 || ageUs > KEY_EVENT_MAX_AGE_US ) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ageUs = (qint64(ts.tv_sec) - qint64(ev.input_event_sec)) * 1000000
+                + ts.tv_nsec / 1000 - qint64(ev.input_event_usec);
+    }
+    if ( ageUs < 0 || ageUs > KEY_EVENT_MAX_AGE_US )
+        return now;
+    return now - ageUs;
+}
+#endif
+
+// Read key events until stopped or the device is gone. An edge within
+// the debounce time is held back and reported when the time has passed,
+// if the key is still in that position, at the end of the debounce time.
+void KeyInputThread::runEvdev()
+{
+#if defined(Q_OS_LINUX)
+    modemWait.storeRelease(0);
+    int fd = int(portHandle);
+    bool latestDown = reportedDown;
+    qint64 latestUs = 0;
+    struct input_event events[64];
+    while ( stopRequested.loadAcquire() == 0 ) {
+        if ( latestDown != reportedDown ) {
+            // Held back by the debounce
+            qint64 waitUs = lockoutUntilUs - KeyClock::nowUs();
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int ready = waitUs > 0 ? poll(&pfd, 1, int((waitUs + 999) / 1000)) : 0;
+            if ( ready < 0 && errno == EINTR )
+                continue;
+            if ( ready == 0 ) {
+                if ( metrics && waitUs > 0 ) {
+                    metrics->record(KM_WAKE_KEY, KeyClock::nowUs() - lockoutUntilUs);
+                }
+                reportEdge(latestDown, qMax(latestUs, lockoutUntilUs));
+                continue;
+            }
+        }
+        if ( !wakeSignal ) {
+            // The read can't be interrupted, only read what is there
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int ready = poll(&pfd, 1, KEY_STOP_POLL_MS);
+            if ( ready == 0 || (ready < 0 && errno == EINTR) )
+                continue;
+        }
+        ssize_t n = read(fd, events, sizeof(events));
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            // Device unplugged
+            break;
+        }
+        int code = keyCode.loadAcquire();
+        bool invert = inverted.loadAcquire() != 0;
+        for (size_t i=0; i<size_t(n) / sizeof(events[0]); i++) {
+            const struct input_event &ev = events[i];
+            // Value 2 is autorepeat
+            if ( ev.type != EV_KEY || ev.value > 1 )
+                continue;
+            if ( code != 0 && ev.code != code )
+                continue;
+            latestDown = (ev.value != 0) != invert;
+            latestUs = eventTimeUs(ev);
+            // The kernel's event time to the thread reading it
+            if ( metrics ) {
+                metrics->record(KM_WAKE_KEY, KeyClock::nowUs() - latestUs);
+            }
+            reportEdge(latestDown, latestUs);
+        }
+    }
+#endif
+}
+
+// Block until a modem line changes. Returns false if the driver does not
+// support TIOCMIWAIT so the caller can fall back to polling.
+bool KeyInputThread::runModemWait()
+{
+#if defined(Q_OS_LINUX)
+    // Without the signal the thread couldn't be stopped in the ioctl
+    if ( !wakeSignal )
+        return false;
+    bool supported = false;
+    while ( stopRequested.loadAcquire() == 0 ) {
+        if ( KeyClock::nowUs() < lockoutUntilUs ) {
+            sleepUntil(lockoutUntilUs);
+            continue;
+        }
+        // The line may have changed during the lockout
+        if ( checkLine() )
+            continue;
+        if ( ioctl(int(portHandle), TIOCMIWAIT, TIOCM_CTS | TIOCM_DSR) < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            if ( !supported )
+                return false;
+            // Port closed or device gone
+            break;
+        }
+        if ( !supported ) {
+            supported = true;
+            modemWait.storeRelease(1);
+        }
+        checkLine();
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Paddle keying. Each lever is debounced on its own, for at most a unit
+// so a release is seen before the keyer decides on the next element.
+// The thread wakes at the end of every element to end it locally and
+// after its space to decide on the next one, in between the levers are
+// sampled every KEY_POLL_US. With both levers up and nothing to send
+// it waits in TIOCMIWAIT where the driver has it.
+void KeyInputThread::runPaddle()
+{
+    modemWait.storeRelease(0);
+    IambicKeyer keyer;
+    bool dit = false;
+    bool dah = false;
+    qint64 ditLockoutUs = 0;
+    qint64 dahLockoutUs = 0;
+    // Key up of the element being sent, -1 when it has been reported
+    qint64 upUs = -1;
+#if defined(Q_OS_LINUX)
+    bool canWait = wakeSignal;
+#endif
+    while ( stopRequested.loadAcquire() == 0 ) {
+        keyer.setWpm(paddleWpm.loadAcquire());
+        keyer.setWeight(paddleWeight.loadAcquire());
+        keyer.setModeB(paddleMode.loadAcquire() == PaddleIambicB);
+        int memory = paddleMemory.loadAcquire();
+        keyer.setMemory((memory & 1) != 0, (memory & 2) != 0);
+        qint64 now = KeyClock::nowUs();
+        bool ditNow, dahNow;
+        if ( readPaddle(&ditNow, &dahNow) ) {
+            qint64 lockoutUs = qMin(qint64(debounceUs.loadAcquire()), keyer.unitUs());
+            if ( ditNow != dit && now >= ditLockoutUs ) {
+                dit = ditNow;
+                ditLockoutUs = now + lockoutUs;
+            }
+            if ( dahNow != dah && now >= dahLockoutUs ) {
+                dah = dahNow;
+                dahLockoutUs = now + lockoutUs;
+            }
+        }
+        if ( upUs >= 0 && now >= upUs ) {
+            edgeHandler->keyElementEnd(upUs);
+            upUs = -1;
+        }
+        KeyerElement element;
+        if ( keyer.update(dit, dah, now, &element) ) {
+            KeyPathTrace::record(KPS_DEBOUNCED, element.downUs, true);
+            KeyPathTrace::record(KPS_DEBOUNCED, element.upUs, false);
+            edgeHandler->keyElement(element.downUs, element.upUs);
+            upUs = element.upUs;
+        }
+#if defined(Q_OS_LINUX)
+        if ( canWait && keyer.isIdle() && !dit && !dah && upUs < 0
+             && now >= ditLockoutUs && now >= dahLockoutUs ) {
+            if ( ioctl(int(portHandle), TIOCMIWAIT, TIOCM_CTS | TIOCM_DSR) < 0 && errno != EINTR ) {
+                canWait = false;
+            } else {
+                modemWait.storeRelease(1);
+            }
+            continue;
+        }
+#endif
+        qint64 dueUs = now + KEY_POLL_US;
+        if ( upUs >= 0 ) {
+            dueUs = qMin(dueUs, upUs);
+        }
+        if ( keyer.nextUs() >= 0 ) {
+            dueUs = qMin(dueUs, keyer.nextUs());
+        }
+        sleepUntil(dueUs);
+    }
+    if ( upUs >= 0 ) {
+        // Stopped during an element, it has been sent whole
+        edgeHandler->keyElementEnd(upUs);
+    }
+}
+
+void KeyInputThread::runPolling()
+{
+    modemWait.storeRelease(0);
+    while ( stopRequested.loadAcquire() == 0 ) {
+        checkLine();
+        sleepUntil(KeyClock::nowUs() + KEY_POLL_US);
+    }
+}
@@ -0,0 +1,145 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYINPUTTHREAD_H
+#define KEYINPUTTHREAD_H
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QString>
+#include "keymetrics.h"
+#include "iambickeyer.h"
+#if defined(Q_OS_LINUX)
+#include <pthread.h>
+#endif
+
+// Poll interval when the driver can't wait for modem line changes
+#define KEY_POLL_US 250
+
+// Receiver of debounced key edges. Called directly on the key input
+// thread, an implementation must be thread safe and must not block.
+class KeyEdgeHandler
+{
+public:
+    virtual ~KeyEdgeHandler() {}
+    virtual void keyEdge(bool down, qint64 edgeUs) = 0;
+    // An element of the paddle keyer, called when it starts with its key
+    // up already known. keyElementEnd() follows at upUs.
+    virtual void keyElement(qint64 downUs, qint64 upUs) { Q_UNUSED(upUs); keyEdge(true, downUs); }
+    virtual void keyElementEnd(qint64 upUs) { keyEdge(false, upUs); }
+};
+
+// Key sampling on its own high priority thread, independent of the GUI
+// event loop. On Linux the thread blocks in TIOCMIWAIT until CTS or DSR
+// changes, other platforms and drivers without TIOCMIWAIT poll the modem
+// lines every KEY_POLL_US. Edges are timestamped with KeyClock when they
+// are detected and debounced in real time.
+//
+// On Linux stopSampling() interrupts a blocking TIOCMIWAIT or read()
+// with SIGUSR2 sent to the thread. The first KeyInputThread installs an
+// empty handler for it, once for the process, if SIGUSR2 has no handler
+// yet. An application that uses SIGUSR2 itself keeps its handler, the
+// thread then polls the modem lines and checks for stop every 50 ms
+// while waiting for an input event.
+//
+// LineEvdev keys from a Linux input device (/dev/input/event*), e.g. a
+// USB foot switch or a paddle with a HID interface. The thread blocks in
+// read() and takes the edge time from the kernel's timestamp of the
+// event, so it doesn't depend on when the thread gets to run.
+//
+// With a paddle mode set a paddle is keyed on the serial port: the key
+// line is the dit lever, the other modem line the dah lever, and an
+// IambicKeyer makes the elements. Each element is reported whole when
+// it starts, so both of its key events can be sent at once.
+class KeyInputThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    enum KeyLine { LineCTS, LineDSR, LineEvdev };
+    enum PaddleMode { PaddleOff, PaddleIambicA, PaddleIambicB };
+
+    // Input device for LineEvdev, see KeyPortWatcher for the list. The
+    // handle is a file descriptor, -1 when it can't be opened.
+    static qintptr openEventDevice(const QString &path);
+    static void closeEventDevice(qintptr handle);
+
+    KeyInputThread(KeyEdgeHandler *handler, QObject *parent = nullptr);
+    ~KeyInputThread();
+
+    // 'handle' is the native handle of an already opened serial port,
+    // see QSerialPort::handle(), or from openEventDevice() for LineEvdev
+    void startSampling(qintptr handle);
+    void stopSampling();
+
+    void setKeyLine(KeyLine line) { keyLine.storeRelease(int(line)); }
+    void setInverted(bool on) { inverted.storeRelease(on ? 1 : 0); }
+    void setDebounceUs(int us) { debounceUs.storeRelease(us); }
+    // Linux key code (KEY_*, BTN_*) keying with LineEvdev, 0 for any key
+    void setKeyCode(int code) { keyCode.storeRelease(code); }
+    // Not for LineEvdev. Switching it on or off takes effect when sampling
+    // is started, the rest right away.
+    void setPaddleMode(PaddleMode mode) { paddleMode.storeRelease(int(mode)); }
+    void setPaddleWpm(int wpm) { paddleWpm.storeRelease(wpm); }
+    void setPaddleWeight(int percent) { paddleWeight.storeRelease(percent); }
+    void setPaddleMemory(bool dit, bool dah) { paddleMemory.storeRelease((dit ? 1 : 0) | (dah ? 2 : 0)); }
+    bool usesModemWait() const { return modemWait.loadAcquire() != 0; }
+    // Wake up latency of the thread, set before sampling starts
+    void setMetrics(KeyMetrics *m) { metrics = m; }
+
+protected:
+    void run() override;
+
+private:
+    bool readLine(bool *down);
+    bool readPaddle(bool *dit, bool *dah);
+    bool checkLine();
+    bool runModemWait();
+    void runPolling();
+    void runEvdev();
+    void runPaddle();
+    bool reportEdge(bool down, qint64 edgeUs);
+    void sleepUntil(qint64 dueUs);
+
+    KeyEdgeHandler *edgeHandler;
+    KeyMetrics *metrics = nullptr;
+    qintptr portHandle = -1;
+    QAtomicInt stopRequested;
+    QAtomicInt keyLine;
+    QAtomicInt inverted;
+    QAtomicInt debounceUs;
+    QAtomicInt keyCode;
+    QAtomicInt modemWait;
+    QAtomicInt paddleMode;
+    QAtomicInt paddleWpm;
+    QAtomicInt paddleWeight;
+    QAtomicInt paddleMemory;
+    bool reportedDown = false;
+    bool seenDown = false;
+    qint64 lockoutUntilUs = 0;
+#if defined(Q_OS_LINUX)
+    pthread_t threadId;
+    QAtomicInt threadIdValid;
+    bool wakeSignal = false;        // SIGUSR2 is ours to wake the thread
+#endif
+};
+
+#endif // KEYINPUTTHREAD_H
@@ -0,0 +1,187 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QFile>
+#include "keymetrics.h"
+#include "keyclock.h"
+
+KeyMetrics::KeyMetrics() :
+    histograms(KM_COUNT)
+{
+}
+
+const char *KeyMetrics::name(KeyMetric metric)
+{
+    switch ( metric ) {
+    case KM_PING_RTT: return "ping_rtt_us";
+    case KM_ONE_WAY: return "one_way_us";
+    case KM_EDGE_TO_WRITE: return "edge_to_write_us";
+    case KM_SEND_QUEUE: return "send_queue_depth";
+    case KM_KEYTIME_MARGIN: return "keytime_margin_us";
+    case KM_WAKE_KEY: return "key_wakeup_us";
+    case KM_WAKE_SEND: return "send_wakeup_us";
+    case KM_WAKE_AUDIO: return "tone_wakeup_us";
+    case KM_BATCH_HOLD: return "batch_hold_us";
+    case KM_WRITE_BYTES: return "write_bytes";
+    case KM_TX_STACK: return "tx_kernel_lag_us";
+    case KM_RX_STACK: return "rx_kernel_lag_us";
+    default: return "";
+    }
+}
+
+const char *KeyMetrics::description(KeyMetric metric)
+{
+    switch ( metric ) {
+    case KM_PING_RTT: return "Round trip time of pings and acked key events";
+    case KM_ONE_WAY: return "One way delay to the key server";
+    case KM_EDGE_TO_WRITE: return "Key edge to written to the socket";
+    case KM_SEND_QUEUE: return "Messages waiting in the send worker";
+    case KM_KEYTIME_MARGIN: return "Key time minus estimated arrival";
+    case KM_WAKE_KEY: return "Key input thread wake up latency";
+    case KM_WAKE_SEND: return "Send worker wake up latency";
+    case KM_WAKE_AUDIO: return "Side tone wake up latency";
+    case KM_BATCH_HOLD: return "Latency added by batching key events";
+    case KM_WRITE_BYTES: return "Bytes per write to the key socket";
+    case KM_TX_STACK: return "Ping queued to sent by the kernel";
+    case KM_RX_STACK: return "Received by the kernel to read by the client";
+    default: return "";
+    }
+}
+
+void KeyMetrics::record(KeyMetric metric, qint64 value)
+{
+    qint64 now = KeyClock::nowUs();
+    QMutexLocker locker(&lock);
+    histograms[metric].record(value, now);
+}
+
+void KeyMetrics::reset()
+{
+    QMutexLocker locker(&lock);
+    for (int i=0; i<KM_COUNT; i++) {
+        histograms[i].reset();
+    }
+}
+
+KeyMetricSummary KeyMetrics::summarize(const LatencyHistogram &h)
+{
+    KeyMetricSummary s;
+    s.count = h.count();
+    s.min = h.minValue();
+    s.max = h.maxValue();
+    s.mean = qRound64(h.mean());
+    s.p50 = h.quantile(0.50);
+    s.p95 = h.quantile(0.95);
+    s.p99 = h.quantile(0.99);
+    return s;
+}
+
+KeyMetricSummary KeyMetrics::summary(KeyMetric metric, qint64 windowUs)
+{
+    qint64 now = KeyClock::nowUs();
+    QMutexLocker locker(&lock);
+    return summarize(histograms[metric].window(windowUs, now));
+}
+
+QByteArray KeyMetrics::csv(qint64 windowUs)
+{
+    QByteArray out("metric,count,min,max,mean,p50,p95,p99\n");
+    for (int i=0; i<KM_COUNT; i++) {
+        KeyMetricSummary s = summary(KeyMetric(i), windowUs);
+        out.append(name(KeyMetric(i)));
+        out.append("," + QByteArray::number(s.count));
+        out.append("," + QByteArray::number(s.min));
+        out.append("," + QByteArray::number(s.max));
+        out.append("," + QByteArray::number(s.mean));
+        out.append("," + QByteArray::number(s.p50));
+        out.append("," + QByteArray::number(s.p95));
+        out.append("," + QByteArray::number(s.p99));
+        out.append('\n');
+    }
+    return out;
+}
+
+QByteArray KeyMetrics::json(qint64 windowUs)
+{
+    QByteArray out("{\n  \"window_s\": ");
+    out.append(QByteArray::number(windowUs / 1000000));
+    out.append(",\n  \"metrics\": {");
+    for (int i=0; i<KM_COUNT; i++) {
+        KeyMetricSummary s = summary(KeyMetric(i), windowUs);
+        out.append(i ? ",\n" : "\n");
+        out.append("    \"");
+        out.append(name(KeyMetric(i)));
+        out.append("\": { \"count\": ");
+        out.append(QByteArray::number(s.count));
+        out.append(", \"min\": ");
+        out.append(QByteArray::number(s.min));
+        out.append(", \"max\": ");
+        out.append(QByteArray::number(s.max));
+        out.append(", \"mean\": ");
+        out.append(QByteArray::number(s.mean));
+        out.append(", \"p50\": ");
+        out.append(QByteArray::number(s.p50));
+        out.append(", \"p95\": ");
+        out.append(QByteArray::number(s.p95));
+        out.append(", \"p99\": ");
+        out.append(QByteArray::number(s.p99));
+        out.append(" }");
+    }
+    out.append("\n  }\n}\n");
+    return out;
+}
+
+// Quantiles over the last minute, sum and count since the start as
+// Prometheus expects of a summary
+QByteArray KeyMetrics::prometheus()
+{
+    QByteArray out;
+    qint64 now = KeyClock::nowUs();
+    QMutexLocker locker(&lock);
+    for (int i=0; i<KM_COUNT; i++) {
+        QByteArray metric("remotecw_");
+        metric.append(name(KeyMetric(i)));
+        KeyMetricSummary s = summarize(histograms[i].window(KM_MINUTE_US, now));
+        const LatencyHistogram &all = histograms[i].total();
+        out.append("# HELP " + metric + " " + description(KeyMetric(i)) + "\n");
+        out.append("# TYPE " + metric + " summary\n");
+        out.append(metric + "{quantile=\"0.5\"} " + QByteArray::number(s.p50) + "\n");
+        out.append(metric + "{quantile=\"0.95\"} " + QByteArray::number(s.p95) + "\n");
+        out.append(metric + "{quantile=\"0.99\"} " + QByteArray::number(s.p99) + "\n");
+        out.append(metric + "_sum " + QByteArray::number(all.sumValue()) + "\n");
+        out.append(metric + "_count " + QByteArray::number(all.count()) + "\n");
+    }
+    return out;
+}
+
+bool KeyMetrics::writeFile(const QString &fileName, qint64 windowUs)
+{
+    QFile file(fileName);
+    if ( !file.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+        return false;
+    QByteArray data;
+    if ( fileName.endsWith(".json", Qt::CaseInsensitive) ) {
+        data = json(windowUs);
+    } else {
+        data = csv(windowUs);
+    }
+    return file.write(data) == data.size();
+}
@@ -0,0 +1,92 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYMETRICS_H
+#define KEYMETRICS_H
+
+#include <QMutex>
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include "latencyhistogram.h"
+
+// Windows offered for the summaries
+#define KM_MINUTE_US Q_INT64_C(60000000)
+#define KM_QUARTER_US (15 * KM_MINUTE_US)
+
+enum KeyMetric {
+    KM_PING_RTT,            // Ping round trip time, us
+    KM_ONE_WAY,             // Half the round trip, us
+    KM_EDGE_TO_WRITE,       // Key edge to accepted by the socket, us
+    KM_SEND_QUEUE,          // Messages held by the send worker
+    KM_KEYTIME_MARGIN,      // Estimated key time minus arrival, us
+    KM_WAKE_KEY,            // Key input thread woken after it was due, us
+    KM_WAKE_SEND,           // Send worker woken after a message was queued, us
+    KM_WAKE_AUDIO,          // Side tone block later than one audio period, us
+    KM_BATCH_HOLD,          // Key event held back for a batch, us
+    KM_WRITE_BYTES,         // Bytes per socket write, a datagram over UDP
+    KM_TX_STACK,            // Probe queued to sent by the kernel, us
+    KM_RX_STACK,            // Received by the kernel to read by the client, us
+    KM_COUNT
+};
+
+// Quantiles of one metric over a window
+struct KeyMetricSummary {
+    quint64 count;
+    qint64 min;
+    qint64 max;
+    qint64 mean;
+    qint64 p50;
+    qint64 p95;
+    qint64 p99;
+};
+
+// Rolling histograms of the latencies that matter for keying, recorded
+// from the engine, the send worker and the key input thread. Memory is
+// fixed, so they can run for a contest weekend. Summaries are exported
+// as CSV or JSON and in the Prometheus text format.
+class KeyMetrics
+{
+public:
+    KeyMetrics();
+
+    static const char *name(KeyMetric metric);
+    static const char *description(KeyMetric metric);
+
+    void record(KeyMetric metric, qint64 value);
+    void reset();
+    // The last windowUs, everything since the start if 0
+    KeyMetricSummary summary(KeyMetric metric, qint64 windowUs);
+
+    QByteArray csv(qint64 windowUs);
+    QByteArray json(qint64 windowUs);
+    QByteArray prometheus();
+    // JSON if the name ends in .json, otherwise CSV
+    bool writeFile(const QString &fileName, qint64 windowUs);
+
+private:
+    static KeyMetricSummary summarize(const LatencyHistogram &h);
+
+    QMutex lock;
+    QVector<RollingHistogram> histograms;   // A few 100 kB, not on the stack
+};
+
+#endif // KEYMETRICS_H
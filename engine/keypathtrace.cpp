@@ -0,0 +1,252 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QFile>
+#include <QHash>
+#include <QVector>
+#include <cstring>
+#include "keypathtrace.h"
+#include "keyclock.h"
+
+struct KeyPathPoint {
+    qint64 timeUs;
+    qint64 edgeUs;
+    qint64 value;
+    quint8 stage;
+    quint8 down;
+};
+
+// Written only by the thread that owns it, read by chromeTrace()
+struct KeyPathRing {
+    QAtomicInteger<quint32> head;       // Tracepoints recorded
+    QAtomicInt inUse;
+    char name[32];
+    KeyPathPoint points[KPT_RING_SIZE];
+};
+
+// Hands the ring back when its thread ends
+struct KeyPathOwner {
+    KeyPathRing *ring = nullptr;
+    bool none = false;                  // All rings taken
+    ~KeyPathOwner()
+    {
+        if ( ring ) {
+            ring->inUse.storeRelease(0);
+        }
+    }
+};
+
+static QAtomicInt enabled(1);
+static QMutex ringsLock;
+static KeyPathRing *rings[KPT_MAX_THREADS];
+static thread_local KeyPathOwner owner;
+
+// A ring for the calling thread: the one a thread of the same name had,
+// so a restarted thread continues its track, or a free one, or a new
+// one. nullptr when all are taken.
+static KeyPathRing *attach(const char *name)
+{
+    QMutexLocker locker(&ringsLock);
+    KeyPathRing *ring = nullptr;
+    int i;
+    for (i=0; i<KPT_MAX_THREADS && rings[i] != nullptr; i++) {
+        if ( rings[i]->inUse.loadAcquire() != 0 )
+            continue;
+        if ( !strcmp(rings[i]->name, name) ) {
+            ring = rings[i];
+            break;
+        }
+        if ( ring == nullptr ) {
+            ring = rings[i];
+        }
+    }
+    if ( ring == nullptr ) {
+        if ( i == KPT_MAX_THREADS )
+            return nullptr;
+        ring = new KeyPathRing;
+        ring->head.storeRelease(0);
+        ring->name[0] = 0;
+        rings[i] = ring;
+    }
+    if ( strcmp(ring->name, name) != 0 ) {
+        // Another thread's tracepoints don't belong on this track
+        ring->head.storeRelease(0);
+        strncpy(ring->name, name, sizeof(ring->name) - 1);
+        ring->name[sizeof(ring->name) - 1] = 0;
+    }
+    ring->inUse.storeRelease(1);
+    return ring;
+}
+
+void KeyPathTrace::setEnabled(bool on)
+{
+    enabled.storeRelease(on ? 1 : 0);
+}
+
+bool KeyPathTrace::isEnabled()
+{
+    return enabled.loadAcquire() != 0;
+}
+
+void KeyPathTrace::nameThread(const char *name)
+{
+    if ( owner.ring ) {
+        if ( !strcmp(owner.ring->name, name) )
+            return;
+        owner.ring->inUse.storeRelease(0);
+    }
+    owner.ring = attach(name);
+    owner.none = (owner.ring == nullptr);
+}
+
+void KeyPathTrace::record(KeyPathStage stage, qint64 edgeUs, bool down, qint64 value, qint64 timeUs)
+{
+    if ( enabled.loadAcquire() == 0 )
+        return;
+    KeyPathRing *ring = owner.ring;
+    if ( ring == nullptr ) {
+        if ( owner.none )
+            return;
+        nameThread("thread");
+        ring = owner.ring;
+        if ( ring == nullptr )
+            return;
+    }
+    quint32 head = ring->head.loadAcquire();
+    KeyPathPoint &p = ring->points[head & (KPT_RING_SIZE - 1)];
+    p.timeUs = (timeUs < 0) ? KeyClock::nowUs() : timeUs;
+    p.edgeUs = edgeUs;
+    p.value = value;
+    p.stage = quint8(stage);
+    p.down = down ? 1 : 0;
+    ring->head.storeRelease(head + 1);
+}
+
+const char *KeyPathTrace::name(KeyPathStage stage)
+{
+    switch ( stage ) {
+    case KPS_DETECTED: return "detected";
+    case KPS_BOUNCE: return "bounce";
+    case KPS_DEBOUNCED: return "debounced";
+    case KPS_ENCODED: return "encoded";
+    case KPS_KEYTIME: return "keytime";
+    case KPS_WRITTEN: return "written";
+    case KPS_DROPPED: return "dropped";
+    case KPS_ACKED: return "acked";
+    default: return "";
+    }
+}
+
+QByteArray KeyPathTrace::chromeTrace()
+{
+    struct Span {
+        qint64 firstUs;
+        qint64 lastUs;
+        bool down;
+        int points;
+    };
+    QHash<qint64, Span> spans;
+    QByteArray out("{\"displayTimeUnit\":\"ms\",\"otherData\":{\"clock\":\"KeyClock us\",\"epochAnchorUs\":");
+    out.append(QByteArray::number(KeyClock::epochAnchorUs()));
+    out.append("},\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"key path\"}}");
+    // Under the lock no ring changes hands. The threads keep recording,
+    // what they overwrote while it was copied is left out.
+    QMutexLocker locker(&ringsLock);
+    QVector<KeyPathPoint> copy(KPT_RING_SIZE);
+    for (int i=0; i<KPT_MAX_THREADS && rings[i] != nullptr; i++) {
+        KeyPathRing *ring = rings[i];
+        int tid = i + 1;
+        out.append(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+        out.append(QByteArray::number(tid));
+        out.append(",\"args\":{\"name\":\"");
+        out.append(ring->name);
+        out.append("\"}}");
+        quint32 end = ring->head.loadAcquire();
+        int count = int(qMin(end, quint32(KPT_RING_SIZE)));
+        for (int k=0; k<count; k++) {
+            copy[k] = ring->points[(end - quint32(count) + quint32(k)) & (KPT_RING_SIZE - 1)];
+        }
+        // Slots written again meanwhile are lost, the one at the head
+        // may be half written
+        quint32 advanced = qMin(ring->head.loadAcquire() - end, quint32(KPT_RING_SIZE));
+        int skip = qMax(0, int(advanced) + count + 1 - KPT_RING_SIZE);
+        for (int k=qMin(skip, count); k<count; k++) {
+            const KeyPathPoint &p = copy[k];
+            out.append(",\n{\"name\":\"");
+            out.append(name(KeyPathStage(p.stage)));
+            out.append("\",\"cat\":\"key\",\"ph\":\"i\",\"s\":\"t\",\"ts\":");
+            out.append(QByteArray::number(p.timeUs));
+            out.append(",\"pid\":1,\"tid\":");
+            out.append(QByteArray::number(tid));
+            out.append(",\"args\":{\"edge\":");
+            out.append(QByteArray::number(p.edgeUs));
+            out.append(p.down ? ",\"key\":\"down\"" : ",\"key\":\"up\"");
+            out.append(",\"value\":");
+            out.append(QByteArray::number(p.value));
+            out.append("}}");
+            if ( p.stage == KPS_DETECTED || p.stage == KPS_BOUNCE )
+                continue;
+            Span &s = spans[p.edgeUs];
+            if ( s.points == 0 ) {
+                s.firstUs = qMin(p.timeUs, p.edgeUs);
+                s.lastUs = p.timeUs;
+                s.down = (p.down != 0);
+            } else {
+                s.firstUs = qMin(s.firstUs, p.timeUs);
+                s.lastUs = qMax(s.lastUs, p.timeUs);
+            }
+            s.points++;
+        }
+    }
+    locker.unlock();
+    // One span per key event, from the edge to its last stage
+    for (QHash<qint64, Span>::const_iterator it = spans.constBegin(); it != spans.constEnd(); ++it) {
+        const char *spanName = it.value().down ? "key down" : "key up";
+        QByteArray id = QByteArray::number(it.key());
+        out.append(",\n{\"name\":\"");
+        out.append(spanName);
+        out.append("\",\"cat\":\"key\",\"ph\":\"b\",\"id\":\"");
+        out.append(id);
+        out.append("\",\"ts\":");
+        out.append(QByteArray::number(it.value().firstUs));
+        out.append(",\"pid\":1,\"tid\":0}");
+        out.append(",\n{\"name\":\"");
+        out.append(spanName);
+        out.append("\",\"cat\":\"key\",\"ph\":\"e\",\"id\":\"");
+        out.append(id);
+        out.append("\",\"ts\":");
+        out.append(QByteArray::number(it.value().lastUs));
+        out.append(",\"pid\":1,\"tid\":0}");
+    }
+    out.append("\n]}\n");
+    return out;
+}
+
+bool KeyPathTrace::writeChromeTrace(const QString &fileName)
+{
+    QFile file(fileName);
+    if ( !file.open(QIODevice::WriteOnly | QIODevice::Truncate) )
+        return false;
+    QByteArray data = chromeTrace();
+    return file.write(data) == data.size();
+}
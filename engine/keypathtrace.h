@@ -0,0 +1,70 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+
+#ifndef KEYPATHTRACE_H
+#define KEYPATHTRACE_H
+
+#include <QByteArray>
+#include <QString>
+
+// Tracepoints kept per thread, a power of two
+#define KPT_RING_SIZE 4096
+// Threads that can record at the same time
+#define KPT_MAX_THREADS 16
+
+// Where a key event is on its way from the key to the server
+enum KeyPathStage {
+    KPS_DETECTED,       // The key line changed, before the debounce
+    KPS_BOUNCE,         // Ignored within the debounce time
+    KPS_DEBOUNCED,      // Reported to the engine
+    KPS_ENCODED,        // Encoded by the engine, value: seq
+    KPS_KEYTIME,        // Handed to a server's send worker, value: key
+                        // time minus edge time, us
+    KPS_WRITTEN,        // Accepted by the socket
+    KPS_DROPPED,        // Dropped as late under the drop policy
+    KPS_ACKED,          // Acknowledged, value: key time minus arrival, us
+    KPS_STAGES
+};
+
+// Always on tracing of every key event through the stages above. Each
+// thread records into its own fixed ring without locking or allocating,
+// a tracepoint is a clock read and a few stores. The rings keep the last
+// KPT_RING_SIZE tracepoints of each thread and are read on demand into
+// a Chrome trace (JSON), which chrome://tracing and ui.perfetto.dev
+// show as a timeline: one track per thread and one span per key event
+// from its edge to its last stage. Key events are told apart by their
+// edge time (KeyClock us), which every stage knows.
+class KeyPathTrace
+{
+public:
+    static void setEnabled(bool on);
+    static bool isEnabled();
+    // Name of the calling thread's track, before it records
+    static void nameThread(const char *name);
+    // timeUs -1 is now
+    static void record(KeyPathStage stage, qint64 edgeUs, bool down, qint64 value = 0, qint64 timeUs = -1);
+
+    static const char *name(KeyPathStage stage);
+    static QByteArray chromeTrace();
+    static bool writeChromeTrace(const QString &fileName);
+};
+
+#endif // KEYPATHTRACE_H
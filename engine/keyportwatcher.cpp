@@ -0,0 +1,465 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+#include <QSerialPortInfo>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QHash>
+#include "keyportwatcher.h"
+#if defined(Q_OS_LINUX)
+#include <cstring>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+// Multicast groups of NETLINK_KOBJECT_UEVENT
+#define KPW_GROUP_KERNEL 1
+#define KPW_GROUP_UDEV 2
+#define KPW_UEVENT_SIZE 8192
+#endif
+
+typedef QHash<QString, QString> DeviceProperties;
+
+static QString stableIdOf(const QString &serial, const QString &path, const QString &name)
+{
+    if ( !serial.isEmpty() )
+        return "serial:" + serial;
+    if ( !path.isEmpty() )
+        return "path:" + path;
+    return "name:" + name;
+}
+
+#if defined(Q_OS_LINUX)
+// A sysfs attribute, empty if there is none
+static QString readSysfs(const QString &path)
+{
+    QFile file(path);
+    if ( !file.open(QIODevice::ReadOnly) )
+        return QString();
+    return QString::fromUtf8(file.readAll()).trimmed();
+}
+
+// Attribute of a device or of the closest parent that has it, like the
+// serial number of the USB device a ttyUSB port belongs to
+static QString parentAttribute(const QString &dir, const char *attribute)
+{
+    QString path = QFileInfo(dir).canonicalFilePath();
+    while ( path.startsWith("/sys/devices/") ) {
+        QString value = readSysfs(path + "/" + attribute);
+        if ( !value.isEmpty() )
+            return value;
+        path = path.left(path.lastIndexOf('/'));
+    }
+    return QString();
+}
+
+// What udev knows of a character device, "E:KEY=VALUE" lines in its
+// database. Empty without udev.
+static DeviceProperties udevProperties(const QString &sysDir)
+{
+    DeviceProperties props;
+    QString dev = readSysfs(sysDir + "/dev");
+    if ( dev.isEmpty() )
+        return props;
+    QFile file("/run/udev/data/c" + dev);
+    if ( !file.open(QIODevice::ReadOnly) )
+        return props;
+    foreach (const QByteArray &line, file.readAll().split('\n')) {
+        int eq = line.indexOf('=');
+        if ( line.startsWith("E:") && eq > 2 ) {
+            props.insert(QString::fromUtf8(line.mid(2, eq - 2)), QString::fromUtf8(line.mid(eq + 1)));
+        }
+    }
+    return props;
+}
+
+// A tty with a device behind it, from the properties of its hotplug
+// event or of the udev database, sysfs where they are missing
+static KeyPortInfo serialPortInfo(const QString &name, const DeviceProperties &props)
+{
+    QString dir = "/sys/class/tty/" + name;
+    KeyPortInfo port;
+    port.name = name;
+    port.input = false;
+    port.description = props.value("ID_MODEL_FROM_DATABASE", props.value("ID_MODEL")).replace('_', ' ');
+    if ( port.description.isEmpty() ) {
+        port.description = parentAttribute(dir + "/device", "product");
+    }
+    QString serial = props.value("ID_SERIAL_SHORT");
+    if ( serial.isEmpty() ) {
+        serial = parentAttribute(dir + "/device", "serial");
+    }
+    port.stableId = stableIdOf(serial, props.value("ID_PATH"), name);
+    return port;
+}
+
+// An input device has several event nodes for one USB device, its name
+// tells them apart
+static KeyPortInfo inputDeviceInfo(const QString &node, const DeviceProperties &props)
+{
+    QString dir = "/sys/class/input/" + node;
+    KeyPortInfo port;
+    port.name = "/dev/input/" + node;
+    port.input = true;
+    port.description = readSysfs(dir + "/device/name");
+    QString serial = props.value("ID_SERIAL_SHORT");
+    if ( serial.isEmpty() ) {
+        serial = parentAttribute(dir + "/device", "serial");
+    }
+    QString path = props.value("ID_PATH");
+    port.stableId = stableIdOf(serial.isEmpty() ? serial : serial + "/" + port.description,
+                               path.isEmpty() ? path : path + "/" + port.description, port.name);
+    return port;
+}
+#endif
+
+KeyPortWatcher::KeyPortWatcher(QObject *parent) :
+    QThread(parent)
+{
+    changesPending.storeRelease(0);
+    stopRequested.storeRelease(0);
+    rescanRequested.storeRelease(0);
+#if defined(Q_OS_LINUX)
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+#endif
+}
+
+KeyPortWatcher::~KeyPortWatcher()
+{
+    stopWatching();
+#if defined(Q_OS_LINUX)
+    if ( wakeFd >= 0 )
+        close(wakeFd);
+#endif
+}
+
+void KeyPortWatcher::startWatching()
+{
+    if ( isRunning() )
+        return;
+    stopRequested.storeRelease(0);
+    start(QThread::LowPriority);
+}
+
+void KeyPortWatcher::stopWatching()
+{
+    if ( !isRunning() )
+        return;
+    stopRequested.storeRelease(1);
+    wake.release();
+#if defined(Q_OS_LINUX)
+    quint64 one = 1;
+    if ( wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0 ) {
+        // Already signalled
+    }
+#endif
+    wait();
+}
+
+void KeyPortWatcher::rescan()
+{
+    rescanRequested.storeRelease(1);
+    wake.release();
+#if defined(Q_OS_LINUX)
+    quint64 one = 1;
+    if ( wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0 ) {
+        // Already signalled
+    }
+#endif
+}
+
+QList<KeyPortInfo> KeyPortWatcher::ports(bool input) const
+{
+    QMutexLocker locker(&lock);
+    QList<KeyPortInfo> list;
+    foreach (const KeyPortInfo &port, known) {
+        if ( port.input == input )
+            list.append(port);
+    }
+    return list;
+}
+
+QString KeyPortWatcher::stableId(const QString &name) const
+{
+    // An input device may be given by one of its /dev/input/by-id links
+    QString node = name.startsWith("/dev/") ? QFileInfo(name).canonicalFilePath() : name;
+    QMutexLocker locker(&lock);
+    foreach (const KeyPortInfo &port, known) {
+        if ( port.name == node || port.name == name )
+            return port.stableId;
+    }
+    return QString();
+}
+
+QList<KeyPortChange> KeyPortWatcher::takeChanges()
+{
+    QMutexLocker locker(&lock);
+    QList<KeyPortChange> taken;
+    taken.swap(changes);
+    changesPending.storeRelease(0);
+    return taken;
+}
+
+void KeyPortWatcher::run()
+{
+#if defined(Q_OS_LINUX)
+    // Listening before the scan, nothing plugged in meanwhile is missed
+    int fd = openUevents();
+    scan();
+    if ( fd >= 0 ) {
+        while ( stopRequested.loadAcquire() == 0 ) {
+            struct pollfd pfd[2];
+            pfd[0].fd = fd;
+            pfd[0].events = POLLIN;
+            pfd[0].revents = 0;
+            pfd[1].fd = wakeFd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            if ( poll(pfd, wakeFd >= 0 ? 2 : 1, wakeFd >= 0 ? -1 : KPW_RESCAN_MS) < 0 && errno != EINTR )
+                break;
+            if ( pfd[1].revents & POLLIN ) {
+                quint64 count;
+                if ( read(wakeFd, &count, sizeof(count)) < 0 ) {
+                    // Nothing to reset
+                }
+            }
+            if ( rescanRequested.fetchAndStoreOrdered(0) != 0 ) {
+                scan();
+            }
+            if ( pfd[0].revents & POLLIN ) {
+                readUevents(fd);
+            }
+        }
+        close(fd);
+        return;
+    }
+#else
+    scan();
+#endif
+    // No hotplug notifications, compare with a new scan now and then
+    while ( stopRequested.loadAcquire() == 0 ) {
+        wake.tryAcquire(1, KPW_RESCAN_MS);
+        wake.tryAcquire(wake.available());
+        if ( stopRequested.loadAcquire() != 0 )
+            break;
+        rescanRequested.storeRelease(0);
+        scan();
+    }
+}
+
+// Everything there is now, the differences to the last scan are queued
+// as changes
+void KeyPortWatcher::scan()
+{
+    QList<KeyPortInfo> found;
+    foreach (const QSerialPortInfo &info, QSerialPortInfo::availablePorts()) {
+#if defined(Q_OS_LINUX)
+        KeyPortInfo port = serialPortInfo(info.portName(), udevProperties("/sys/class/tty/" + info.portName()));
+        if ( !info.description().isEmpty() ) {
+            port.description = info.description();
+        }
+#else
+        KeyPortInfo port;
+        port.name = info.portName();
+        port.description = info.description();
+        port.input = false;
+        port.stableId = stableIdOf(info.serialNumber(), QString(), port.name);
+#endif
+        found.append(port);
+    }
+#if defined(Q_OS_LINUX)
+    QDir dir("/dev/input");
+    foreach (const QString &node, dir.entryList(QStringList() << "event*", QDir::System, QDir::Name)) {
+        found.append(inputDeviceInfo(node, udevProperties("/sys/class/input/" + node)));
+    }
+#endif
+    update(found);
+}
+
+void KeyPortWatcher::update(const QList<KeyPortInfo> &found)
+{
+    QStringList names;
+    foreach (const KeyPortInfo &port, found) {
+        names.append(port.name);
+        addPort(port);
+    }
+    QStringList gone;
+    {
+        QMutexLocker locker(&lock);
+        foreach (const KeyPortInfo &port, known) {
+            if ( !names.contains(port.name) )
+                gone.append(port.name);
+        }
+    }
+    foreach (const QString &name, gone) {
+        removePort(name);
+    }
+}
+
+// A port that is already known with the same id is left alone
+void KeyPortWatcher::addPort(const KeyPortInfo &port)
+{
+    QMutexLocker locker(&lock);
+    for (int i=0; i<known.size(); i++) {
+        if ( known[i].name != port.name )
+            continue;
+        if ( known[i].stableId == port.stableId ) {
+            known[i].description = port.description;
+            return;
+        }
+        // Another device got the name, the old one is gone
+        queueChange(false, known.takeAt(i));
+        break;
+    }
+    known.append(port);
+    queueChange(true, port);
+}
+
+void KeyPortWatcher::removePort(const QString &name)
+{
+    QMutexLocker locker(&lock);
+    for (int i=0; i<known.size(); i++) {
+        if ( known[i].name == name ) {
+            queueChange(false, known.takeAt(i));
+            return;
+        }
+    }
+}
+
+// With the lock held
+void KeyPortWatcher::queueChange(bool added, const KeyPortInfo &port)
+{
+    KeyPortChange change;
+    change.added = added;
+    change.port = port;
+    changes.append(change);
+    changesPending.storeRelease(1);
+}
+
+#if defined(Q_OS_LINUX)
+// Hotplug events from udev when it runs, they come after the device
+// node and its links exist with their permissions. Otherwise straight
+// from the kernel.
+int KeyPortWatcher::openUevents()
+{
+    udevEvents = QFileInfo::exists("/run/udev/control");
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if ( fd < 0 )
+        return -1;
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = udevEvents ? KPW_GROUP_UDEV : KPW_GROUP_KERNEL;
+    int on = 1;
+    if ( bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0
+         || setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0 ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void KeyPortWatcher::readUevents(int fd)
+{
+    char buf[KPW_UEVENT_SIZE];
+    char control[CMSG_SPACE(sizeof(struct ucred))];
+    for (;;) {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        struct sockaddr_nl sender;
+        memset(&sender, 0, sizeof(sender));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &sender;
+        msg.msg_namelen = sizeof(sender);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if ( n <= 0 )
+            return;
+        buf[n] = 0;
+        // Only from the kernel or from udev running as root
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if ( cmsg == nullptr || cmsg->cmsg_type != SCM_CREDENTIALS )
+            continue;
+        struct ucred cred;
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+        if ( cred.uid != 0 )
+            continue;
+        const char *props;
+        size_t len;
+        if ( udevEvents ) {
+            // "libudev\0", magic, header size, properties offset and length
+            quint32 off, plen;
+            if ( sender.nl_pid == 0 || n < 24 || memcmp(buf, "libudev", 8) != 0 )
+                continue;
+            memcpy(&off, buf + 16, sizeof(off));
+            memcpy(&plen, buf + 20, sizeof(plen));
+            if ( off < 24 || size_t(off) + plen > size_t(n) )
+                continue;
+            props = buf + off;
+            len = plen;
+        } else {
+            // "action@devpath" and the properties
+            if ( sender.nl_pid != 0 )
+                continue;
+            size_t head = strlen(buf) + 1;
+            if ( head >= size_t(n) )
+                continue;
+            props = buf + head;
+            len = size_t(n) - head;
+        }
+        DeviceProperties env;
+        for (size_t i=0; i<len; ) {
+            QString entry = QString::fromUtf8(props + i);
+            int eq = entry.indexOf('=');
+            if ( eq > 0 ) {
+                env.insert(entry.left(eq), entry.mid(eq + 1));
+            }
+            i += strlen(props + i) + 1;
+        }
+        QString action = env.value("ACTION");
+        QString subsystem = env.value("SUBSYSTEM");
+        QString node = QFileInfo(env.value("DEVNAME")).fileName();
+        if ( node.isEmpty() )
+            continue;
+        if ( subsystem == "tty" ) {
+            if ( action == "remove" ) {
+                removePort(node);
+            } else if ( action == "add" && QFileInfo::exists("/sys/class/tty/" + node + "/device") ) {
+                addPort(serialPortInfo(node, udevEvents ? env : udevProperties("/sys/class/tty/" + node)));
+            }
+        } else if ( subsystem == "input" && node.startsWith("event") ) {
+            if ( action == "remove" ) {
+                removePort("/dev/input/" + node);
+            } else if ( action == "add" ) {
+                addPort(inputDeviceInfo(node, udevEvents ? env : udevProperties("/sys/class/input/" + node)));
+            }
+        }
+    }
+}
+#endif
@@ -0,0 +1,103 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+#ifndef KEYPORTWATCHER_H
+#define KEYPORTWATCHER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QList>
+#include <QString>
+
+// Rescan interval where there are no hotplug notifications
+#define KPW_RESCAN_MS 2000
+
+// A serial port or a Linux input device that can be the key port
+struct KeyPortInfo {
+    QString name;           // For KeyEngine::openKeyPort(), ttyUSB0, COM3 or /dev/input/event5
+    QString description;
+    // Stays the same when the device is plugged in again: "serial:" and
+    // the USB serial number, else "path:" and the bus path (Linux), else
+    // "name:" and the name
+    QString stableId;
+    bool input;             // Input device rather than a serial port
+};
+
+struct KeyPortChange {
+    bool added;
+    KeyPortInfo port;
+};
+
+// Keeps the list of serial ports and input devices up to date on its
+// own thread, so enumerating them never blocks the thread that runs the
+// engine. On Linux the list is scanned once and then updated one device
+// at a time from the hotplug events of udev (or of the kernel when udev
+// doesn't run), elsewhere it is rescanned every KPW_RESCAN_MS. Changes
+// are queued for the engine, which takes them on its timer.
+class KeyPortWatcher : public QThread
+{
+    Q_OBJECT
+
+public:
+    KeyPortWatcher(QObject *parent = nullptr);
+    ~KeyPortWatcher();
+
+    void startWatching();
+    void stopWatching();
+    // Scan everything again, e.g. for ports the notifications missed
+    void rescan();
+
+    // The ports as last seen, never blocks on the enumeration
+    QList<KeyPortInfo> ports(bool input) const;
+    // Of the port with this name, empty if it isn't known
+    QString stableId(const QString &name) const;
+    bool hasChanges() const { return changesPending.loadAcquire() != 0; }
+    QList<KeyPortChange> takeChanges();
+
+protected:
+    void run() override;
+
+private:
+    void scan();
+    void update(const QList<KeyPortInfo> &found);
+    void addPort(const KeyPortInfo &port);
+    void removePort(const QString &name);
+    void queueChange(bool added, const KeyPortInfo &port);
+#if defined(Q_OS_LINUX)
+    int openUevents();
+    void readUevents(int fd);
+#endif
+
+    mutable QMutex lock;
+    QList<KeyPortInfo> known;
+    QList<KeyPortChange> changes;
+    QAtomicInt changesPending;
+    QAtomicInt stopRequested;
+    QAtomicInt rescanRequested;
+    QSemaphore wake;
+    bool udevEvents = false;
+#if defined(Q_OS_LINUX)
+    int wakeFd = -1;            // eventfd, interrupts the wait for events
+#endif
+};
+
+#endif // KEYPORTWATCHER_H
@@ -0,0 +1,486 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <cstring>
+#include "keyprotocol.h"
+
+static inline void put16(char *p, quint16 v)
+{
+    p[0] = char(v & 0xFF);
+    p[1] = char(v >> 8);
+}
+
+static inline void put64(char *p, quint64 v)
+{
+    for (int i=0; i<8; i++) {
+        p[i] = char((v >> (8 * i)) & 0xFF);
+    }
+}
+
+static inline void put32(char *p, quint32 v)
+{
+    for (int i=0; i<4; i++) {
+        p[i] = char((v >> (8 * i)) & 0xFF);
+    }
+}
+
+static inline quint16 get16(const quint8 *p)
+{
+    return quint16(p[0] | (p[1] << 8));
+}
+
+static inline quint32 get32(const quint8 *p)
+{
+    return quint32(p[0]) | (quint32(p[1]) << 8) | (quint32(p[2]) << 16) | (quint32(p[3]) << 24);
+}
+
+static inline quint64 get64(const quint8 *p)
+{
+    quint64 v = 0;
+    for (int i=7; i>=0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline bool isAlpha(quint8 c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+static inline bool isDigit(quint8 c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static char *putDecimal(char *p, quint64 v)
+{
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = char('0' + v % 10);
+        v /= 10;
+    } while ( v != 0 );
+    while ( n > 0 )
+        *p++ = digits[--n];
+    return p;
+}
+
+int KeyProtocol::payloadSize(quint8 type)
+{
+    switch ( type ) {
+    case KP_KEY_DOWN:
+    case KP_KEY_UP:
+    case KP_PONG:
+        return 16;
+    case KP_PING:
+    case KP_SESSION:
+        return 8;
+    case KP_EVENTS:
+        return 1;       // Minimum, the count follows
+    case KP_ACKS:
+        return 9;       // Minimum, base and count
+    case KP_BATCH:
+        return KP_BATCH_BASE_SIZE;  // Minimum, the first event
+    default:
+        return -1;
+    }
+}
+
+int KeyProtocol::encode(char *out, const KeyMessage &msg)
+{
+    int len = payloadSize(msg.type);
+    if ( len < 0 )
+        return 0;
+    out[0] = char(KP_SYNC);
+    out[1] = char(len);
+    out[2] = char(msg.type);
+    put16(&out[3], msg.seq);
+    put64(&out[KP_HEADER_SIZE], msg.timeUs);
+    if ( len == 16 ) {
+        put64(&out[KP_HEADER_SIZE + 8], msg.remoteUs);
+    }
+    return KP_HEADER_SIZE + len;
+}
+
+int KeyProtocol::encodeText(char *out, quint8 type, quint64 first, quint64 second)
+{
+    char *p = out;
+    switch ( type ) {
+    case KP_KEY_DOWN:
+    case KP_KEY_UP:
+        *p++ = 'K';
+        *p++ = (type == KP_KEY_DOWN) ? 'D' : 'U';
+        *p++ = ' ';
+        p = putDecimal(p, first);
+        *p++ = ' ';
+        p = putDecimal(p, second);
+        break;
+    case KP_PING:
+        *p++ = 'P';
+        *p++ = ' ';
+        p = putDecimal(p, first);
+        break;
+    default:
+        break;
+    }
+    return int(p - out);
+}
+
+void KeyProtocol::setKeyTime(char *frame, quint64 remoteUs)
+{
+    put64(&frame[KP_HEADER_SIZE + 8], remoteUs);
+}
+
+int KeyProtocol::encodeEvents(char *out, const KeyMessage *events, int count)
+{
+    if ( count > KP_MAX_EVENTS )
+        count = KP_MAX_EVENTS;
+    int len = 1 + count * KP_EVENT_SIZE;
+    out[0] = char(KP_SYNC);
+    out[1] = char(len);
+    out[2] = char(KP_EVENTS);
+    put16(&out[3], 0);
+    out[KP_HEADER_SIZE] = char(count);
+    char *p = &out[KP_HEADER_SIZE + 1];
+    for (int i=0; i<count; i++) {
+        put16(p, events[i].seq);
+        p[2] = char(events[i].type);
+        put64(&p[3], events[i].timeUs);
+        put64(&p[11], events[i].remoteUs);
+        p += KP_EVENT_SIZE;
+    }
+    return KP_HEADER_SIZE + len;
+}
+
+int KeyProtocol::encodeAcks(char *out, const KeyMessage *acks, int count, quint64 sendUs)
+{
+    if ( count > KP_MAX_ACKS )
+        count = KP_MAX_ACKS;
+    int len = 9 + count * KP_ACK_SIZE;
+    quint64 base = sendUs;
+    out[0] = char(KP_SYNC);
+    out[1] = char(len);
+    out[2] = char(KP_ACKS);
+    put16(&out[3], 0);
+    put64(&out[KP_HEADER_SIZE], base);
+    out[KP_HEADER_SIZE + 8] = char(count);
+    char *p = &out[KP_HEADER_SIZE + 9];
+    for (int i=0; i<count; i++) {
+        put16(p, acks[i].seq);
+        put32(&p[2], quint32(qint32(qint64(acks[i].remoteUs - base))));
+        p += KP_ACK_SIZE;
+    }
+    return KP_HEADER_SIZE + len;
+}
+
+bool KeyProtocol::decodeKeyEvent(const char *frame, int len, KeyMessage *msg)
+{
+    const quint8 *p = reinterpret_cast<const quint8 *>(frame);
+    if ( len != KP_HEADER_SIZE + 16 || p[0] != KP_SYNC || (p[2] != KP_KEY_DOWN && p[2] != KP_KEY_UP) )
+        return false;
+    msg->type = p[2];
+    msg->seq = get16(&p[3]);
+    msg->text = false;
+    msg->timeUs = get64(&p[KP_HEADER_SIZE]);
+    msg->remoteUs = get64(&p[KP_HEADER_SIZE + 8]);
+    msg->version = 0;
+    return true;
+}
+
+bool KeyProtocol::batchable(const KeyMessage &first, const KeyMessage &prev, const KeyMessage &next)
+{
+    if ( next.seq != quint16(prev.seq + 1) || next.type == prev.type || next.timeUs < prev.timeUs )
+        return false;
+    if ( next.timeUs - prev.timeUs > Q_UINT64_C(0xFFFFFFFF) )
+        return false;
+    qint64 lead = qint64(next.remoteUs - next.timeUs) - qint64(first.remoteUs - first.timeUs);
+    return lead >= -32768 && lead <= 32767;
+}
+
+int KeyProtocol::encodeBatch(char *out, const KeyMessage *events, int count)
+{
+    if ( count > KP_MAX_BATCH )
+        count = KP_MAX_BATCH;
+    int len = KP_BATCH_BASE_SIZE + (count - 1) * KP_BATCH_DELTA_SIZE;
+    out[0] = char(KP_SYNC);
+    out[1] = char(len);
+    out[2] = char(KP_BATCH);
+    put16(&out[3], events[0].seq);
+    char *p = &out[KP_HEADER_SIZE];
+    p[0] = char(count);
+    put64(&p[1], events[0].timeUs);
+    put64(&p[9], events[0].remoteUs);
+    // The type of the first goes in the top bit of the count
+    if ( events[0].type == KP_KEY_UP ) {
+        p[0] = char(count | 0x80);
+    }
+    p += KP_BATCH_BASE_SIZE;
+    qint64 firstLead = qint64(events[0].remoteUs - events[0].timeUs);
+    for (int i=1; i<count; i++) {
+        put32(p, quint32(events[i].timeUs - events[i - 1].timeUs));
+        put16(&p[4], quint16(qint16(qint64(events[i].remoteUs - events[i].timeUs) - firstLead)));
+        p += KP_BATCH_DELTA_SIZE;
+    }
+    return KP_HEADER_SIZE + len;
+}
+
+KeyStreamParser::KeyStreamParser()
+{
+    reset();
+}
+
+void KeyStreamParser::reset()
+{
+    fill = 0;
+}
+
+char *KeyStreamParser::writePtr(int *space)
+{
+    *space = KP_PARSER_BUFFER - fill;
+    return reinterpret_cast<char *>(&buffer[fill]);
+}
+
+void KeyStreamParser::commit(int bytes)
+{
+    fill += bytes;
+}
+
+void KeyStreamParser::feed(const char *data, int bytes, KeyMessageHandler *handler)
+{
+    while ( bytes > 0 ) {
+        int space;
+        char *p = writePtr(&space);
+        int n = (bytes < space) ? bytes : space;
+        memcpy(p, data, size_t(n));
+        commit(n);
+        parse(handler);
+        data += n;
+        bytes -= n;
+    }
+}
+
+int KeyStreamParser::parse(KeyMessageHandler *handler)
+{
+    return parse(handler, false);
+}
+
+// A text message ends at the next byte that isn't part of it, so its
+// last number can't be taken until something follows. Call flush() once
+// nothing more arrived for a while, or at the end of a datagram.
+int KeyStreamParser::flush(KeyMessageHandler *handler)
+{
+    return parse(handler, true);
+}
+
+bool KeyStreamParser::pending() const
+{
+    return fill > 0;
+}
+
+int KeyStreamParser::parse(KeyMessageHandler *handler, bool atEnd)
+{
+    int pos = 0;
+    int count = 0;
+    while ( pos < fill ) {
+        int used;
+        if ( buffer[pos] == KP_SYNC ) {
+            used = parseFrame(&buffer[pos], fill - pos, handler);
+        } else if ( isAlpha(buffer[pos]) ) {
+            used = parseText(&buffer[pos], fill - pos, handler, atEnd);
+        } else {
+            // Separator or garbage between messages
+            pos++;
+            continue;
+        }
+        if ( used == 0 )
+            break;
+        pos += used;
+        count++;
+    }
+    if ( pos == 0 && fill == KP_PARSER_BUFFER ) {
+        // Full of something that never completes, resync
+        pos = 1;
+    }
+    if ( pos > 0 ) {
+        memmove(buffer, &buffer[pos], size_t(fill - pos));
+        fill -= pos;
+    }
+    return count;
+}
+
+// Returns the bytes used by one complete frame, 0 if more data is needed
+int KeyStreamParser::parseFrame(const quint8 *p, int n, KeyMessageHandler *handler)
+{
+    if ( n < KP_HEADER_SIZE )
+        return 0;
+    int len = p[1];
+    if ( n < KP_HEADER_SIZE + len )
+        return 0;
+    KeyMessage msg;
+    msg.type = p[2];
+    msg.seq = get16(&p[3]);
+    msg.text = false;
+    msg.timeUs = 0;
+    msg.remoteUs = 0;
+    msg.version = 0;
+    int expected = KeyProtocol::payloadSize(msg.type);
+    if ( msg.type == KP_EVENTS && len >= 1 && len >= 1 + p[KP_HEADER_SIZE] * KP_EVENT_SIZE ) {
+        const quint8 *e = &p[KP_HEADER_SIZE + 1];
+        for (int i=0; i<p[KP_HEADER_SIZE]; i++) {
+            msg.seq = get16(e);
+            msg.type = e[2];
+            msg.timeUs = get64(&e[3]);
+            msg.remoteUs = get64(&e[11]);
+            handler->keyMessage(msg);
+            e += KP_EVENT_SIZE;
+        }
+        return KP_HEADER_SIZE + len;
+    }
+    if ( msg.type == KP_ACKS && len >= 9 && len >= 9 + p[KP_HEADER_SIZE + 8] * KP_ACK_SIZE ) {
+        quint64 base = get64(&p[KP_HEADER_SIZE]);
+        const quint8 *a = &p[KP_HEADER_SIZE + 9];
+        for (int i=0; i<p[KP_HEADER_SIZE + 8]; i++) {
+            msg.seq = get16(a);
+            msg.timeUs = base;
+            msg.remoteUs = base + quint64(qint64(qint32(get32(&a[2]))));
+            handler->keyMessage(msg);
+            a += KP_ACK_SIZE;
+        }
+        return KP_HEADER_SIZE + len;
+    }
+    if ( msg.type == KP_BATCH && len >= KP_BATCH_BASE_SIZE ) {
+        int count = p[KP_HEADER_SIZE] & 0x7F;
+        if ( count > 0 && len >= KP_BATCH_BASE_SIZE + (count - 1) * KP_BATCH_DELTA_SIZE ) {
+            const quint8 *b = &p[KP_HEADER_SIZE];
+            msg.type = (b[0] & 0x80) ? KP_KEY_UP : KP_KEY_DOWN;
+            msg.timeUs = get64(&b[1]);
+            msg.remoteUs = get64(&b[9]);
+            qint64 firstLead = qint64(msg.remoteUs - msg.timeUs);
+            handler->keyMessage(msg);
+            b += KP_BATCH_BASE_SIZE;
+            for (int i=1; i<count; i++) {
+                msg.seq++;
+                msg.type = (msg.type == KP_KEY_DOWN) ? KP_KEY_UP : KP_KEY_DOWN;
+                msg.timeUs += get32(b);
+                msg.remoteUs = msg.timeUs + quint64(firstLead + qint16(get16(&b[4])));
+                handler->keyMessage(msg);
+                b += KP_BATCH_DELTA_SIZE;
+            }
+            return KP_HEADER_SIZE + len;
+        }
+    }
+    if ( expected < 0 || expected > len || msg.type == KP_EVENTS || msg.type == KP_ACKS
+         || msg.type == KP_BATCH ) {
+        msg.type = KP_UNKNOWN;
+    } else {
+        msg.timeUs = get64(&p[KP_HEADER_SIZE]);
+        if ( expected == 16 ) {
+            msg.remoteUs = get64(&p[KP_HEADER_SIZE + 8]);
+        }
+    }
+    handler->keyMessage(msg);
+    return KP_HEADER_SIZE + len;
+}
+
+// Text messages are a word followed by numbers, "PP 123 456", without any
+// terminator. A message ends where the next word starts, or at the end of
+// the data once all numbers of a known message type have been seen.
+int KeyStreamParser::parseText(const quint8 *p, int n, KeyMessageHandler *handler, bool atEnd)
+{
+    static const struct {
+        const char *word;
+        quint8 type;
+        int args;
+    } textTypes[] = {
+        { "KD", KP_KEY_DOWN, 2 },
+        { "KU", KP_KEY_UP, 2 },
+        { "P", KP_PING, 1 },
+        { "PP", KP_PONG, 2 },
+        { "V", KP_HELLO, 1 },
+        { "VV", KP_HELLO_ACK, 1 },
+    };
+    int i = 0;
+    while ( i < n && isAlpha(p[i]) )
+        i++;
+    if ( i == n && !atEnd )
+        return 0;
+    KeyMessage msg;
+    msg.type = KP_UNKNOWN;
+    msg.seq = 0;
+    msg.text = true;
+    msg.timeUs = 0;
+    msg.remoteUs = 0;
+    msg.version = 0;
+    int expected = -1;
+    for (size_t t=0; t<sizeof(textTypes)/sizeof(textTypes[0]); t++) {
+        if ( int(strlen(textTypes[t].word)) == i && !memcmp(p, textTypes[t].word, size_t(i)) ) {
+            msg.type = textTypes[t].type;
+            expected = textTypes[t].args;
+        }
+    }
+
+    quint64 args[2] = { 0, 0 };
+    int argc = 0;
+    for (;;) {
+        int j = i;
+        while ( j < n && p[j] == ' ' )
+            j++;
+        if ( j == n ) {
+            if ( !atEnd && (expected < 0 || argc < expected) )
+                return 0;
+            i = j;
+            break;
+        }
+        if ( !isDigit(p[j]) || argc == expected )
+            break;
+        quint64 v = 0;
+        int k = j;
+        while ( k < n && isDigit(p[k]) ) {
+            v = v * 10 + quint64(p[k] - '0');
+            k++;
+        }
+        if ( k == n && !atEnd )
+            return 0;
+        if ( argc < 2 )
+            args[argc] = v;
+        argc++;
+        i = k;
+    }
+
+    switch ( msg.type ) {
+    case KP_KEY_DOWN:
+    case KP_KEY_UP:
+    case KP_PONG:
+        msg.timeUs = args[0] * 1000;
+        msg.remoteUs = args[1] * 1000;
+        break;
+    case KP_PING:
+        msg.timeUs = args[0] * 1000;
+        break;
+    case KP_HELLO:
+    case KP_HELLO_ACK:
+        msg.version = quint32(args[0]);
+        break;
+    }
+    handler->keyMessage(msg);
+    return i;
+}
@@ -0,0 +1,167 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYPROTOCOL_H
+#define KEYPROTOCOL_H
+
+#include <QtGlobal>
+
+// Binary key protocol, used when the server answers the "V 4" hello
+// with "VV 2" or higher. Older servers keep getting the text format.
+//
+// Frame:   sync(0xA5) length type seq(lo) seq(hi) payload[length]
+// Numbers are little endian, times are microseconds.
+//   KD/KU  time(8) remote(8)   edge time, key time in the server clock
+//   P      time(8)             client time
+//   PP     time(8) remote(8)   echoed client time, server time
+//   EV     count(1) count * [seq(2) type(1) time(8) remote(8)]
+//          the last key events, sent over UDP so a lost datagram is
+//          recovered from the next one. The frame's own seq is unused.
+//   ACK    time(8) count(1) count * [seq(2) delta(4)]
+//          server send time of the frame, and the receive time of key
+//          events as a signed delta to it, batched by the server. With
+//          the edge time every acked key event is a round trip probe.
+//          Version 3, and always over UDP.
+//   S      token(8)            session token, 0 asks for a new session.
+//          The server answers with the session's token, the same one
+//          if it resumed it. Version 3.
+//   KB     count(1) time(8) remote(8) (count - 1) * [duration(4) lead(2)]
+//          a batch of key events with consecutive seq from the frame's
+//          seq on, alternating between key down and up. The top bit of
+//          the count is set if the first is a key up. The first has its
+//          edge time and key time, the ones after it the time since the
+//          previous edge (the element duration) and how much the key
+//          time moved against the edge time since the first, signed.
+//          The receiver gets each of them as a separate KD/KU message.
+//          Version 4.
+#define KP_SYNC 0xA5
+#define KP_HEADER_SIZE 5
+#define KP_MAX_FRAME (KP_HEADER_SIZE + 255)
+#define KP_VERSION 4
+#define KP_VERSION_BINARY 2
+#define KP_VERSION_ACKS 3
+#define KP_VERSION_BATCH 4
+#define KP_PARSER_BUFFER 4096
+#define KP_TEXT_FLUSH_MS 20
+#define KP_EVENT_SIZE 19
+#define KP_MAX_EVENTS 8
+#define KP_ACK_SIZE 6
+#define KP_MAX_ACKS 32
+#define KP_BATCH_BASE_SIZE 17
+#define KP_BATCH_DELTA_SIZE 6
+#define KP_MAX_BATCH 32
+
+enum KeyMessageType {
+    KP_UNKNOWN = 0,
+    KP_KEY_DOWN = 1,
+    KP_KEY_UP = 2,
+    KP_PING = 3,
+    KP_PONG = 4,
+    KP_EVENTS = 5,
+    KP_ACKS = 6,
+    KP_SESSION = 7,
+    KP_BATCH = 8,
+    // Text only, used to negotiate the binary format
+    KP_HELLO = 0x10,
+    KP_HELLO_ACK = 0x11
+};
+
+struct KeyMessage
+{
+    quint8 type;
+    quint16 seq;
+    bool text;          // Received in the text format, times were ms
+    quint64 timeUs;     // Sender's time of the edge or ping, ACK: server
+                        // send time
+    quint64 remoteUs;   // KD/KU: time to key the rig, PP: server time,
+                        // ACK: server receive time of key event seq
+    quint32 version;    // V/VV only
+};
+
+class KeyMessageHandler
+{
+public:
+    virtual ~KeyMessageHandler() {}
+    virtual void keyMessage(const KeyMessage &msg) = 0;
+};
+
+class KeyProtocol
+{
+public:
+    // Encode msg as a binary frame into out, which must hold at least
+    // KP_MAX_FRAME bytes. Returns the frame length.
+    static int encode(char *out, const KeyMessage &msg);
+    // Encode a KD/KU (two numbers) or P (one) text message into out,
+    // which must hold at least KP_MAX_FRAME bytes, without allocating.
+    // Returns the length, 0 for other types.
+    static int encodeText(char *out, quint8 type, quint64 first, quint64 second = 0);
+    // Replace the key time (remoteUs) of an encoded KD/KU frame, so one
+    // encoded key event can go to several servers
+    static void setKeyTime(char *frame, quint64 remoteUs);
+    // Encode up to KP_MAX_EVENTS key events into one KP_EVENTS frame,
+    // the receiver gets each of them as a separate KD/KU message
+    static int encodeEvents(char *out, const KeyMessage *events, int count);
+    // Encode up to KP_MAX_ACKS acknowledgements (seq and remoteUs) sent
+    // at sendUs into one KP_ACKS frame, the receiver gets one KP_ACKS
+    // message each
+    static int encodeAcks(char *out, const KeyMessage *acks, int count, quint64 sendUs);
+    // Decode an encoded binary KD/KU frame, false if it is something else
+    static bool decodeKeyEvent(const char *frame, int len, KeyMessage *msg);
+    // True if next can follow prev in a KP_BATCH frame that starts with
+    // first
+    static bool batchable(const KeyMessage &first, const KeyMessage &prev, const KeyMessage &next);
+    // Encode up to KP_MAX_BATCH key events, each batchable() after the
+    // one before it, into one KP_BATCH frame
+    static int encodeBatch(char *out, const KeyMessage *events, int count);
+    // Payload length of a binary message type, -1 if unknown
+    static int payloadSize(quint8 type);
+};
+
+// Incremental parser for a stream of binary frames and text messages.
+// Data is read straight into the parser's buffer (writePtr()/commit()),
+// complete messages are decoded in place and handed to the handler, any
+// number of them per read. Partial messages are kept for the next read.
+class KeyStreamParser
+{
+public:
+    KeyStreamParser();
+
+    char *writePtr(int *space);
+    void commit(int bytes);
+    // Copying variant of writePtr()/commit()
+    void feed(const char *data, int bytes, KeyMessageHandler *handler);
+    // Returns the number of messages handed to the handler
+    int parse(KeyMessageHandler *handler);
+    // Also takes a text message that runs to the end of the data
+    int flush(KeyMessageHandler *handler);
+    bool pending() const;
+    void reset();
+
+private:
+    int parse(KeyMessageHandler *handler, bool atEnd);
+    int parseFrame(const quint8 *p, int n, KeyMessageHandler *handler);
+    int parseText(const quint8 *p, int n, KeyMessageHandler *handler, bool atEnd);
+
+    quint8 buffer[KP_PARSER_BUFFER];
+    int fill;
+};
+
+#endif // KEYPROTOCOL_H
@@ -0,0 +1,607 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <cstring>
+#include "keysender.h"
+#include "keyclock.h"
+#include "keypathtrace.h"
+#include "realtime.h"
+#include "sockettimestamps.h"
+#if defined(Q_OS_WIN)
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+KeySender::KeySender(QObject *parent) :
+    QThread(parent),
+    guiThread(QThread::currentThreadId())
+{
+    guiRing.head.storeRelease(0);
+    guiRing.tail.storeRelease(0);
+    keyRing.head.storeRelease(0);
+    keyRing.tail.storeRelease(0);
+    keyProducer.storeRelease(nullptr);
+    stopRequested.storeRelease(0);
+    stallPolicy.storeRelease(int(FlushBulk));
+    overflowCount.storeRelease(0);
+    transitExcessUs.storeRelease(0);
+    estimateMargin.storeRelease(1);
+    batchPercent.storeRelease(0);
+    pending.reserve(KS_PENDING_RESERVE);
+    outBuf.reserve(KS_PENDING_RESERVE * KP_MAX_FRAME);
+    outTimes.reserve(KS_PENDING_RESERVE);
+    memset(stamps, 0, sizeof(stamps));
+    resetStatistics();
+}
+
+KeySender::~KeySender()
+{
+    stopSending();
+}
+
+void KeySender::startSending()
+{
+    if ( isRunning() )
+        return;
+    stopRequested.storeRelease(0);
+    start(QThread::HighestPriority);
+}
+
+void KeySender::stopSending()
+{
+    if ( !isRunning() )
+        return;
+    stopRequested.storeRelease(1);
+    wake.release();
+    wait();
+}
+
+void KeySender::setSocket(qintptr fd, bool datagram, bool stamped)
+{
+    QMutexLocker locker(&socketLock);
+    socketFd = fd;
+    socketDatagram = datagram;
+    socketStamped = stamped && fd != -1;
+    txCount = 0;
+    stampLock.lock();
+    memset(stamps, 0, sizeof(stamps));
+    stampsWaiting = 0;
+    stampLock.unlock();
+    // Half written data belongs to the old connection. The buffers keep
+    // their capacity, QByteArray::clear() would free it.
+    pending.clear();
+    outBuf.resize(0);
+    outTimes.clear();
+    batchCount = 0;
+    stalled = false;
+    droppingKey = false;
+}
+
+bool KeySender::send(const char *data, int len, KeySendKind kind, qint64 expireUs, qint64 edgeUs, qint64 probeId)
+{
+    if ( len <= 0 || len > KP_MAX_FRAME )
+        return false;
+    Ring &ring = (QThread::currentThreadId() == guiThread) ? guiRing : keyRing;
+    if ( &ring == &keyRing ) {
+        // The key ring belongs to the first other thread that sends, the
+        // key input thread keeps its QThread across restarts
+        QThread *self = QThread::currentThread();
+        if ( keyProducer.loadAcquire() != self && !keyProducer.testAndSetOrdered(nullptr, self) ) {
+            Q_ASSERT_X(false, "KeySender::send", "a second thread producing into the key ring");
+            return false;
+        }
+    }
+    int head = ring.head.loadAcquire();
+    int next = (head + 1) & (KS_RING_SIZE - 1);
+    if ( next == ring.tail.loadAcquire() ) {
+        overflowCount.fetchAndAddOrdered(1);
+        return false;
+    }
+    Entry &e = ring.entries[head];
+    e.enqueueUs = KeyClock::nowUs();
+    e.expireUs = expireUs;
+    e.edgeUs = edgeUs;
+    e.probeId = probeId;
+    e.kind = quint8(kind);
+    e.len = quint16(len);
+    memcpy(e.data, data, size_t(len));
+    ring.head.storeRelease(next);
+    wake.release();
+    return true;
+}
+
+int KeySender::ringDepth(const Ring &ring) const
+{
+    return (ring.head.loadAcquire() - ring.tail.loadAcquire()) & (KS_RING_SIZE - 1);
+}
+
+void KeySender::run()
+{
+    RealTime::enterThread(RT_SEND);
+    KeyPathTrace::nameThread("send");
+    while ( stopRequested.loadAcquire() == 0 ) {
+        bool woken = false;
+        if ( !stalled ) {
+            // Up to when the batch is due
+            int waitMs = KS_IDLE_MS;
+            if ( batchCount > 0 ) {
+                qint64 dueMs = (batchDueUs - KeyClock::nowUs() + 999) / 1000;
+                waitMs = int(qBound(Q_INT64_C(0), dueMs, qint64(KS_IDLE_MS)));
+            }
+            // The kernel's send stamps come shortly after the write
+            if ( stampsWaiting > 0 ) {
+                waitMs = qMin(waitMs, KS_STALL_WAIT_MS);
+            }
+            woken = wake.tryAcquire(1, waitMs);
+        }
+        // The permits only wake the worker, the rings hold the data
+        wake.tryAcquire(wake.available());
+        QMutexLocker locker(&socketLock);
+        int start = pending.size();
+        qint64 firstUs = takeFromRings();
+        if ( metrics && woken && firstUs >= 0 ) {
+            metrics->record(KM_WAKE_SEND, pending[start].dequeueUs - firstUs);
+        }
+        // Depth the new messages found, before this round is written
+        if ( metrics && pending.size() > start ) {
+            metrics->record(KM_SEND_QUEUE, pending.size() + outTimes.size());
+        }
+        flush();
+        if ( socketStamped ) {
+            takeStamps();
+        }
+        statsLock.lock();
+        stats.pendingDepth = pending.size() + outTimes.size();
+        statsLock.unlock();
+        if ( stalled ) {
+            waitWritable();
+        }
+    }
+}
+
+// Take what the two producers queued, in the order it was queued. Each
+// ring is in order by itself, so they are merged as they are taken
+// without sorting. Returns the enqueue time of the first message taken,
+// -1 if there was none.
+qint64 KeySender::takeFromRings()
+{
+    int keyDepth = ringDepth(keyRing);
+    int guiDepth = ringDepth(guiRing);
+    if ( keyDepth == 0 && guiDepth == 0 )
+        return -1;
+    qint64 now = KeyClock::nowUs();
+    QMutexLocker locker(&statsLock);
+    stats.ringMaxDepth = qMax(stats.ringMaxDepth, qMax(keyDepth, guiDepth));
+    qint64 firstUs = -1;
+    int keyTail = keyRing.tail.loadAcquire();
+    int guiTail = guiRing.tail.loadAcquire();
+    while ( keyDepth > 0 || guiDepth > 0 ) {
+        bool fromKey = (guiDepth == 0 || (keyDepth > 0 && keyRing.entries[keyTail].enqueueUs
+                                          <= guiRing.entries[guiTail].enqueueUs));
+        Ring &ring = fromKey ? keyRing : guiRing;
+        int &tail = fromKey ? keyTail : guiTail;
+        pending.append(ring.entries[tail]);
+        Entry &e = pending.last();
+        e.dequeueUs = now;
+        if ( firstUs < 0 ) {
+            firstUs = e.enqueueUs;
+        }
+        qint64 waited = now - e.enqueueUs;
+        queueSumUs += waited;
+        dequeued++;
+        stats.queueMaxUs = qMax(stats.queueMaxUs, waited);
+        tail = (tail + 1) & (KS_RING_SIZE - 1);
+        ring.tail.storeRelease(tail);
+        if ( fromKey ) {
+            keyDepth--;
+        } else {
+            guiDepth--;
+        }
+    }
+    stats.pendingMaxDepth = qMax(stats.pendingMaxDepth, pending.size() + outTimes.size());
+    return firstUs;
+}
+
+// Under the drop policy an expired key down is dropped together with its
+// key up. A key up is never dropped on its own once the key down was
+// sent, the key would be left down at the rig.
+bool KeySender::dropEntry(const Entry &e, qint64 now)
+{
+    if ( e.kind == KS_KEY_ELEMENT ) {
+        // Its key up goes with it
+        bool drop = (stallPolicy.loadAcquire() == int(DropExpired) && e.expireUs >= 0 && now > e.expireUs);
+        if ( drop ) {
+            KeyPathTrace::record(KPS_DROPPED, e.edgeUs, true, 0, now);
+        }
+        return drop;
+    }
+    if ( e.kind == KS_KEY_DOWN ) {
+        droppingKey = (stallPolicy.loadAcquire() == int(DropExpired)
+                       && e.expireUs >= 0 && now > e.expireUs);
+        if ( droppingKey ) {
+            KeyPathTrace::record(KPS_DROPPED, e.edgeUs, true, 0, now);
+        }
+        return droppingKey;
+    }
+    if ( e.kind == KS_KEY_UP && droppingKey ) {
+        droppingKey = false;
+        KeyPathTrace::record(KPS_DROPPED, e.edgeUs, false, 0, now);
+        return true;
+    }
+    return false;
+}
+
+void KeySender::flush()
+{
+    if ( socketFd == -1 ) {
+        // Not connected, nothing to send to
+        pending.clear();
+        outBuf.resize(0);
+        outTimes.clear();
+        batchCount = 0;
+        stalled = false;
+        return;
+    }
+    qint64 now = KeyClock::nowUs();
+    if ( socketDatagram ) {
+        flushDatagrams(now);
+    } else {
+        flushStream(now);
+    }
+}
+
+void KeySender::flushStream(qint64 now)
+{
+    for (;;) {
+        if ( outBuf.isEmpty() ) {
+            fillStream(now);
+            if ( outBuf.isEmpty() )
+                return;
+        }
+        int n = writeSocket(outBuf.constData(), outBuf.size());
+        if ( n < 0 ) {
+            outBuf.resize(0);
+            outTimes.clear();
+            stalled = false;
+            return;
+        }
+        if ( metrics && n > 0 ) {
+            metrics->record(KM_WRITE_BYTES, n);
+        }
+        txCount += quint32(n);
+        outBuf.remove(0, n);
+        if ( !outBuf.isEmpty() ) {
+            if ( !stalled ) {
+                QMutexLocker locker(&statsLock);
+                stats.stalls++;
+            }
+            stalled = true;
+            return;
+        }
+        stalled = false;
+        now = KeyClock::nowUs();
+        for (int i=0; i<outTimes.size(); i++) {
+            written(outTimes[i], now);
+            // Stamped with the write that took its last byte
+            if ( socketStamped && outTimes[i].probeId >= 0 ) {
+                addStamp(outTimes[i], txCount - 1, now);
+            }
+        }
+        outTimes.clear();
+        // Anything queued while stalled, or text held for its own write
+        if ( pending.isEmpty() )
+            return;
+    }
+}
+
+// Move what is waiting into the next write, binary frames all in one.
+// A text message has no terminator, so it gets a write of its own.
+void KeySender::fillStream(qint64 now)
+{
+    quint32 drops = 0;
+    quint32 keyEvents = 0;
+    quint64 keyBytes = 0;
+    bool batching = (batchPercent.loadAcquire() > 0);
+    int taken = 0;
+    while ( taken < pending.size() ) {
+        const Entry &e = pending[taken];
+        bool text = (quint8(e.data[0]) != KP_SYNC);
+        if ( text && (!outBuf.isEmpty() || batchCount > 0) )
+            break;
+        taken++;
+        KeyMessage msg;
+        if ( dropEntry(e, now) ) {
+            drops++;
+        } else if ( batching && (e.kind == KS_KEY_DOWN || e.kind == KS_KEY_UP)
+                    && KeyProtocol::decodeKeyEvent(e.data, e.len, &msg) ) {
+            addToBatch(msg, timing(e), now);
+        } else {
+            if ( e.kind == KS_KEY_ELEMENT && batchCount > 0 ) {
+                // Already paired, but not ahead of earlier key events
+                closeBatch(now);
+            }
+            outBuf.append(e.data, e.len);
+            outTimes.append(timing(e));
+            if ( e.kind != KS_CONTROL ) {
+                keyEvents += (e.kind == KS_KEY_ELEMENT) ? 2 : 1;
+                keyBytes += e.len;
+            }
+            if ( text )
+                break;
+        }
+    }
+    pending.remove(0, taken);
+    if ( batchCount > 0 && (now >= batchDueUs || !batching || !pending.isEmpty()) ) {
+        closeBatch(now);
+    }
+    if ( drops > 0 || keyEvents > 0 ) {
+        QMutexLocker locker(&statsLock);
+        stats.dropped += drops;
+        stats.keyEvents += keyEvents;
+        stats.keyBytes += keyBytes;
+    }
+}
+
+// Write the batch first if the event can't join it
+void KeySender::addToBatch(const KeyMessage &msg, const Timing &t, qint64 now)
+{
+    if ( batchCount > 0 && (batchCount == KP_MAX_BATCH
+                            || !KeyProtocol::batchable(batch[0], batch[batchCount - 1], msg)) ) {
+        closeBatch(now);
+    }
+    // What is left of the slack once the network's excess delay is taken
+    // off, and never held past the edge of a key event sent ahead
+    qint64 dueUs = now;
+    if ( t.expireUs >= 0 ) {
+        qint64 slackUs = t.expireUs - now - transitExcessUs.loadAcquire();
+        dueUs = now + qMax(Q_INT64_C(0), slackUs) * batchPercent.loadAcquire() / 100;
+    }
+    if ( batchCount == 0 || dueUs < batchDueUs ) {
+        batchDueUs = dueUs;
+    }
+    batch[batchCount] = msg;
+    batchTimes[batchCount] = t;
+    batchCount++;
+}
+
+void KeySender::closeBatch(qint64 now)
+{
+    char frame[KP_MAX_FRAME];
+    int len = (batchCount == 1) ? KeyProtocol::encode(frame, batch[0])
+                                : KeyProtocol::encodeBatch(frame, batch, batchCount);
+    outBuf.append(frame, len);
+    for (int i=0; i<batchCount; i++) {
+        outTimes.append(batchTimes[i]);
+        if ( metrics ) {
+            metrics->record(KM_BATCH_HOLD, now - batchTimes[i].dequeueUs);
+        }
+    }
+    QMutexLocker locker(&statsLock);
+    stats.keyEvents += quint32(batchCount);
+    stats.keyBytes += quint64(len);
+    stats.batches++;
+    batchCount = 0;
+}
+
+void KeySender::flushDatagrams(qint64 now)
+{
+    quint32 drops = 0;
+    int done = 0;
+    while ( done < pending.size() ) {
+        const Entry &e = pending[done];
+        if ( dropEntry(e, now) ) {
+            drops++;
+            done++;
+            continue;
+        }
+        int n = writeSocket(e.data, e.len);
+        if ( n == 0 ) {
+            if ( !stalled ) {
+                QMutexLocker locker(&statsLock);
+                stats.stalls++;
+            }
+            stalled = true;
+            break;
+        }
+        stalled = false;
+        if ( n > 0 ) {
+            written(timing(e), KeyClock::nowUs());
+            txCount++;
+            if ( socketStamped && e.probeId >= 0 ) {
+                addStamp(timing(e), txCount - 1, KeyClock::nowUs());
+            }
+            if ( metrics ) {
+                metrics->record(KM_WRITE_BYTES, n);
+            }
+            if ( e.kind != KS_CONTROL ) {
+                QMutexLocker locker(&statsLock);
+                stats.keyEvents += (e.kind == KS_KEY_ELEMENT) ? 2 : 1;
+                stats.keyBytes += quint64(n);
+            }
+        }
+        done++;
+    }
+    pending.remove(0, done);
+    if ( drops > 0 ) {
+        QMutexLocker locker(&statsLock);
+        stats.dropped += drops;
+    }
+}
+
+// Bytes accepted by the socket, 0 if it would block, -1 on error
+int KeySender::writeSocket(const char *data, int len)
+{
+#if defined(Q_OS_WIN)
+    int n = ::send(SOCKET(socketFd), data, len, 0);
+    if ( n == SOCKET_ERROR ) {
+        return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+    }
+    return n;
+#else
+    for (;;) {
+        ssize_t n = ::send(int(socketFd), data, size_t(len), MSG_NOSIGNAL);
+        if ( n >= 0 )
+            return int(n);
+        if ( errno == EINTR )
+            continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) ? 0 : -1;
+    }
+#endif
+}
+
+void KeySender::waitWritable()
+{
+#if defined(Q_OS_WIN)
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(SOCKET(socketFd), &set);
+    timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = KS_STALL_WAIT_MS * 1000;
+    select(0, nullptr, &set, nullptr, &tv);
+#else
+    struct pollfd pfd;
+    pfd.fd = int(socketFd);
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    poll(&pfd, 1, KS_STALL_WAIT_MS);
+#endif
+}
+
+KeySender::Timing KeySender::timing(const Entry &e)
+{
+    Timing t;
+    t.enqueueUs = e.enqueueUs;
+    t.dequeueUs = e.dequeueUs;
+    t.expireUs = e.expireUs;
+    t.edgeUs = e.edgeUs;
+    t.probeId = e.probeId;
+    t.kind = e.kind;
+    return t;
+}
+
+void KeySender::addStamp(const Timing &t, quint32 key, qint64 now)
+{
+    QMutexLocker locker(&stampLock);
+    SendStamp &s = stamps[stampNext];
+    if ( s.probeId != 0 && s.txUs < 0 ) {
+        stampsWaiting--;
+    }
+    s.probeId = t.probeId;
+    s.key = key;
+    s.enqueueUs = t.enqueueUs;
+    s.writeUs = now;
+    s.txUs = -1;
+    stampsWaiting++;
+    stampNext = (stampNext + 1) % KS_STAMPS;
+}
+
+// Every write is stamped, only the probes' stamps are kept
+void KeySender::takeStamps()
+{
+    quint32 id;
+    qint64 txUs;
+    while ( SocketTimestamps::takeSendStamp(socketFd, &id, &txUs) ) {
+        if ( txUs < 0 || stampsWaiting == 0 )
+            continue;
+        QMutexLocker locker(&stampLock);
+        for (int i=0; i<KS_STAMPS; i++) {
+            SendStamp &s = stamps[i];
+            if ( s.probeId != 0 && s.txUs < 0 && s.key == id ) {
+                s.txUs = txUs;
+                stampsWaiting--;
+                if ( metrics ) {
+                    metrics->record(KM_TX_STACK, txUs - s.enqueueUs);
+                }
+            }
+        }
+    }
+    // Not stamped after all, a lost stamp doesn't keep the worker busy
+    QMutexLocker locker(&stampLock);
+    qint64 now = KeyClock::nowUs();
+    for (int i=0; i<KS_STAMPS && stampsWaiting > 0; i++) {
+        SendStamp &s = stamps[i];
+        if ( s.probeId != 0 && s.txUs < 0 && now - s.writeUs > KS_STAMP_TIMEOUT_MS * 1000 ) {
+            s.probeId = 0;
+            stampsWaiting--;
+        }
+    }
+}
+
+qint64 KeySender::sentUs(qint64 probeId)
+{
+    QMutexLocker locker(&stampLock);
+    for (int i=0; i<KS_STAMPS; i++) {
+        if ( stamps[i].probeId == probeId ) {
+            return stamps[i].txUs;
+        }
+    }
+    return -1;
+}
+
+void KeySender::written(const Timing &t, qint64 now)
+{
+    if ( t.kind != KS_CONTROL ) {
+        // An element by its key down
+        KeyPathTrace::record(KPS_WRITTEN, t.edgeUs, t.kind != KS_KEY_UP, 0, now);
+    }
+    if ( metrics ) {
+        // Key events sent ahead of their edge (text keyer) have none
+        if ( t.edgeUs >= 0 && t.edgeUs <= now ) {
+            metrics->record(KM_EDGE_TO_WRITE, now - t.edgeUs);
+        }
+        if ( t.expireUs >= 0 && estimateMargin.loadAcquire() ) {
+            metrics->record(KM_KEYTIME_MARGIN, t.expireUs - now - transitExcessUs.loadAcquire());
+        }
+    }
+    QMutexLocker locker(&statsLock);
+    qint64 us = now - t.dequeueUs;
+    writeSumUs += us;
+    stats.writeMaxUs = qMax(stats.writeMaxUs, us);
+    stats.sent++;
+}
+
+KeySenderStats KeySender::statistics()
+{
+    QMutexLocker locker(&statsLock);
+    KeySenderStats s = stats;
+    s.ringDepth = ringDepth(guiRing) + ringDepth(keyRing);
+    s.queueAvgUs = dequeued ? queueSumUs / dequeued : 0;
+    s.writeAvgUs = stats.sent ? writeSumUs / stats.sent : 0;
+    s.overflows = quint32(overflowCount.loadAcquire());
+    return s;
+}
+
+void KeySender::resetStatistics()
+{
+    QMutexLocker locker(&statsLock);
+    memset(&stats, 0, sizeof(stats));
+    queueSumUs = 0;
+    writeSumUs = 0;
+    dequeued = 0;
+    overflowCount.storeRelease(0);
+}
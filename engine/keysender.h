@@ -0,0 +1,235 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYSENDER_H
+#define KEYSENDER_H
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QSemaphore>
+#include <QMutex>
+#include <QByteArray>
+#include <QVector>
+#include "keyprotocol.h"
+#include "keymetrics.h"
+
+// Entries per producer ring, a power of two
+#define KS_RING_SIZE 256
+// Longest wait for new data when nothing is pending
+#define KS_IDLE_MS 100
+// Wait for the socket to become writable again when stalled
+#define KS_STALL_WAIT_MS 1
+// Messages held by the worker without allocating, it grows beyond only
+// while the link is stalled
+#define KS_PENDING_RESERVE (2 * KS_RING_SIZE)
+// Probes whose kernel send time is kept, and how long it is waited for
+#define KS_STAMPS 64
+#define KS_STAMP_TIMEOUT_MS 500
+
+// What is sent, key events may be dropped under the drop policy. An
+// element is a key down and its key up in one message.
+enum KeySendKind { KS_CONTROL, KS_KEY_DOWN, KS_KEY_UP, KS_KEY_ELEMENT };
+
+// Counters of the send pipeline. Ring is producer to worker, pending is
+// held by the worker while the socket doesn't accept more data.
+struct KeySenderStats {
+    int ringDepth;
+    int ringMaxDepth;
+    int pendingDepth;
+    int pendingMaxDepth;
+    qint64 queueAvgUs;      // Enqueued to taken by the worker
+    qint64 queueMaxUs;
+    qint64 writeAvgUs;      // Taken by the worker to accepted by the socket
+    qint64 writeMaxUs;
+    quint32 sent;
+    quint32 dropped;        // Expired under the drop policy
+    quint32 overflows;      // Ring full, never blocks the producer
+    quint32 stalls;
+    quint32 keyEvents;      // Written, and the bytes they took on the wire
+    quint64 keyBytes;
+    quint32 batches;
+};
+
+// Network worker thread that does all writes to the key socket. The key
+// input thread and the GUI thread each have their own lock free single
+// producer ring, so queueing a message never blocks on the network.
+// The worker writes to the non blocking socket descriptor, coalescing
+// the binary frames waiting for a TCP socket into one write, text
+// messages have no terminator and get a write each. When the socket
+// doesn't take more (a stalled link) messages are held back and the
+// stall policy decides what to do with key events whose keytime has
+// passed by the time they can be written. The worker's buffers are
+// allocated up front, sending makes no heap allocation as long as the
+// link keeps up.
+//
+// With batching on key events for a stream are held back and go out
+// together in one KP_BATCH frame, so fast keying doesn't cost a packet
+// per element. A batch is written once the given percentage of the
+// slack its first event had left (its keytime minus the time it was
+// taken) has passed, when it is full, or when the next event can't be
+// added to it.
+//
+// On a socket with kernel timestamps the worker takes the kernel's send
+// time of every probe (a message queued with a probe id) off the
+// socket's error queue, sentUs() has it for the round trip.
+class KeySender : public QThread
+{
+    Q_OBJECT
+
+public:
+    enum StallPolicy {
+        FlushBulk,      // Send everything as soon as the link takes it
+        DropExpired     // Drop key events that can only arrive late
+    };
+
+    KeySender(QObject *parent = nullptr);
+    ~KeySender();
+
+    void startSending();
+    void stopSending();
+
+    // Native descriptor of the connected key socket, -1 when closed.
+    // Returns when the worker is no longer writing to the old one.
+    // stamped if SocketTimestamps were enabled on it.
+    void setSocket(qintptr fd, bool datagram, bool stamped = false);
+    void setStallPolicy(StallPolicy policy) { stallPolicy.storeRelease(int(policy)); }
+    StallPolicy policy() const { return StallPolicy(stallPolicy.loadAcquire()); }
+
+    // Queue a message, only called from the GUI thread and one other
+    // thread, the key input thread. A third producer is refused.
+    // expireUs is the KeyClock time when a key event is late at the
+    // server, -1 if it never expires. edgeUs is the KeyClock time of the
+    // key edge, -1 for anything else. probeId identifies a message whose
+    // kernel send time is wanted, -1 if it isn't.
+    bool send(const char *data, int len, KeySendKind kind = KS_CONTROL, qint64 expireUs = -1,
+              qint64 edgeUs = -1, qint64 probeId = -1);
+    // KeyClock time the kernel sent the probe, -1 if unknown (yet)
+    qint64 sentUs(qint64 probeId);
+
+    // Histograms of queue depth, edge to write and the key time margin,
+    // set before the first send
+    void setMetrics(KeyMetrics *m) { metrics = m; }
+    // How much slower than the fastest packet the network is right now,
+    // taken off the margin a key event has when it is written
+    void setTransitExcessUs(qint64 us) { transitExcessUs.storeRelease(us); }
+    // Off when the server acknowledges key events with the real margin
+    void setEstimateMargin(bool on) { estimateMargin.storeRelease(on ? 1 : 0); }
+    // Percentage of the slack to spend on batching key events, 0 sends
+    // every event on its own. Only for a stream to a server that knows
+    // KP_BATCH.
+    void setBatchPercent(int percent) { batchPercent.storeRelease(qBound(0, percent, 100)); }
+
+    KeySenderStats statistics();
+    void resetStatistics();
+
+protected:
+    void run() override;
+
+private:
+    struct Entry {
+        qint64 enqueueUs;
+        qint64 dequeueUs;
+        qint64 expireUs;
+        qint64 edgeUs;
+        qint64 probeId;
+        quint8 kind;
+        quint16 len;
+        char data[KP_MAX_FRAME];
+    };
+    struct Timing {
+        qint64 enqueueUs;
+        qint64 dequeueUs;
+        qint64 expireUs;
+        qint64 edgeUs;
+        qint64 probeId;
+        quint8 kind;
+    };
+    struct SendStamp {
+        qint64 probeId;
+        quint32 key;            // Write counter the kernel reports it with
+        qint64 enqueueUs;
+        qint64 writeUs;
+        qint64 txUs;            // -1 until the kernel's stamp is taken
+    };
+    struct Ring {
+        Entry entries[KS_RING_SIZE];
+        QAtomicInt head;
+        QAtomicInt tail;
+    };
+    int ringDepth(const Ring &ring) const;
+    qint64 takeFromRings();
+    bool dropEntry(const Entry &e, qint64 now);
+    void flush();
+    void flushStream(qint64 now);
+    void fillStream(qint64 now);
+    void flushDatagrams(qint64 now);
+    void addToBatch(const KeyMessage &msg, const Timing &t, qint64 now);
+    void closeBatch(qint64 now);
+    int writeSocket(const char *data, int len);
+    void waitWritable();
+    static Timing timing(const Entry &e);
+    void written(const Timing &t, qint64 now);
+    void addStamp(const Timing &t, quint32 key, qint64 now);
+    void takeStamps();
+
+    Qt::HANDLE guiThread;
+    Ring guiRing;
+    Ring keyRing;
+    QAtomicPointer<QThread> keyProducer;
+    QSemaphore wake;
+    QAtomicInt stopRequested;
+    QAtomicInt stallPolicy;
+    QAtomicInt overflowCount;
+    QAtomicInteger<qint64> transitExcessUs;
+    QAtomicInt estimateMargin;
+    QAtomicInt batchPercent;
+    KeyMetrics *metrics = nullptr;
+
+    // Worker side
+    QMutex socketLock;
+    qintptr socketFd = -1;
+    bool socketDatagram = false;
+    QVector<Entry> pending;
+    QByteArray outBuf;          // Committed to a stream, written in full
+    QVector<Timing> outTimes;   // Of what is in outBuf
+    bool stalled = false;
+    bool droppingKey = false;
+    KeyMessage batch[KP_MAX_BATCH];
+    Timing batchTimes[KP_MAX_BATCH];
+    int batchCount = 0;
+    qint64 batchDueUs = 0;
+    bool socketStamped = false;
+    quint32 txCount = 0;        // Bytes or datagrams since stamping began
+
+    QMutex stampLock;
+    SendStamp stamps[KS_STAMPS];
+    int stampNext = 0;
+    int stampsWaiting = 0;
+
+    QMutex statsLock;
+    KeySenderStats stats;
+    qint64 queueSumUs = 0;
+    qint64 writeSumUs = 0;
+    quint32 dequeued = 0;
+};
+
+#endif // KEYSENDER_H
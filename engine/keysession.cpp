@@ -0,0 +1,946 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTcpSocket>
+#include <QUdpSocket>
+#include <QDebug>
+#include <cstring>
+#include <algorithm>
+#include "keysession.h"
+#include "keyclock.h"
+#include "keypathtrace.h"
+#include "sockettimestamps.h"
+
+KeySession::KeySession(KeySessionHandler *handler) :
+    handler(handler)
+{
+    controlSeq.storeRelease(0);
+    keyIsDownSent.storeRelease(0);
+    awaitingRxUs.storeRelease(0);
+    memset(sentEvents, 0, sizeof(sentEvents));
+    lastKeyEdgeUs.storeRelease(0);
+    impairmentActive.storeRelease(0);
+    keyTransportUdp.storeRelease(0);
+    keyProtocolBinary.storeRelease(0);
+    serverBatches.storeRelease(0);
+    packetDelay.storeRelease(300);
+    acksSeen.storeRelease(0);
+    sentOffsetUs.storeRelease(0);
+    prevSentOffsetUs.storeRelease(0);
+
+    // Setup Key TCP connection, the Qt sockets are only used for
+    // connecting and reading, all writes are done by keySender
+    tcpKeySocket = new QTcpSocket();
+    tcpKeySocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    QObject::connect(tcpKeySocket, &QTcpSocket::readyRead, [this]() { readyReadKeyTcp(); });
+    QObject::connect(tcpKeySocket, &QTcpSocket::connected, [this]() { keyNetConnected(); });
+    QObject::connect(tcpKeySocket, &QTcpSocket::aboutToClose, [this]() { keyNetDisconnected(); });
+    QObject::connect(tcpKeySocket, &QTcpSocket::disconnected, [this]() { keyNetDisconnected(); });
+    // A failed connection attempt only shows up as a state change
+    QObject::connect(tcpKeySocket, &QTcpSocket::stateChanged, [this](QAbstractSocket::SocketState state) {
+        if ( state == QAbstractSocket::UnconnectedState )
+            keyNetDisconnected();
+    });
+
+    // Setup Key UDP connection, used instead of TCP when selected
+    udpKeySocket = new QUdpSocket();
+    QObject::connect(udpKeySocket, &QUdpSocket::readyRead, [this]() { readyReadKeyUdp(); });
+    QObject::connect(udpKeySocket, &QUdpSocket::connected, [this]() { keyNetConnected(); });
+    QObject::connect(udpKeySocket, &QUdpSocket::aboutToClose, [this]() { keyNetDisconnected(); });
+    QObject::connect(udpKeySocket, &QUdpSocket::stateChanged, [this](QAbstractSocket::SocketState state) {
+        if ( state == QAbstractSocket::UnconnectedState )
+            keyNetDisconnected();
+    });
+
+    keySender.startSending();
+}
+
+KeySession::~KeySession()
+{
+    // Closing the sockets below is not reported and not reconnected
+    handler = nullptr;
+    connState = KC_DISCONNECTED;
+    keySender.stopSending();
+    tcpKeySocket->close();
+    udpKeySocket->close();
+    delete tcpKeySocket;
+    delete udpKeySocket;
+}
+
+void KeySession::restartSending()
+{
+    keySender.stopSending();
+    keySender.startSending();
+}
+
+void KeySession::setTrace(KeyTraceWriter *writer, const QAtomicInt *on)
+{
+    trace = writer;
+    tracing = on;
+}
+
+void KeySession::setMetrics(KeyMetrics *m)
+{
+    metrics = m;
+    keySender.setMetrics(m);
+}
+
+void KeySession::tick(qint64 now)
+{
+    manageConnection(now);
+    // Probe the link when key events haven't done it lately, and repeat
+    // the ping while waiting for any answer
+    int intervalMs = awaitingRxUs.loadAcquire() ? KE_LINK_TIMEOUT_MS / 3 : probeIntervalMs;
+    if ( connState == KC_CONNECTED && now - lastProbeUs >= qint64(intervalMs) * 1000 ) {
+        lastProbeUs = now;
+        ping();
+    }
+    applyPendingKeyDelay();
+    if ( !keyTransportUdp.loadAcquire() && keyParser.pending() && now - keyReadUs >= KP_TEXT_FLUSH_MS * 1000 ) {
+        keyParser.flush(this);
+    }
+    if ( keyTransportUdp.loadAcquire() ) {
+        char frame[KP_MAX_FRAME];
+        int len = udpStream.repeat(KeyClock::nowUs(), frame);
+        if ( len > 0 ) {
+            writeKeyData(frame, len);
+        }
+    }
+    sendImpairedData();
+}
+
+void KeySession::receiveMessage(const KeyMessage &msg, qint64 rxUs)
+{
+    keyRxUs = rxUs;
+    keyMessage(msg);
+}
+
+void KeySession::restoreConfig(int delayMs, int flags, double onTimeFraction)
+{
+    packetDelay.storeRelease(delayMs);
+    keyProtocolBinary.storeRelease((flags & KT_FLAG_BINARY) ? 1 : 0);
+    autoKeyDelay = (flags & KT_FLAG_AUTO) != 0;
+    keyTransportUdp.storeRelease((flags & KT_FLAG_UDP) ? 1 : 0);
+    onTime = onTimeFraction;
+}
+
+void KeySession::setTransportUdp(bool udp)
+{
+    if ( udp == transportUdp() )
+        return;
+    // Changing transport closes the current connection and opens one
+    // over the other transport
+    bool wanted = isServerOpen();
+    if ( wanted ) {
+        setConnectionState(KC_DISCONNECTED);
+        keySocket()->abort();
+    }
+    keyTransportUdp.storeRelease(udp ? 1 : 0);
+    if ( wanted ) {
+        backoffMs = KE_RECONNECT_MIN_MS;
+        startConnect();
+    }
+}
+
+void KeySession::connectToServer(const QString &host, quint16 port)
+{
+    if ( isServerOpen() ) {
+        setConnectionState(KC_DISCONNECTED);
+        keySocket()->abort();
+    }
+    serverHost = host;
+    serverPort = port;
+    backoffMs = KE_RECONNECT_MIN_MS;
+    startConnect();
+}
+
+void KeySession::disconnectFromServer()
+{
+    setConnectionState(KC_DISCONNECTED);
+    keySocket()->close();
+}
+
+void KeySession::setConnectionState(KeyConnectionState state)
+{
+    if ( state == connState )
+        return;
+    connState = state;
+    if ( handler ) {
+        handler->sessionStateChanged(this, state);
+    }
+}
+
+void KeySession::startConnect()
+{
+    // Whatever is left of the last attempt, not reported
+    keySocket()->abort();
+    connectStartUs = KeyClock::nowUs();
+    setConnectionState(KC_CONNECTING);
+    // With kernel timestamps the data is read straight from the socket,
+    // Qt must not read it into its buffer first
+    QIODevice::OpenMode mode = QIODevice::ReadWrite;
+    if ( kernelStamps && !keyTransportUdp.loadAcquire() ) {
+        mode |= QIODevice::Unbuffered;
+    }
+    keySocket()->connectToHost(serverHost, serverPort, mode);
+}
+
+// Reconnect after the backoff, give up attempts that hang and drop a
+// connection that stopped answering. On a 4G link TCP can take minutes
+// to notice a dead connection on its own.
+void KeySession::manageConnection(qint64 now)
+{
+    switch ( connState ) {
+    case KC_RECONNECTING:
+        if ( now >= reconnectAtUs ) {
+            reconnects++;
+            startConnect();
+        }
+        break;
+    case KC_CONNECTING:
+        if ( now - connectStartUs > qint64(KE_CONNECT_TIMEOUT_MS) * 1000 ) {
+            keySocket()->abort();
+        }
+        break;
+    case KC_CONNECTED: {
+        qint64 since = awaitingRxUs.loadAcquire();
+        if ( since != 0 && now - since > qint64(KE_LINK_TIMEOUT_MS) * 1000 ) {
+            qDebug() << "Key server not answering, reconnecting";
+            keySocket()->abort();
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void KeySession::setNetImpairment(const NetImpairment &sim)
+{
+    QMutexLocker locker(&impairedLock);
+    netImpairment = sim;
+    impairmentActive.storeRelease(sim.isActive() ? 1 : 0);
+}
+
+QAbstractSocket *KeySession::keySocket() const
+{
+    if ( keyTransportUdp.loadAcquire() )
+        return udpKeySocket;
+    return tcpKeySocket;
+}
+
+void KeySession::ping()
+{
+    sendPing();
+}
+
+void KeySession::sendPing()
+{
+    awaitingRxUs.testAndSetOrdered(0, qMax(Q_INT64_C(1), KeyClock::nowUs()));
+    qint64 nowUs = KeyClock::epochUs();
+    if ( keyProtocolBinary.loadAcquire() ) {
+        KeyMessage msg;
+        msg.type = KP_PING;
+        msg.seq = quint16(controlSeq.fetchAndAddOrdered(1));
+        msg.timeUs = quint64(nowUs);
+        msg.remoteUs = 0;
+        char frame[KP_MAX_FRAME];
+        // The send time identifies it when the pong comes back
+        writeKeyData(frame, KeyProtocol::encode(frame, msg), KS_CONTROL, -1, -1, nowUs);
+        return;
+    }
+    quint32 ms = ((nowUs / 1000) % 4294967295);
+    char text[KP_MAX_FRAME];
+    writeKeyData(text, KeyProtocol::encodeText(text, KP_PING, ms));
+}
+
+void KeySession::sendKeyEvent(const KeyMessage &event, const char *frame, int len, qint64 edgeUs,
+                              qint64 aheadUs)
+{
+    // On the stack, the key input thread makes no heap allocation
+    char out[KP_MAX_FRAME];
+    KeyMessage sent;
+    // The connection may change on the GUI thread meanwhile
+    bool binary = keyProtocolBinary.loadAcquire();
+    bool udp = keyTransportUdp.loadAcquire();
+    qint64 delayUs = qint64(packetDelay.loadAcquire()) * 1000;
+    if ( aheadUs > 0 ) {
+        delayUs = qMax(qint64(CW_MIN_DELAY) * 1000, delayUs - aheadUs);
+    }
+    int n = encodeKeyEvent(event, frame, len, edgeUs, delayUs, binary, udp, out, &sent);
+    // Written after this it can only be played late
+    qint64 expireUs = edgeUs + delayUs;
+    writeKeyData(out, n, (event.type == KP_KEY_DOWN) ? KS_KEY_DOWN : KS_KEY_UP, expireUs, edgeUs);
+}
+
+// The key up is written with the key down, as one batch if the server
+// knows them. Over UDP the key up's datagram carries the key down too,
+// unless the datagrams carry a single event or text.
+void KeySession::sendKeyElement(const KeyMessage &down, const KeyMessage &up, qint64 downUs, qint64 upUs)
+{
+    // Two key event frames fit in one message, two datagrams might not
+    char out[2 * KP_MAX_FRAME];
+    KeyMessage sent[2];
+    // The connection may change on the GUI thread meanwhile, both events
+    // are encoded and sent the same way
+    bool binary = keyProtocolBinary.loadAcquire();
+    bool udp = keyTransportUdp.loadAcquire();
+    qint64 delayUs = qint64(packetDelay.loadAcquire()) * 1000;
+    int n = encodeKeyEvent(down, nullptr, 0, downUs, delayUs, binary, udp, out, &sent[0]);
+    int m = encodeKeyEvent(up, nullptr, 0, upUs, delayUs, binary, udp, out + n, &sent[1]);
+    // A text server reads one message per line, so it gets two entries
+    if ( !binary || ( udp && udpStream.eventsPerDatagram() < 2 ) ) {
+        writeKeyData(out, n, KS_KEY_DOWN, downUs + delayUs, downUs);
+        writeKeyData(out + n, m, KS_KEY_UP, upUs + delayUs, upUs);
+        return;
+    }
+    if ( udp ) {
+        writeKeyData(out + n, m, KS_KEY_ELEMENT, downUs + delayUs, downUs);
+        return;
+    }
+    if ( serverBatches.loadAcquire() && KeyProtocol::batchable(sent[0], sent[0], sent[1]) ) {
+        n = KeyProtocol::encodeBatch(out, sent, 2);
+        m = 0;
+    }
+    writeKeyData(out, n + m, KS_KEY_ELEMENT, downUs + delayUs, downUs);
+}
+
+// This server's key time for the key event, kept for its ack and traced.
+// The frame is encoded into out, from the engine's frame with a zero key
+// time if there is one, and *sent is the event as sent. binary and udp
+// are the connection as the caller sends on it. Returns the length, for
+// UDP the datagram.
+int KeySession::encodeKeyEvent(const KeyMessage &event, const char *frame, int len, qint64 edgeUs,
+                               qint64 delayUs, bool binary, bool udp, char *out, KeyMessage *sent)
+{
+    bool down = (event.type == KP_KEY_DOWN);
+    qint64 edgeEpochUs = qint64(event.timeUs);
+    unsigned long keytime, remdiff;
+    keyIsDownSent.storeRelease(down ? 1 : 0);
+    lastKeyEdgeUs.storeRelease(edgeUs);
+    // Server time of the edge plus the fastest one way delay, so the key
+    // delay only has to cover the jitter on top of it
+    qint64 toServerUs;
+    clockLock.lock();
+    toServerUs = clockSync.offsetUs(edgeEpochUs) + clockSync.minOneWayUs();
+    clockLock.unlock();
+    prevSentOffsetUs.storeRelease(sentOffsetUs.loadAcquire());
+    *sent = event;
+    qint64 offsetUs;
+    if ( binary ) {
+        KeyMessage &msg = *sent;
+        msg.remoteUs = quint64(edgeEpochUs + toServerUs + delayUs);
+        offsetUs = qint64(msg.remoteUs) - edgeEpochUs;
+        sentOffsetUs.storeRelease(offsetUs);
+        KeyPathTrace::record(KPS_KEYTIME, edgeUs, down, offsetUs);
+        sentLock.lock();
+        SentEvent &entry = sentEvents[msg.seq % KE_SENT_EVENTS];
+        entry.seq = msg.seq;
+        entry.type = msg.type;
+        entry.waiting = true;
+        entry.repeated = false;
+        entry.edgeUs = edgeEpochUs;
+        entry.keyTimeUs = qint64(msg.remoteUs);
+        entry.delayUs = delayUs;
+        entry.leadUs = qMax(Q_INT64_C(0), edgeUs - KeyClock::nowUs());
+        sentLock.unlock();
+        // The ack is the answer
+        if ( acksSeen.loadAcquire() ) {
+            awaitingRxUs.testAndSetOrdered(0, qMax(Q_INT64_C(1), KeyClock::nowUs()));
+        }
+        if ( isTracing() ) {
+            trace->record(KT_SENT, edgeUs, offsetUs);
+        }
+        if ( udp )
+            return udpStream.addEvent(msg, KeyClock::nowUs(), out);
+        if ( frame == nullptr )
+            return KeyProtocol::encode(out, msg);
+        // Only the key time differs between the servers
+        memcpy(out, frame, size_t(len));
+        KeyProtocol::setKeyTime(out, msg.remoteUs);
+        return len;
+    }
+    quint32 ms = ((edgeEpochUs / 1000) % 4294967295);
+    remdiff = quint32(qint32(qRound64(toServerUs / 1000.0)));
+    keytime = remdiff + (ms&0xFFFFFFFF) + quint32(delayUs / 1000);
+    offsetUs = qint64(qint32(quint32(keytime) - ms)) * 1000;
+    sentOffsetUs.storeRelease(offsetUs);
+    KeyPathTrace::record(KPS_KEYTIME, edgeUs, down, offsetUs);
+    if ( isTracing() ) {
+        trace->record(KT_SENT, edgeUs, offsetUs);
+    }
+    return KeyProtocol::encodeText(out, event.type, ms, quint64(keytime));
+}
+
+
+void KeySession::setBatchPercent(int percent)
+{
+    batchSlackPercent = qBound(0, percent, 100);
+    if ( serverBatches.loadAcquire() && !keyTransportUdp.loadAcquire() ) {
+        keySender.setBatchPercent(batchSlackPercent);
+    }
+}
+
+void KeySession::writeKeyData(const char *data, int len, KeySendKind kind, qint64 expireUs,
+                              qint64 edgeUs, qint64 probeId)
+{
+    // Checked without the lock, the key input thread only takes it with
+    // a simulated network
+    if ( impairmentActive.loadAcquire() ) {
+        // Held back until the simulated network delivers it, or dropped
+        QMutexLocker locker(&impairedLock);
+        qint64 arrival = netImpairment.arrivalUs(KeyClock::nowUs(), !keyTransportUdp.loadAcquire());
+        if ( arrival >= 0 ) {
+            ImpairedData d;
+            d.arrivalUs = arrival;
+            d.kind = kind;
+            d.data = QByteArray(data, len);
+            impairedQueue.append(d);
+        }
+        return;
+    }
+    keySender.send(data, len, kind, expireUs, edgeUs, probeId);
+}
+
+void KeySession::sendImpairedData()
+{
+    QList<ImpairedData> due;
+    {
+        QMutexLocker locker(&impairedLock);
+        qint64 now = KeyClock::nowUs();
+        for (int i=0; i<impairedQueue.size(); ) {
+            if ( impairedQueue[i].arrivalUs <= now ) {
+                due.append(impairedQueue.takeAt(i));
+            } else {
+                i++;
+            }
+        }
+    }
+    // The simulated network decides how late it is, never dropped here
+    foreach (ImpairedData d, due) {
+        keySender.send(d.data.constData(), d.data.size(), d.kind);
+    }
+}
+
+void KeySession::keyNetConnected()
+{
+    qintptr fd = keySocket()->socketDescriptor();
+    socketStamped = kernelStamps && SocketTimestamps::enable(fd);
+    keySender.setSocket(fd, keyTransportUdp.loadAcquire(), socketStamped);
+    keyParser.reset();
+    awaitingRxUs.storeRelease(0);
+    backoffMs = KE_RECONNECT_MIN_MS;
+    resumed = false;
+    QString server = QString("%1:%2/%3").arg(serverHost).arg(serverPort).arg(keyTransportUdp.loadAcquire() ? "UDP" : "TCP");
+    if ( server != lastServer ) {
+        // Nothing learned about the last server applies. Reconnecting to
+        // the same one keeps the clock and delay estimates and the
+        // unacknowledged key events for the session resume.
+        lastServer = server;
+        clockLock.lock();
+        clockSync.reset();
+        clockLock.unlock();
+        sentLock.lock();
+        memset(sentEvents, 0, sizeof(sentEvents));
+        sentLock.unlock();
+        playoutEstimator.reset();
+        acksSeen.storeRelease(0);
+        keySender.setEstimateMargin(true);
+        sessionToken = 0;
+        helloBinary = false;
+    }
+    setConnectionState(KC_CONNECTED);
+    // Until the server says it takes batches
+    serverBatches.storeRelease(0);
+    keySender.setBatchPercent(0);
+    if ( keyTransportUdp.loadAcquire() ) {
+        // Only servers that know the binary protocol listen on UDP
+        keyProtocolBinary.storeRelease(1);
+        udpStream.reset();
+        traceConfig();
+        sendSession();
+        return;
+    }
+    // Offer the binary protocol, an old server doesn't answer and the
+    // text format is used
+    keyProtocolBinary.storeRelease(0);
+    traceConfig();
+    if ( !offerBinary )
+        return;
+    QByteArray Data("V ");
+    Data.append(QByteArray::number(KP_VERSION));
+    writeKeyData(Data.constData(), Data.size());
+}
+
+void KeySession::keyNetDisconnected()
+{
+    // Make sure the send worker is not writing while Qt closes it
+    keySender.setSocket(-1, keyTransportUdp.loadAcquire());
+    socketStamped = false;
+    if ( connState == KC_DISCONNECTED || connState == KC_RECONNECTING )
+        return;
+    // Lost, or the attempt failed. Try again after the backoff.
+    reconnectAtUs = KeyClock::nowUs() + qint64(backoffMs) * 1000;
+    backoffMs = qMin(backoffMs * 2, KE_RECONNECT_MAX_MS);
+    setConnectionState(KC_RECONNECTING);
+}
+
+void KeySession::sendSession()
+{
+    KeyMessage msg;
+    msg.type = KP_SESSION;
+    msg.seq = quint16(controlSeq.fetchAndAddOrdered(1));
+    msg.timeUs = sessionToken;
+    msg.remoteUs = 0;
+    char frame[KP_MAX_FRAME];
+    writeKeyData(frame, KeyProtocol::encode(frame, msg));
+}
+
+void KeySession::handleSession(const KeyMessage &msg)
+{
+    resumed = (sessionToken != 0 && msg.timeUs == sessionToken);
+    sessionToken = msg.timeUs;
+    if ( resumed ) {
+        resendUnacked();
+        return;
+    }
+    // A new session, the server doesn't know what was sent before
+    sentLock.lock();
+    memset(sentEvents, 0, sizeof(sentEvents));
+    sentLock.unlock();
+}
+
+// The server resumed the session and drops what it already got, so
+// every key event it hasn't acknowledged goes again if it can still be
+// played in time. A key up always goes, played late is better than a
+// key left down at the rig.
+void KeySession::resendUnacked()
+{
+    qint64 nowUs = KeyClock::epochUs();
+    clockLock.lock();
+    qint64 arrivalUs = nowUs + clockSync.offsetUs(nowUs) + clockSync.minOneWayUs();
+    clockLock.unlock();
+    QList<SentEvent> due;
+    sentLock.lock();
+    for (int i=0; i<KE_SENT_EVENTS; i++) {
+        SentEvent &sent = sentEvents[i];
+        if ( sent.waiting && (sent.keyTimeUs > arrivalUs || sent.type == KP_KEY_UP) ) {
+            sent.repeated = true;
+            due.append(sent);
+        }
+    }
+    sentLock.unlock();
+    std::sort(due.begin(), due.end(),
+              [](const SentEvent &a, const SentEvent &b) { return a.edgeUs < b.edgeUs; });
+    foreach (const SentEvent &sent, due) {
+        KeyMessage msg;
+        msg.type = sent.type;
+        msg.seq = sent.seq;
+        msg.timeUs = quint64(sent.edgeUs);
+        msg.remoteUs = quint64(sent.keyTimeUs);
+        KeySendKind kind = (sent.type == KP_KEY_DOWN) ? KS_KEY_DOWN : KS_KEY_UP;
+        char frame[KP_MAX_FRAME];
+        if ( keyTransportUdp.loadAcquire() ) {
+            writeKeyData(frame, udpStream.addEvent(msg, KeyClock::nowUs(), frame), kind);
+        } else {
+            writeKeyData(frame, KeyProtocol::encode(frame, msg), kind);
+        }
+        resent++;
+    }
+}
+
+void KeySession::readyReadKeyTcp()
+{
+    // when data comes in, read it straight into the parser which calls
+    // keyMessage() for every complete message
+    keyRxUs = KeyClock::epochUs();
+    keyReadUs = KeyClock::nowUs();
+    awaitingRxUs.storeRelease(0);
+    if ( socketStamped ) {
+        readStamped();
+        return;
+    }
+    for (;;) {
+        int space;
+        char *p = keyParser.writePtr(&space);
+        qint64 n = tcpKeySocket->read(p, space);
+        if ( n <= 0 )
+            break;
+        keyParser.commit(int(n));
+        keyParser.parse(this);
+    }
+}
+
+void KeySession::readyReadKeyUdp()
+{
+    keyRxUs = KeyClock::epochUs();
+    awaitingRxUs.storeRelease(0);
+    if ( socketStamped ) {
+        readStamped();
+        return;
+    }
+    while ( udpKeySocket->hasPendingDatagrams() ) {
+        int space;
+        char *p = keyParser.writePtr(&space);
+        qint64 n = udpKeySocket->readDatagram(p, space);
+        if ( n <= 0 )
+            continue;
+        keyParser.commit(int(n));
+        keyParser.flush(this);
+    }
+}
+
+// Read past Qt to get the kernel's receive time with the data. Each
+// read is a datagram or whatever arrived on the stream, its messages get
+// the time the kernel received it.
+void KeySession::readStamped()
+{
+    qint64 appRxUs = keyRxUs;
+    qintptr fd = keySocket()->socketDescriptor();
+    for (;;) {
+        int space;
+        char *p = keyParser.writePtr(&space);
+        qint64 rxUs;
+        qint64 n = SocketTimestamps::receive(fd, p, space, &rxUs);
+        if ( n == -2 )
+            break;
+        if ( n <= 0 ) {
+            // An empty datagram or an ICMP error
+            if ( keyTransportUdp.loadAcquire() )
+                continue;
+            // Qt doesn't read, so it can't see the connection end
+            tcpKeySocket->abort();
+            return;
+        }
+        keyRxUs = appRxUs;
+        if ( rxUs >= 0 ) {
+            keyRxUs = rxUs + KeyClock::epochAnchorUs();
+            if ( metrics ) {
+                metrics->record(KM_RX_STACK, KeyClock::nowUs() - rxUs);
+            }
+        }
+        keyParser.commit(int(n));
+        if ( keyTransportUdp.loadAcquire() ) {
+            keyParser.flush(this);
+        } else {
+            keyParser.parse(this);
+        }
+    }
+}
+
+void KeySession::keyMessage(const KeyMessage &msg)
+{
+    switch ( msg.type ) {
+    case KP_PONG:
+        handlePong(msg);
+        break;
+    case KP_ACKS:
+        handleAck(msg);
+        break;
+    case KP_SESSION:
+        handleSession(msg);
+        break;
+    case KP_HELLO_ACK: {
+        bool binary = (msg.version >= KP_VERSION_BINARY);
+        if ( binary != helloBinary ) {
+            // Text pongs are on a 32 bit ms clock, don't mix them in
+            clockLock.lock();
+            clockSync.reset();
+            clockLock.unlock();
+        }
+        keyProtocolBinary.storeRelease(binary ? 1 : 0);
+        helloBinary = binary;
+        bool batches = (msg.version >= KP_VERSION_BATCH);
+        serverBatches.storeRelease(batches ? 1 : 0);
+        keySender.setBatchPercent(batches ? batchSlackPercent : 0);
+        traceConfig();
+        if ( msg.version >= KP_VERSION_ACKS ) {
+            sendSession();
+        }
+        break;
+    }
+    default:
+        qDebug() << "Unknown data received, type:" << msg.type;
+        break;
+    }
+}
+
+void KeySession::handlePong(const KeyMessage &msg)
+{
+    quint32 sms, rms, remTime;
+    // When the ping left the kernel rather than when it was queued
+    qint64 sentUs = qint64(msg.timeUs);
+    if ( socketStamped && !msg.text ) {
+        qint64 txUs = keySender.sentUs(sentUs);
+        if ( txUs >= 0 ) {
+            sentUs = txUs + KeyClock::epochAnchorUs();
+        }
+    }
+    rms = quint32((keyRxUs / 1000) % 4294967295);
+    sms = quint32((sentUs / 1000) % 4294967295);
+    remTime = quint32((msg.remoteUs / 1000) % 4294967295);
+    pongDiff = (rms-sms)/2;
+    if ( isTracing() ) {
+        qint64 rxUs = keyRxUs - KeyClock::epochAnchorUs();
+        if ( msg.text ) {
+            trace->record(KT_PONG_TEXT, rxUs, qint64(msg.timeUs), qint64(msg.remoteUs));
+        } else {
+            trace->record(KT_PONG, rxUs, keyRxUs - sentUs, qint64(msg.remoteUs) - sentUs);
+        }
+    }
+
+    // Server time minus local send time, the text format only has ms
+    // and both clocks wrap at 32 bits
+    qint64 rttUs, toServerUs;
+    if ( msg.text ) {
+        rttUs = qint64(rms - sms) * 1000;
+        toServerUs = qint64(qint32(remTime - sms)) * 1000;
+    } else {
+        rttUs = keyRxUs - sentUs;
+        toServerUs = qint64(msg.remoteUs) - sentUs;
+    }
+    // One way delay, the text format only has ms
+    qint64 oneWayUs = msg.text ? qint64(pongDiff) * 1000 : rttUs / 2;
+    addRoundTrip(keyRxUs, rttUs, toServerUs - rttUs / 2, oneWayUs);
+
+    // "Auto key delay" sends a burst of pings to fill the estimator and
+    // then applies its recommendation right away
+    if ( SetKeyDelayCnt == 1 ) {
+        changeKeyDelay(recommendedKeyDelay);
+        pendingKeyDelay = -1;
+    } else if ( SetKeyDelayCnt != 0 ){
+        measureKeyDelay();
+    }
+    if ( SetKeyDelayCnt != 0 )
+        SetKeyDelayCnt--;
+    roundTripMeasured();
+}
+
+// A round trip from a pong or an acked key event. rxUs is the local
+// receive time, offsetUs the server clock minus the local one at the
+// middle of the round trip.
+void KeySession::addRoundTrip(qint64 rxUs, qint64 rttUs, qint64 offsetUs, qint64 oneWayUs)
+{
+    clockLock.lock();
+    clockSync.addSample(rxUs - rttUs, rxUs, offsetUs);
+    clockLock.unlock();
+    adaptProbeInterval(oneWayUs);
+    delayEstimator.addSample(oneWayUs);
+    updateKeyDelayRecommendation();
+    if ( metrics ) {
+        metrics->record(KM_PING_RTT, rttUs);
+        metrics->record(KM_ONE_WAY, oneWayUs);
+    }
+    keySender.setTransitExcessUs(qMax(qint64(0), oneWayUs - delayEstimator.minUs()));
+    lastProbeUs = KeyClock::nowUs();
+}
+
+// Probe twice as often when a sample is off by more than twice the mean
+// deviation, back off slowly while the link is steady
+void KeySession::adaptProbeInterval(qint64 oneWayUs)
+{
+    int maxMs = autoKeyDelay ? KE_PROBE_AUTO_MAX_MS : KE_PROBE_MAX_MS;
+    if ( delayEstimator.sampleCount() >= DE_MIN_SAMPLES
+         && qAbs(oneWayUs - delayEstimator.meanUs()) <= 2 * delayEstimator.deviationUs() ) {
+        probeIntervalMs = qMin(probeIntervalMs + probeIntervalMs / 4, maxMs);
+    } else {
+        probeIntervalMs = KE_PROBE_MIN_MS;
+    }
+}
+
+void KeySession::roundTripMeasured()
+{
+    if ( handler ) {
+        handler->sessionMeasured(this);
+    }
+}
+
+void KeySession::handleAck(const KeyMessage &msg)
+{
+    if ( isTracing() ) {
+        trace->record(KT_ACK, keyRxUs - KeyClock::epochAnchorUs(), msg.seq, qint64(msg.remoteUs),
+                     qint64(msg.timeUs - msg.remoteUs));
+    }
+    qint64 slackUs, delayUs, edgeUs, leadUs;
+    bool repeated, down;
+    {
+        QMutexLocker locker(&sentLock);
+        SentEvent &sent = sentEvents[msg.seq % KE_SENT_EVENTS];
+        // Unknown, too old or already acknowledged over UDP
+        if ( !sent.waiting || sent.seq != msg.seq )
+            return;
+        sent.waiting = false;
+        slackUs = sent.keyTimeUs - qint64(msg.remoteUs);
+        delayUs = sent.delayUs;
+        edgeUs = sent.edgeUs;
+        leadUs = sent.leadUs;
+        repeated = sent.repeated;
+        down = (sent.type == KP_KEY_DOWN);
+    }
+    KeyPathTrace::record(KPS_ACKED, edgeUs - KeyClock::epochAnchorUs(), down, slackUs);
+    if ( !acksSeen.loadAcquire() ) {
+        acksSeen.storeRelease(1);
+        keySender.setEstimateMargin(false);
+    }
+    ackedCount++;
+    if ( slackUs < 0 )
+        lateCount++;
+    lastSlackUs = slackUs;
+    minSlackUs = (ackedCount == 1) ? slackUs : qMin(minSlackUs, slackUs);
+    if ( metrics ) {
+        metrics->record(KM_KEYTIME_MARGIN, slackUs);
+    }
+    // One sent ahead of its edge had that much more time to arrive
+    playoutEstimator.addSample(delayUs - slackUs + leadUs);
+
+    // The key event was a probe too: sending, server receive, server send
+    // and local receive time, less the time the server held the ack. A
+    // resent one spans the outage and is no measurement of the link.
+    qint64 sentUs = edgeUs - leadUs;
+    qint64 holdUs = qint64(msg.timeUs) - qint64(msg.remoteUs);
+    qint64 rttUs = (keyRxUs - sentUs) - holdUs;
+    if ( rttUs > 0 && !repeated ) {
+        qint64 offsetUs = ((qint64(msg.remoteUs) - sentUs) + (qint64(msg.timeUs) - keyRxUs)) / 2;
+        pongDiff = quint32(rttUs / 2000);
+        addRoundTrip(keyRxUs, rttUs, offsetUs, rttUs / 2);
+    } else {
+        updateKeyDelayRecommendation();
+    }
+    roundTripMeasured();
+}
+
+KeyAckStats KeySession::ackStatistics()
+{
+    KeyAckStats s;
+    s.acked = ackedCount;
+    s.late = lateCount;
+    s.lastSlackUs = lastSlackUs;
+    if ( !acksSeen.loadAcquire() ) {
+        s.minSlackUs = 0;
+    } else if ( metrics ) {
+        s.minSlackUs = metrics->summary(KM_KEYTIME_MARGIN, KM_MINUTE_US).min;
+    } else {
+        s.minSlackUs = minSlackUs;
+    }
+    return s;
+}
+
+void KeySession::measureKeyDelay()
+{
+    if ( SetKeyDelayCnt == 0 ) {
+        SetKeyDelayCnt = 10;
+        if ( isTracing() ) {
+            trace->record(KT_MEASURE, KeyClock::nowUs());
+        }
+    }
+    sendPing();
+}
+
+void KeySession::setKeyDelayMs(int ms)
+{
+    packetDelay.storeRelease(ms);
+    traceConfig();
+}
+
+void KeySession::setAutoKeyDelay(bool on)
+{
+    autoKeyDelay = on;
+    pendingKeyDelay = -1;
+    traceConfig();
+    if ( autoKeyDelay && recommendedKeyDelay > 0 ) {
+        updateKeyDelayRecommendation();
+    }
+}
+
+// With acks the delay comes from what the acknowledged events needed to
+// be on time, otherwise it is inferred from the ping times
+void KeySession::updateKeyDelayRecommendation()
+{
+    qint64 us;
+    if ( playoutEstimator.sampleCount() >= DE_MIN_SAMPLES ) {
+        us = playoutEstimator.quantileUs(onTime);
+    } else {
+        us = delayEstimator.recommendedDelayUs(onTime);
+    }
+    recommendedKeyDelay = int(qBound(qint64(CW_MIN_DELAY), (us + 999) / 1000, qint64(CW_MAX_DELAY)));
+    if ( autoKeyDelay && qAbs(recommendedKeyDelay - keyDelayMs()) >= CW_DELAY_HYSTERESIS ) {
+        pendingKeyDelay = recommendedKeyDelay;
+    }
+}
+
+// Change the key delay only while the key is up. A longer delay just
+// stretches the current gap. A shorter one moves the next key down
+// earlier, so wait until the last key up has been played at the rig and
+// the gap is already longer than what is taken off it.
+void KeySession::applyPendingKeyDelay()
+{
+    if ( pendingKeyDelay < 0 || keyIsDownSent.loadAcquire() != 0 )
+        return;
+    qint64 upMs = (KeyClock::nowUs() - lastKeyEdgeUs.loadAcquire()) / 1000;
+    qint64 shrinkMs = qint64(keyDelayMs()) - pendingKeyDelay;
+    if ( shrinkMs > 0 && upMs < qint64(keyDelayMs()) + shrinkMs )
+        return;
+    changeKeyDelay(pendingKeyDelay);
+    pendingKeyDelay = -1;
+}
+
+void KeySession::changeKeyDelay(int ms)
+{
+    packetDelay.storeRelease(ms);
+    if ( handler ) {
+        handler->sessionKeyDelayChanged(this, ms);
+    }
+}
+
+qint64 KeySession::clockOffsetUs()
+{
+    QMutexLocker locker(&clockLock);
+    return clockSync.offsetUs(KeyClock::epochUs());
+}
+
+double KeySession::clockSkewPpm()
+{
+    QMutexLocker locker(&clockLock);
+    return clockSync.skewPpm();
+}
+
+qint64 KeySession::clockUncertaintyUs()
+{
+    QMutexLocker locker(&clockLock);
+    return clockSync.uncertaintyUs(KeyClock::epochUs());
+}
+
+int KeySession::clockSamples()
+{
+    QMutexLocker locker(&clockLock);
+    return clockSync.sampleCount();
+}
+
+// Settings the replay needs to compute the same key times
+void KeySession::traceConfig()
+{
+    if ( !isTracing() )
+        return;
+    qint64 flags = (keyProtocolBinary.loadAcquire() ? KT_FLAG_BINARY : 0)
+            | (autoKeyDelay ? KT_FLAG_AUTO : 0)
+            | (keyTransportUdp.loadAcquire() ? KT_FLAG_UDP : 0);
+    trace->record(KT_CONFIG, KeyClock::nowUs(), qint64(keyDelayMs()), flags, qRound64(onTime * 10000.0));
+}
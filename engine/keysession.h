@@ -0,0 +1,309 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYSESSION_H
+#define KEYSESSION_H
+
+#include <QString>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QList>
+#include <QByteArray>
+#include "keyprotocol.h"
+#include "keysender.h"
+#include "udpkeystream.h"
+#include "netimpairment.h"
+#include "delayestimator.h"
+#include "clocksync.h"
+#include "keymetrics.h"
+#include "keytrace.h"
+
+class QTcpSocket;
+class QUdpSocket;
+class QAbstractSocket;
+
+#define CW_MAX_DELAY 300
+#define CW_MIN_DELAY 25
+// Smallest change of the key delay the automatic mode bothers with
+#define CW_DELAY_HYSTERESIS 5
+// Key events remembered until the server acknowledges them
+#define KE_SENT_EVENTS 256
+// Range of the idle probe interval, pings are only sent when no key
+// event has measured the round trip for that long
+#define KE_PROBE_MIN_MS 250
+#define KE_PROBE_MAX_MS 5000
+#define KE_PROBE_AUTO_MAX_MS 1000
+// Reconnect backoff, doubled after every failed attempt
+#define KE_RECONNECT_MIN_MS 100
+#define KE_RECONNECT_MAX_MS 5000
+// Give up a connection attempt after this long
+#define KE_CONNECT_TIMEOUT_MS 3000
+// Nothing received for this long while waiting for a reply, the link is
+// dead. Pings are repeated at a third of it meanwhile.
+#define KE_LINK_TIMEOUT_MS 3000
+
+enum KeyConnectionState {
+    KC_DISCONNECTED,        // Not wanted
+    KC_CONNECTING,
+    KC_CONNECTED,
+    KC_RECONNECTING         // Lost, waiting for the next attempt
+};
+
+// Key events acknowledged by the server. Slack is the key time minus
+// the arrival at the server, negative when it was played late.
+struct KeyAckStats {
+    quint32 acked;
+    quint32 late;
+    qint64 lastSlackUs;
+    qint64 minSlackUs;      // Over the last minute, since the start without metrics
+};
+
+class KeySession;
+
+// Receiver of what happens in a session, called on the thread that runs
+// the engine
+class KeySessionHandler
+{
+public:
+    virtual ~KeySessionHandler() {}
+    virtual void sessionStateChanged(KeySession *session, KeyConnectionState state) = 0;
+    // After every round trip sample, a pong or an acknowledged key event
+    virtual void sessionMeasured(KeySession *session) = 0;
+    // The session changed the key delay on its own
+    virtual void sessionKeyDelayChanged(KeySession *session, int ms) = 0;
+};
+
+// One key server: the connection with its reconnects and session
+// resume, the send worker, the clock offset, the delay estimators and
+// the key delay. Key events are encoded once by the engine and only get
+// this server's key time filled in, they are written by the session's
+// own send worker thread so a slow server doesn't hold up the others.
+class KeySession : public KeyMessageHandler
+{
+public:
+    KeySession(KeySessionHandler *handler);
+    ~KeySession();
+
+    // Only the session of the main server traces and records metrics
+    void setTrace(KeyTraceWriter *writer, const QAtomicInt *on);
+    void setMetrics(KeyMetrics *m);
+    void setRedundancy(int events) { udpStream.setRedundancy(events); }
+    void setStallPolicy(KeySender::StallPolicy policy) { keySender.setStallPolicy(policy); }
+    KeySender::StallPolicy stallPolicy() const { return keySender.policy(); }
+    // The send worker takes its scheduling when it starts, restarted
+    // after RealTime::configure(). Nothing queued is lost.
+    void restartSending();
+    void setOnTimeTarget(double fraction) { onTime = fraction; }
+    // Percentage of the key delay's slack spent on batching key events,
+    // 0 is off. Used over TCP with servers that know KP_BATCH.
+    void setBatchPercent(int percent);
+    int batchPercent() const { return batchSlackPercent; }
+    double onTimeTarget() const { return onTime; }
+
+    // Once asked to connect the session keeps reconnecting in the
+    // background until disconnectFromServer(). A connection to the same
+    // server keeps the clock and delay estimates, resumes the session
+    // and resends key events that were not acknowledged and can still be
+    // played in time.
+    void setTransportUdp(bool udp);
+    bool transportUdp() const { return keyTransportUdp.loadAcquire(); }
+    void connectToServer(const QString &host, quint16 port);
+    void disconnectFromServer();
+    // Where connectToServer() goes, without connecting
+    void setServer(const QString &host, quint16 port) { serverHost = host; serverPort = port; }
+    QString host() const { return serverHost; }
+    quint16 port() const { return serverPort; }
+    bool isServerOpen() const { return connState != KC_DISCONNECTED; }
+    bool isConnected() const { return connState == KC_CONNECTED; }
+    KeyConnectionState connectionState() const { return connState; }
+    bool sessionResumed() const { return resumed; }
+    int reconnectCount() const { return reconnects; }
+    int resentCount() const { return resent; }
+    void setOfferBinary(bool on) { offerBinary = on; }
+    // Take the round trip of pings and the receive time of everything
+    // from the kernel's timestamps of the key socket, where it has them.
+    // Used from the next connection on.
+    void setKernelTimestamps(bool on) { kernelStamps = on; }
+    bool kernelTimestamps() const { return kernelStamps; }
+    // The current connection has them
+    bool isStamped() const { return socketStamped; }
+    void setNetImpairment(const NetImpairment &sim);
+
+    // A key event encoded by the engine with a zero key time. Called on
+    // the key input thread. aheadUs is how long before its edge every
+    // event of the text keyer run is sent at least, it is taken off the
+    // key delay (down to CW_MIN_DELAY) as it already covers the jitter.
+    void sendKeyEvent(const KeyMessage &event, const char *frame, int len, qint64 edgeUs,
+                      qint64 aheadUs = 0);
+    // An element of the paddle keyer, both key events at its start with
+    // a zero key time
+    void sendKeyElement(const KeyMessage &down, const KeyMessage &up, qint64 downUs, qint64 upUs);
+    // Pings, repeats and the connection manager, from the engine timer
+    void tick(qint64 now);
+    void ping();
+
+    void setKeyDelayMs(int ms);
+    int keyDelayMs() const { return packetDelay.loadAcquire(); }
+    void setAutoKeyDelay(bool on);
+    bool isAutoKeyDelay() const { return autoKeyDelay; }
+    void measureKeyDelay();
+    int recommendedKeyDelayMs() const { return recommendedKeyDelay; }
+    void applyPendingKeyDelay();
+
+    // Statistics, only read from the thread running the engine
+    int lastOneWayMs() const { return int(pongDiff); }
+    const DelayEstimator &delayStatistics() const { return delayEstimator; }
+    qint64 clockOffsetUs();
+    double clockSkewPpm();
+    qint64 clockUncertaintyUs();
+    int clockSamples();
+    KeySenderStats sendStatistics() { return keySender.statistics(); }
+    bool serverAcks() const { return acksSeen.loadAcquire(); }
+    KeyAckStats ackStatistics();
+
+    // Replay of a trace
+    void receiveMessage(const KeyMessage &msg, qint64 rxUs);
+    void restoreConfig(int delayMs, int flags, double onTimeFraction);
+    // The one before for back 1
+    qint64 lastSentOffsetUs(int back = 0) const
+    {
+        return back ? prevSentOffsetUs.loadAcquire() : sentOffsetUs.loadAcquire();
+    }
+    void traceConfig();
+
+    // Called by the key stream parser for every received message
+    void keyMessage(const KeyMessage &msg) override;
+
+private:
+    bool isTracing() const { return trace && tracing->loadAcquire(); }
+    void sendPing();
+    void handlePong(const KeyMessage &msg);
+    void handleAck(const KeyMessage &msg);
+    void addRoundTrip(qint64 rxUs, qint64 rttUs, qint64 offsetUs, qint64 oneWayUs);
+    void adaptProbeInterval(qint64 oneWayUs);
+    void roundTripMeasured();
+    void updateKeyDelayRecommendation();
+    void changeKeyDelay(int ms);
+    int encodeKeyEvent(const KeyMessage &event, const char *frame, int len, qint64 edgeUs,
+                       qint64 delayUs, bool binary, bool udp, char *out, KeyMessage *sent);
+    void writeKeyData(const char *data, int len, KeySendKind kind = KS_CONTROL, qint64 expireUs = -1,
+                      qint64 edgeUs = -1, qint64 probeId = -1);
+    void sendImpairedData();
+    void keyNetConnected();
+    void keyNetDisconnected();
+    void setConnectionState(KeyConnectionState state);
+    void startConnect();
+    void manageConnection(qint64 now);
+    void sendSession();
+    void handleSession(const KeyMessage &msg);
+    void resendUnacked();
+    void readyReadKeyTcp();
+    void readyReadKeyUdp();
+    void readStamped();
+    QAbstractSocket *keySocket() const;
+
+    KeySessionHandler *handler;
+    KeyTraceWriter *trace = nullptr;
+    const QAtomicInt *tracing = nullptr;
+    KeyMetrics *metrics = nullptr;
+
+    // Key server
+    QTcpSocket *tcpKeySocket;
+    QUdpSocket *udpKeySocket;
+    // Read by the key input thread as it sends, set on the GUI thread
+    QAtomicInt keyTransportUdp;
+    KeySender keySender;
+    UdpKeyStream udpStream;
+    KeyStreamParser keyParser;
+    qint64 keyReadUs = 0;           // Last stream read, to flush text
+    QAtomicInt keyProtocolBinary;
+    bool offerBinary = true;
+    int batchSlackPercent = 0;
+    QAtomicInt serverBatches;       // The server takes KP_BATCH
+    bool kernelStamps = false;
+    bool socketStamped = false;
+    QAtomicInt controlSeq;
+    qint64 keyRxUs = 0;
+    // Simulated network conditions, set in remotecwclient.ini only
+    NetImpairment netImpairment;
+    QAtomicInt impairmentActive;
+    struct ImpairedData {
+        qint64 arrivalUs;
+        KeySendKind kind;
+        QByteArray data;
+    };
+    QList<ImpairedData> impairedQueue;
+    QMutex impairedLock;
+
+    // Timing
+    QAtomicInt packetDelay;         // Key delay in ms
+    quint32 SetKeyDelayCnt = 0;
+    quint32 pongDiff = 0;
+    DelayEstimator delayEstimator;
+    // Key delay each acknowledged event would have needed to be on time
+    DelayEstimator playoutEstimator;
+    struct SentEvent {
+        quint16 seq;
+        quint8 type;
+        bool waiting;
+        bool repeated;          // Resent after a reconnect, no probe
+        qint64 edgeUs;          // Epoch, the start of the round trip
+        qint64 keyTimeUs;
+        qint64 delayUs;
+        qint64 leadUs;          // Sent this long before the edge (text keyer)
+    };
+    SentEvent sentEvents[KE_SENT_EVENTS];
+    QMutex sentLock;
+    QAtomicInt acksSeen;
+    quint32 ackedCount = 0;
+    quint32 lateCount = 0;
+    qint64 lastSlackUs = 0;
+    qint64 minSlackUs = 0;
+    qint64 lastProbeUs = 0;
+    int probeIntervalMs = KE_PROBE_MIN_MS;
+
+    // Connection manager
+    QString serverHost;
+    quint16 serverPort = 0;
+    bool helloBinary = false;       // What the server answered last time
+    QString lastServer;             // Estimates and session belong to it
+    KeyConnectionState connState = KC_DISCONNECTED;
+    qint64 connectStartUs = 0;
+    qint64 reconnectAtUs = 0;
+    int backoffMs = KE_RECONNECT_MIN_MS;
+    QAtomicInteger<qint64> awaitingRxUs;    // First unanswered send, 0 if none
+    quint64 sessionToken = 0;
+    bool resumed = false;
+    int reconnects = 0;
+    int resent = 0;
+    bool autoKeyDelay = false;
+    double onTime = 0.99;
+    qint32 recommendedKeyDelay = -1;
+    qint32 pendingKeyDelay = -1;
+    QAtomicInt keyIsDownSent;
+    QAtomicInteger<qint64> lastKeyEdgeUs;
+    ClockSync clockSync;
+    QMutex clockLock;
+    QAtomicInteger<qint64> sentOffsetUs;
+    QAtomicInteger<qint64> prevSentOffsetUs;
+};
+
+#endif // KEYSESSION_H
@@ -0,0 +1,234 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <cstring>
+#include "keytrace.h"
+#include "keyclock.h"
+
+static inline quint64 zigzag(qint64 v)
+{
+    return (quint64(v) << 1) ^ quint64(v >> 63);
+}
+
+static inline qint64 unzigzag(quint64 v)
+{
+    return qint64(v >> 1) ^ -qint64(v & 1);
+}
+
+static inline uchar *putVarint(uchar *p, quint64 v)
+{
+    while ( v >= 0x80 ) {
+        *p++ = uchar(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = uchar(v);
+    return p;
+}
+
+static inline void putInt64(uchar *p, qint64 v)
+{
+    for (int i=0; i<8; i++) {
+        p[i] = uchar(quint64(v) >> (8 * i));
+    }
+}
+
+static inline qint64 getInt64(const char *p)
+{
+    quint64 v = 0;
+    for (int i=0; i<8; i++) {
+        v |= quint64(uchar(p[i])) << (8 * i);
+    }
+    return qint64(v);
+}
+
+KeyTraceWriter::~KeyTraceWriter()
+{
+    close();
+}
+
+bool KeyTraceWriter::open(const QString &fileName)
+{
+    close();
+    QMutexLocker locker(&lock);
+    file.setFileName(fileName);
+    if ( !file.open(QIODevice::ReadWrite | QIODevice::Truncate) )
+        return false;
+    mapSize = 0;
+    used = 0;
+    if ( !grow() ) {
+        file.close();
+        return false;
+    }
+    lastUs = KeyClock::nowUs();
+    memcpy(map, KT_MAGIC, 8);
+    putInt64(map + 8, KeyClock::epochAnchorUs());
+    putInt64(map + 16, lastUs);
+    used = KT_HEADER_SIZE;
+    return true;
+}
+
+// Map the next chunk, the mapping may move
+bool KeyTraceWriter::grow()
+{
+    if ( map ) {
+        file.unmap(map);
+        map = nullptr;
+    }
+    if ( !file.resize(mapSize + KT_CHUNK) )
+        return false;
+    mapSize += KT_CHUNK;
+    map = file.map(0, mapSize);
+    return map != nullptr;
+}
+
+void KeyTraceWriter::close()
+{
+    QMutexLocker locker(&lock);
+    if ( !file.isOpen() )
+        return;
+    if ( map ) {
+        file.unmap(map);
+        map = nullptr;
+    }
+    file.resize(used);
+    file.close();
+}
+
+void KeyTraceWriter::record(KeyTraceTag tag, qint64 timeUs, qint64 a, qint64 b, qint64 c)
+{
+    QMutexLocker locker(&lock);
+    if ( !map )
+        return;
+    if ( used + KT_MAX_RECORD > mapSize && !grow() )
+        return;
+    uchar *p = map + used;
+    *p++ = uchar(tag);
+    // Records from different threads may be a little out of order
+    p = putVarint(p, zigzag(timeUs - lastUs));
+    switch ( tag ) {
+    case KT_PONG:
+    case KT_PONG_TEXT:
+        p = putVarint(p, zigzag(a));
+        p = putVarint(p, zigzag(b));
+        break;
+    case KT_ACK:
+    case KT_KEYER:
+        p = putVarint(p, zigzag(a));
+        p = putVarint(p, zigzag(b));
+        p = putVarint(p, zigzag(c));
+        break;
+    case KT_SENT:
+    case KT_ELEMENT:
+    case KT_SEQ:
+        p = putVarint(p, zigzag(a));
+        break;
+    case KT_CONFIG:
+        p = putVarint(p, zigzag(a));
+        *p++ = uchar(b);
+        p = putVarint(p, zigzag(c));
+        break;
+    default:
+        break;
+    }
+    lastUs = timeUs;
+    used = p - map;
+}
+
+bool KeyTraceReader::open(const QString &fileName)
+{
+    QFile file(fileName);
+    if ( !file.open(QIODevice::ReadOnly) )
+        return false;
+    data = file.readAll();
+    if ( data.size() < KT_HEADER_SIZE || memcmp(data.constData(), KT_MAGIC, 8) )
+        return false;
+    anchorUs = getInt64(data.constData() + 8);
+    firstUs = getInt64(data.constData() + 16);
+    lastUs = firstUs;
+    pos = KT_HEADER_SIZE;
+    return true;
+}
+
+bool KeyTraceReader::readVarint(quint64 &value)
+{
+    value = 0;
+    for (int shift=0; shift<64 && pos<data.size(); shift+=7) {
+        uchar c = uchar(data[pos++]);
+        value |= quint64(c & 0x7f) << shift;
+        if ( !(c & 0x80) )
+            return true;
+    }
+    return false;
+}
+
+bool KeyTraceReader::next(KeyTraceRecord &record)
+{
+    if ( pos >= data.size() )
+        return false;
+    record.tag = KeyTraceTag(uchar(data[pos++]));
+    if ( record.tag == KT_END || record.tag > KT_KEYER )
+        return false;
+    quint64 v;
+    if ( !readVarint(v) )
+        return false;
+    lastUs += unzigzag(v);
+    record.timeUs = lastUs;
+    record.a = 0;
+    record.b = 0;
+    record.c = 0;
+    switch ( record.tag ) {
+    case KT_PONG:
+    case KT_PONG_TEXT:
+    case KT_ACK:
+    case KT_KEYER:
+        if ( !readVarint(v) )
+            return false;
+        record.a = unzigzag(v);
+        if ( !readVarint(v) )
+            return false;
+        record.b = unzigzag(v);
+        if ( record.tag == KT_ACK || record.tag == KT_KEYER ) {
+            if ( !readVarint(v) )
+                return false;
+            record.c = unzigzag(v);
+        }
+        break;
+    case KT_SENT:
+    case KT_ELEMENT:
+    case KT_SEQ:
+        if ( !readVarint(v) )
+            return false;
+        record.a = unzigzag(v);
+        break;
+    case KT_CONFIG:
+        if ( !readVarint(v) || pos >= data.size() )
+            return false;
+        record.a = unzigzag(v);
+        record.b = uchar(data[pos++]);
+        if ( !readVarint(v) )
+            return false;
+        record.c = unzigzag(v);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
@@ -0,0 +1,112 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef KEYTRACE_H
+#define KEYTRACE_H
+
+#include <QFile>
+#include <QMutex>
+#include <QByteArray>
+#include <QString>
+
+// File grows in steps of this, the mapped part is written directly
+#define KT_CHUNK (1 << 20)
+#define KT_MAGIC "CWTRACE1"
+#define KT_HEADER_SIZE 24
+// Longest record: tag, time delta and two 64 bit values as varints
+#define KT_MAX_RECORD 32
+
+enum KeyTraceTag {
+    KT_END = 0,         // Unused mapped space after the last record
+    KT_KEY_DOWN,        // Key edge at the time of the record
+    KT_KEY_UP,
+    KT_PONG,            // Binary pong: round trip, server minus send time
+    KT_PONG_TEXT,       // Text pong: send and server time as received
+    KT_SENT,            // Key time sent for the previous edge, relative to it
+    KT_CONFIG,          // Key delay (ms), KT_FLAG_* and on time target (1/10000)
+    KT_MEASURE,         // "Set key delay" started a burst of pings
+    KT_ACK,             // Key event seq, server receive time and hold time
+    KT_ELEMENT,         // Paddle keyer element from the time of the record, length
+    KT_SEQ,             // Sequence number of the next key event, when tracing starts
+    KT_KEYER            // Text keyer event: time to its edge, down, run's lead
+};
+
+#define KT_FLAG_BINARY 1
+#define KT_FLAG_AUTO 2
+#define KT_FLAG_UDP 4
+
+// A record read back, times in KeyClock us of the recording
+struct KeyTraceRecord {
+    KeyTraceTag tag;
+    qint64 timeUs;
+    qint64 a;
+    qint64 b;
+    qint64 c;
+};
+
+// Append only binary trace of key edges, pongs and the key times sent.
+// Every record is a tag byte, the time since the previous record and
+// its values as zigzag varints, 3 to 10 bytes for most records. The
+// file is memory mapped, so recording from the key input thread is a
+// few stores under an uncontended lock.
+class KeyTraceWriter
+{
+public:
+    KeyTraceWriter() {}
+    ~KeyTraceWriter();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const { return map != nullptr; }
+    void record(KeyTraceTag tag, qint64 timeUs, qint64 a = 0, qint64 b = 0, qint64 c = 0);
+
+private:
+    bool grow();
+
+    QMutex lock;
+    QFile file;
+    uchar *map = nullptr;
+    qint64 mapSize = 0;
+    qint64 used = 0;
+    qint64 lastUs = 0;
+};
+
+// Reads a trace written by KeyTraceWriter, also one that was not closed
+class KeyTraceReader
+{
+public:
+    bool open(const QString &fileName);
+    bool next(KeyTraceRecord &record);
+    // Epoch minus KeyClock time of the recording
+    qint64 epochAnchorUs() const { return anchorUs; }
+    qint64 startUs() const { return firstUs; }
+
+private:
+    bool readVarint(quint64 &value);
+
+    QByteArray data;
+    int pos = 0;
+    qint64 anchorUs = 0;
+    qint64 firstUs = 0;
+    qint64 lastUs = 0;
+};
+
+#endif // KEYTRACE_H
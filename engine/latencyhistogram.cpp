@@ -0,0 +1,156 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <cstring>
+#include <QtAlgorithms>
+#include "latencyhistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    memset(positive, 0, sizeof(positive));
+    memset(negative, 0, sizeof(negative));
+    total = 0;
+    sum = 0;
+    lo = 0;
+    hi = 0;
+}
+
+int LatencyHistogram::bucketOf(qint64 magnitude)
+{
+    if ( magnitude > LH_MAX_VALUE )
+        magnitude = LH_MAX_VALUE;
+    if ( magnitude < LH_SUB )
+        return int(magnitude);
+    int msb = 63 - int(qCountLeadingZeroBits(quint64(magnitude)));
+    int shift = msb - LH_SUB_BITS;
+    return (shift + 1) * LH_SUB + int((magnitude >> shift) - LH_SUB);
+}
+
+qint64 LatencyHistogram::bucketValue(int bucket)
+{
+    if ( bucket < LH_SUB )
+        return bucket;
+    int shift = bucket / LH_SUB - 1;
+    qint64 lower = qint64(LH_SUB + bucket % LH_SUB) << shift;
+    return lower + ((Q_INT64_C(1) << shift) >> 1);
+}
+
+void LatencyHistogram::record(qint64 value)
+{
+    if ( value < 0 ) {
+        negative[bucketOf(-value)]++;
+    } else {
+        positive[bucketOf(value)]++;
+    }
+    if ( total == 0 || value < lo ) lo = value;
+    if ( total == 0 || value > hi ) hi = value;
+    total++;
+    sum += value;
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    if ( other.total == 0 )
+        return;
+    for (int i=0; i<LH_BUCKETS; i++) {
+        positive[i] += other.positive[i];
+        negative[i] += other.negative[i];
+    }
+    if ( total == 0 || other.lo < lo ) lo = other.lo;
+    if ( total == 0 || other.hi > hi ) hi = other.hi;
+    total += other.total;
+    sum += other.sum;
+}
+
+qint64 LatencyHistogram::quantile(double p) const
+{
+    if ( total == 0 )
+        return 0;
+    if ( p <= 0.0 )
+        return lo;
+    if ( p >= 1.0 )
+        return hi;
+    quint64 rank = quint64(p * double(total - 1));
+    quint64 seen = 0;
+    qint64 value = hi;
+    bool found = false;
+    // From the most negative up
+    for (int i=LH_BUCKETS-1; i>=0 && !found; i--) {
+        seen += negative[i];
+        if ( seen > rank ) {
+            value = -bucketValue(i);
+            found = true;
+        }
+    }
+    for (int i=0; i<LH_BUCKETS && !found; i++) {
+        seen += positive[i];
+        if ( seen > rank ) {
+            value = bucketValue(i);
+            found = true;
+        }
+    }
+    return qBound(lo, value, hi);
+}
+
+RollingHistogram::RollingHistogram()
+{
+    reset();
+}
+
+void RollingHistogram::reset()
+{
+    for (int i=0; i<RH_SLOTS; i++) {
+        minutes[i].reset();
+        slotId[i] = -1;
+    }
+    all.reset();
+}
+
+void RollingHistogram::record(qint64 value, qint64 nowUs)
+{
+    qint64 id = nowUs / RH_SLOT_US;
+    int i = int(id % RH_SLOTS);
+    if ( slotId[i] != id ) {
+        minutes[i].reset();
+        slotId[i] = id;
+    }
+    minutes[i].record(value);
+    all.record(value);
+}
+
+LatencyHistogram RollingHistogram::window(qint64 spanUs, qint64 nowUs) const
+{
+    if ( spanUs <= 0 )
+        return all;
+    qint64 id = nowUs / RH_SLOT_US;
+    qint64 first = id - qMin(qint64(RH_SLOTS - 1), (spanUs + RH_SLOT_US - 1) / RH_SLOT_US);
+    LatencyHistogram h;
+    for (int i=0; i<RH_SLOTS; i++) {
+        if ( slotId[i] >= first && slotId[i] <= id )
+            h.add(minutes[i]);
+    }
+    return h;
+}
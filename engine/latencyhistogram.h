@@ -0,0 +1,92 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+
+// 16 linear steps per power of two, a value is off by at most 1/16
+#define LH_SUB_BITS 4
+#define LH_SUB (1 << LH_SUB_BITS)
+// Powers of two above LH_SUB, values up to 2^28 (268 s in us)
+#define LH_OCTAVES 24
+#define LH_BUCKETS ((LH_OCTAVES + 1) * LH_SUB)
+#define LH_MAX_VALUE ((Q_INT64_C(1) << (LH_OCTAVES + LH_SUB_BITS)) - 1)
+
+// Slots of a rolling histogram, one minute each
+#define RH_SLOT_US Q_INT64_C(60000000)
+#define RH_SLOTS 16
+
+// Log-linear histogram in fixed memory. Small values are counted
+// exactly, larger ones in buckets 1/16 of their power of two wide.
+// Negative values, like a key event that is late, have buckets of their
+// own.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void reset();
+    void record(qint64 value);
+    void add(const LatencyHistogram &other);
+
+    quint64 count() const { return total; }
+    qint64 minValue() const { return total ? lo : 0; }
+    qint64 maxValue() const { return total ? hi : 0; }
+    double mean() const { return total ? double(sum) / double(total) : 0.0; }
+    qint64 sumValue() const { return sum; }
+    // Middle of the bucket holding the p:th value, p from 0 to 1
+    qint64 quantile(double p) const;
+
+private:
+    static int bucketOf(qint64 magnitude);
+    static qint64 bucketValue(int bucket);
+
+    quint32 positive[LH_BUCKETS];
+    quint32 negative[LH_BUCKETS];
+    quint64 total;
+    qint64 sum;
+    qint64 lo;
+    qint64 hi;
+};
+
+// Histogram of the last minutes in one minute slots, and of everything
+// since the start
+class RollingHistogram
+{
+public:
+    RollingHistogram();
+
+    void reset();
+    void record(qint64 value, qint64 nowUs);
+    // The last spanUs rounded up to whole minutes plus the current one,
+    // everything since the start if spanUs is 0
+    LatencyHistogram window(qint64 spanUs, qint64 nowUs) const;
+    const LatencyHistogram &total() const { return all; }
+
+private:
+    LatencyHistogram minutes[RH_SLOTS];
+    qint64 slotId[RH_SLOTS];
+    LatencyHistogram all;
+};
+
+#endif // LATENCYHISTOGRAM_H
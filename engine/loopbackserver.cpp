@@ -0,0 +1,310 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QUdpSocket>
+#include <QTimer>
+#include "loopbackserver.h"
+#include "keyclock.h"
+
+LoopbackKeyServer::LoopbackKeyServer(QObject *parent) :
+    QObject(parent)
+{
+    tcpServer = new QTcpServer(this);
+    connect(tcpServer,
+            SIGNAL(newConnection()),
+            this,
+            SLOT(newTcpConnection()));
+    udpSocket = new QUdpSocket(this);
+    connect(udpSocket,
+            SIGNAL(readyRead()),
+            this,
+            SLOT(readyReadUdp()));
+    udpSession.server = this;
+    udpSession.tcp = nullptr;
+    udpSession.peerPort = 0;
+    udpSession.seenAny = false;
+    udpSession.token = 0;
+    udpSession.readLately = false;
+    // Unique enough across restarts of the server
+    nextToken = quint64(KeyClock::epochUs());
+    // Every UDP client gets acks, it can't ask for them
+    udpSession.acks = true;
+    ackTimer = new QTimer(this);
+    connect(ackTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(flushAcks()));
+    ackTimer->start(LB_ACK_BATCH_MS);
+}
+
+LoopbackKeyServer::~LoopbackKeyServer()
+{
+    qDeleteAll(tcpSessions);
+}
+
+bool LoopbackKeyServer::listen(const QHostAddress &address, quint16 port)
+{
+    if ( !tcpServer->listen(address, port) )
+        return false;
+    // UDP on the same port number as TCP
+    return udpSocket->bind(address, tcpServer->serverPort());
+}
+
+quint16 LoopbackKeyServer::serverPort() const
+{
+    return tcpServer->serverPort();
+}
+
+void LoopbackKeyServer::resetStatistics()
+{
+    lateness.clear();
+    events.clear();
+    duplicates = 0;
+    resumes = 0;
+}
+
+void LoopbackKeyServer::newTcpConnection()
+{
+    while ( tcpServer->hasPendingConnections() ) {
+        Session *session = new Session();
+        session->server = this;
+        session->tcp = tcpServer->nextPendingConnection();
+        session->tcp->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        session->peerPort = 0;
+        session->seenAny = false;
+        session->acks = false;
+        session->token = 0;
+        session->readLately = false;
+        connect(session->tcp,
+                SIGNAL(readyRead()),
+                this,
+                SLOT(readyReadTcp()));
+        connect(session->tcp,
+                SIGNAL(disconnected()),
+                this,
+                SLOT(tcpDisconnected()));
+        tcpSessions.append(session);
+    }
+}
+
+void LoopbackKeyServer::readyReadTcp()
+{
+    foreach (Session *session, tcpSessions) {
+        if ( session->tcp != sender() )
+            continue;
+        for (;;) {
+            int space;
+            char *p = session->parser.writePtr(&space);
+            qint64 n = session->tcp->read(p, space);
+            if ( n <= 0 )
+                break;
+            session->parser.commit(int(n));
+            session->parser.parse(session);
+            session->readLately = true;
+        }
+    }
+}
+
+void LoopbackKeyServer::tcpDisconnected()
+{
+    for (int i=0; i<tcpSessions.size(); i++) {
+        if ( tcpSessions[i]->tcp == sender() ) {
+            saveSession(tcpSessions[i]);
+            tcpSessions[i]->tcp->deleteLater();
+            delete tcpSessions.takeAt(i);
+            return;
+        }
+    }
+}
+
+void LoopbackKeyServer::readyReadUdp()
+{
+    // A single UDP client, replies go to whoever sent last
+    while ( udpSocket->hasPendingDatagrams() ) {
+        int space;
+        char *p = udpSession.parser.writePtr(&space);
+        qint64 n = udpSocket->readDatagram(p, space, &udpSession.peer, &udpSession.peerPort);
+        if ( n <= 0 )
+            continue;
+        udpSession.parser.commit(int(n));
+        udpSession.parser.flush(&udpSession);
+    }
+}
+
+void LoopbackKeyServer::Session::keyMessage(const KeyMessage &msg)
+{
+    server->handleMessage(this, msg);
+}
+
+// Sliding window of the last 64 sequence numbers seen
+bool LoopbackKeyServer::Session::isDuplicate(quint16 seq)
+{
+    if ( !seenAny ) {
+        seenAny = true;
+        highestSeq = seq;
+        seenMask = 1;
+        return false;
+    }
+    qint16 ahead = qint16(quint16(seq - highestSeq));
+    if ( ahead > 0 ) {
+        seenMask = (ahead >= 64) ? 1 : ((seenMask << ahead) | 1);
+        highestSeq = seq;
+        return false;
+    }
+    int back = -ahead;
+    if ( back >= 64 || (seenMask & (Q_UINT64_C(1) << back)) )
+        return true;
+    seenMask |= (Q_UINT64_C(1) << back);
+    return false;
+}
+
+void LoopbackKeyServer::saveSession(Session *session)
+{
+    if ( session->token == 0 )
+        return;
+    SessionState &state = sessionStates[session->token];
+    state.seenAny = session->seenAny;
+    state.highestSeq = session->highestSeq;
+    state.seenMask = session->seenMask;
+}
+
+void LoopbackKeyServer::handleMessage(Session *session, const KeyMessage &msg)
+{
+    qint64 nowUs = KeyClock::epochUs();
+    switch ( msg.type ) {
+    case KP_HELLO:
+        if ( msg.version >= KP_VERSION_BINARY ) {
+            quint32 version = qMin(msg.version, quint32(KP_VERSION));
+            session->acks = (version >= KP_VERSION_ACKS);
+            QByteArray Data("VV ");
+            Data.append(QByteArray::number(version));
+            reply(session, Data.constData(), Data.size());
+        }
+        break;
+    case KP_PING:
+        if ( msg.text ) {
+            QByteArray Data("PP ");
+            Data.append(QByteArray::number(msg.timeUs / 1000));
+            Data.append(" ");
+            Data.append(QByteArray::number((nowUs / 1000) % 4294967295));
+            reply(session, Data.constData(), Data.size());
+        } else {
+            KeyMessage pong = msg;
+            pong.type = KP_PONG;
+            pong.remoteUs = quint64(nowUs);
+            char frame[KP_MAX_FRAME];
+            reply(session, frame, KeyProtocol::encode(frame, pong));
+        }
+        break;
+    case KP_SESSION: {
+        // The UDP session is shared, keep what it saw under the old token
+        saveSession(session);
+        quint64 token = msg.timeUs;
+        if ( token != 0 && sessionStates.contains(token) ) {
+            const SessionState &state = sessionStates[token];
+            session->seenAny = state.seenAny;
+            session->highestSeq = state.highestSeq;
+            session->seenMask = state.seenMask;
+            resumes++;
+        } else {
+            token = ++nextToken;
+            session->seenAny = false;
+        }
+        session->token = token;
+        KeyMessage answer = msg;
+        answer.timeUs = token;
+        answer.remoteUs = 0;
+        char frame[KP_MAX_FRAME];
+        reply(session, frame, KeyProtocol::encode(frame, answer));
+        break;
+    }
+    case KP_KEY_DOWN:
+    case KP_KEY_UP:
+        // Events sent again after a reconnect come twice
+        if ( (session->tcp == nullptr || session->token != 0) && session->isDuplicate(msg.seq) ) {
+            duplicates++;
+            break;
+        }
+        {
+            KeyEventRecord e;
+            e.down = (msg.type == KP_KEY_DOWN);
+            e.timeUs = qint64(msg.timeUs);
+            e.keyTimeUs = qint64(msg.remoteUs);
+            // Text key times are in ms modulo 2^32-1
+            e.arrivalUs = msg.text ? ((nowUs / 1000) % 4294967295) * 1000 : nowUs;
+            e.playedUs = qMax(e.arrivalUs, e.keyTimeUs);
+            lateness.append(e.arrivalUs - e.keyTimeUs);
+            events.append(e);
+        }
+        if ( acksEnabled && session->acks && !msg.text ) {
+            KeyMessage ack;
+            ack.type = KP_ACKS;
+            ack.seq = msg.seq;
+            ack.text = false;
+            ack.timeUs = 0;
+            ack.remoteUs = quint64(nowUs);
+            ack.version = 0;
+            session->pendingAcks.append(ack);
+            if ( session->pendingAcks.size() >= KP_MAX_ACKS ) {
+                flushAcks(session);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void LoopbackKeyServer::reply(Session *session, const char *data, int len)
+{
+    if ( session->tcp != nullptr ) {
+        session->tcp->write(data, len);
+    } else {
+        udpSocket->writeDatagram(data, len, session->peer, session->peerPort);
+    }
+}
+
+void LoopbackKeyServer::flushAcks()
+{
+    foreach (Session *session, tcpSessions) {
+        // Text that stopped in a number and had nothing after it for a
+        // whole ack period is a complete message
+        if ( session->parser.pending() && !session->readLately ) {
+            session->parser.flush(session);
+        }
+        session->readLately = false;
+        flushAcks(session);
+    }
+    flushAcks(&udpSession);
+}
+
+void LoopbackKeyServer::flushAcks(Session *session)
+{
+    if ( session->pendingAcks.isEmpty() )
+        return;
+    char frame[KP_MAX_FRAME];
+    reply(session, frame, KeyProtocol::encodeAcks(frame, session->pendingAcks.constData(),
+                                                  session->pendingAcks.size(),
+                                                  quint64(KeyClock::epochUs())));
+    session->pendingAcks.clear();
+}
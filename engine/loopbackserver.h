@@ -0,0 +1,135 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef LOOPBACKSERVER_H
+#define LOOPBACKSERVER_H
+
+#include <QObject>
+#include <QVector>
+#include <QList>
+#include <QHash>
+#include <QHostAddress>
+#include "keyprotocol.h"
+
+class QTcpServer;
+class QTcpSocket;
+class QUdpSocket;
+class QTimer;
+
+// Acknowledgements of key events are collected this long
+#define LB_ACK_BATCH_MS 10
+
+// Local stand-in for the remote key server. Speaks the text and binary
+// key protocol over TCP and UDP, answers pings with its own clock and
+// records for every key event how it arrived compared to its key time.
+// Key events are played at their key time, or when they arrive if that
+// is later, like the real server does. Binary key events are
+// acknowledged with their receive time, in batches. A client that
+// reconnects with its session token resumes the session, key events it
+// sends again are dropped if they already arrived.
+// Used by the benchmarks, and with "--loopback-server [port]" to try the
+// client without a rig.
+class LoopbackKeyServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit LoopbackKeyServer(QObject *parent = nullptr);
+    ~LoopbackKeyServer();
+
+    bool listen(const QHostAddress &address = QHostAddress::LocalHost, quint16 port = 0);
+    quint16 serverPort() const;
+
+    // A received key event, all times in microseconds on the server
+    // clock. For the text protocol they are ms modulo 2^32-1 times 1000.
+    struct KeyEventRecord {
+        bool down;
+        qint64 timeUs;      // The client's time of the edge
+        qint64 keyTimeUs;
+        qint64 arrivalUs;
+        qint64 playedUs;
+    };
+
+    // Arrival time minus key time of every key event in microseconds,
+    // negative values arrived in time
+    const QVector<qint64> &latenessUs() const { return lateness; }
+    const QVector<KeyEventRecord> &keyEvents() const { return events; }
+    quint64 duplicateCount() const { return duplicates; }
+    quint64 resumeCount() const { return resumes; }
+    // Acknowledge key events to clients that support it, on by default
+    void setAcks(bool on) { acksEnabled = on; }
+    void resetStatistics();
+
+private slots:
+    void newTcpConnection();
+    void readyReadTcp();
+    void tcpDisconnected();
+    void readyReadUdp();
+    void flushAcks();
+
+private:
+    struct Session : public KeyMessageHandler
+    {
+        void keyMessage(const KeyMessage &msg) override;
+        bool isDuplicate(quint16 seq);
+
+        LoopbackKeyServer *server;
+        QTcpSocket *tcp;
+        QHostAddress peer;
+        quint16 peerPort;
+        KeyStreamParser parser;
+        bool seenAny;
+        quint16 highestSeq;
+        quint64 seenMask;
+        bool acks;
+        quint64 token;              // 0 until the client asks for a session
+        bool readLately;            // Data came in since the last ack period
+        QVector<KeyMessage> pendingAcks;
+    };
+
+    // What a session saw, kept for a client that reconnects
+    struct SessionState {
+        bool seenAny;
+        quint16 highestSeq;
+        quint64 seenMask;
+    };
+
+    void saveSession(Session *session);
+
+    void handleMessage(Session *session, const KeyMessage &msg);
+    void reply(Session *session, const char *data, int len);
+    void flushAcks(Session *session);
+
+    QTcpServer *tcpServer;
+    QUdpSocket *udpSocket;
+    QTimer *ackTimer;
+    bool acksEnabled = true;
+    QList<Session *> tcpSessions;
+    Session udpSession;
+    QVector<qint64> lateness;
+    QVector<KeyEventRecord> events;
+    quint64 duplicates = 0;
+    quint64 resumes = 0;
+    QHash<quint64, SessionState> sessionStates;
+    quint64 nextToken;
+};
+
+#endif // LOOPBACKSERVER_H
@@ -0,0 +1,96 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTcpServer>
+#include <QTcpSocket>
+#include "metricsserver.h"
+#include "keymetrics.h"
+#include "keypathtrace.h"
+
+MetricsServer::MetricsServer(KeyMetrics *metrics, QObject *parent) :
+    QObject(parent),
+    metrics(metrics)
+{
+    tcpServer = new QTcpServer(this);
+    connect(tcpServer,
+            SIGNAL(newConnection()),
+            this,
+            SLOT(newConnection()));
+}
+
+bool MetricsServer::listen(quint16 port, const QHostAddress &address)
+{
+    close();
+    return tcpServer->listen(address, port);
+}
+
+void MetricsServer::close()
+{
+    tcpServer->close();
+}
+
+quint16 MetricsServer::serverPort() const
+{
+    return tcpServer->serverPort();
+}
+
+void MetricsServer::newConnection()
+{
+    while ( tcpServer->hasPendingConnections() ) {
+        QTcpSocket *socket = tcpServer->nextPendingConnection();
+        connect(socket,
+                SIGNAL(readyRead()),
+                this,
+                SLOT(readyRead()));
+        connect(socket,
+                SIGNAL(disconnected()),
+                socket,
+                SLOT(deleteLater()));
+    }
+}
+
+// Answer once the request header is complete: /keypath.json is the key
+// path trace, anything else the metrics
+void MetricsServer::readyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket *>(sender());
+    if ( !socket )
+        return;
+    if ( !socket->peek(4096).contains("\r\n\r\n") && socket->bytesAvailable() < 4096 )
+        return;
+    QByteArray request = socket->readAll();
+    QByteArray body;
+    QByteArray reply("HTTP/1.0 200 OK\r\n");
+    if ( request.startsWith("GET /keypath.json ") ) {
+        body = KeyPathTrace::chromeTrace();
+        reply.append("Content-Type: application/json\r\n");
+    } else {
+        body = metrics->prometheus();
+        reply.append("Content-Type: text/plain; version=0.0.4\r\n");
+    }
+    reply.append("Connection: close\r\n"
+                 "Content-Length: ");
+    reply.append(QByteArray::number(body.size()));
+    reply.append("\r\n\r\n");
+    reply.append(body);
+    socket->write(reply);
+    socket->disconnectFromHost();
+}
@@ -0,0 +1,55 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QObject>
+#include <QHostAddress>
+
+class QTcpServer;
+class KeyMetrics;
+
+// Minimal HTTP endpoint that answers every request with the key metrics
+// in the Prometheus text format. Enabled with MetricsPort in
+// remotecwclient.ini, listens on localhost only. GET /keypath.json
+// gives the key path trace instead.
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    MetricsServer(KeyMetrics *metrics, QObject *parent = nullptr);
+
+    bool listen(quint16 port, const QHostAddress &address = QHostAddress::LocalHost);
+    void close();
+    quint16 serverPort() const;
+
+private slots:
+    void newConnection();
+    void readyRead();
+
+private:
+    KeyMetrics *metrics;
+    QTcpServer *tcpServer;
+};
+
+#endif // METRICSSERVER_H
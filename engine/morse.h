@@ -0,0 +1,68 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef MORSE_H
+#define MORSE_H
+
+#include <QtGlobal>
+
+// Morse code as bits behind a leading 1, first element highest, 1 for a
+// dah: ".-" is binary 101
+constexpr quint16 morseBits(const char *code, quint16 bits = 1)
+{
+    return *code ? morseBits(code + 1, quint16((bits << 1) | (*code == '-' ? 1 : 0))) : bits;
+}
+
+// ASCII 32 to 95, built at compile time. 0 where there is no code, '<'
+// and '>' enclose prosigns such as <SK>.
+static constexpr quint16 MorseTable[64] = {
+    0,                   morseBits("-.-.--"), morseBits(".-..-."), 0,                      //  !"#
+    morseBits("...-..-"), 0,                  morseBits(".-..."),  morseBits(".----."),    // $%&'
+    morseBits("-.--."),  morseBits("-.--.-"), 0,                   morseBits(".-.-."),     // ()*+
+    morseBits("--..--"), morseBits("-....-"), morseBits(".-.-.-"), morseBits("-..-."),     // ,-./
+    morseBits("-----"),  morseBits(".----"),  morseBits("..---"),  morseBits("...--"),     // 0123
+    morseBits("....-"),  morseBits("....."),  morseBits("-...."),  morseBits("--..."),     // 4567
+    morseBits("---.."),  morseBits("----."),  morseBits("---..."), morseBits("-.-.-."),    // 89:;
+    0,                   morseBits("-...-"),  0,                   morseBits("..--.."),    // <=>?
+    morseBits(".--.-."), morseBits(".-"),     morseBits("-..."),   morseBits("-.-."),      // @ABC
+    morseBits("-.."),    morseBits("."),      morseBits("..-."),   morseBits("--."),       // DEFG
+    morseBits("...."),   morseBits(".."),     morseBits(".---"),   morseBits("-.-"),       // HIJK
+    morseBits(".-.."),   morseBits("--"),     morseBits("-."),     morseBits("---"),       // LMNO
+    morseBits(".--."),   morseBits("--.-"),   morseBits(".-."),    morseBits("..."),       // PQRS
+    morseBits("-"),      morseBits("..-"),    morseBits("...-"),   morseBits(".--"),       // TUVW
+    morseBits("-..-"),   morseBits("-.--"),   morseBits("--.."),   0,                      // XYZ[
+    0,                   0,                   0,                   morseBits("..--.-")     // \]^_
+};
+
+static_assert(MorseTable['A' - 32] == 5, "A is .-");
+static_assert(MorseTable['0' - 32] == 0x3f, "0 is -----");
+
+// Code of a character, lower case letters as upper case, 0 if none
+inline quint16 morseCode(char c)
+{
+    if ( c >= 'a' && c <= 'z' )
+        c = char(c - 'a' + 'A');
+    if ( c < 32 || c > 95 )
+        return 0;
+    return MorseTable[c - 32];
+}
+
+#endif // MORSE_H
@@ -0,0 +1,48 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include "netimpairment.h"
+
+NetImpairment::NetImpairment() :
+    rnd(1)
+{
+}
+
+qint64 NetImpairment::arrivalUs(qint64 nowUs, bool stream)
+{
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    bool lost = (uniform(rnd) * 100.0) < lossPercent;
+    qint64 arrival = nowUs + delayUs + qint64(uniform(rnd) * double(jitterUs));
+    if ( (uniform(rnd) * 100.0) < reorderPercent ) {
+        arrival += reorderUs;
+    }
+    if ( !stream ) {
+        return lost ? -1 : arrival;
+    }
+    if ( lost ) {
+        arrival += retransmitUs;
+    }
+    // In order delivery, nothing passes a segment that is still missing
+    if ( arrival < lastStreamArrivalUs )
+        arrival = lastStreamArrivalUs;
+    lastStreamArrivalUs = arrival;
+    return arrival;
+}
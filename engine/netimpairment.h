@@ -0,0 +1,62 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef NETIMPAIRMENT_H
+#define NETIMPAIRMENT_H
+
+#include <QtGlobal>
+#include <random>
+
+// Simulated network conditions for outgoing key messages, used to test
+// and measure the transports without a bad 4G link at hand.
+// For a stream (TCP) a lost segment is not dropped but delivered after a
+// retransmit timeout, and holds up everything sent after it. Reordered
+// messages are held back by an extra delay so later ones pass them, on a
+// stream that holds up the ones behind them instead.
+class NetImpairment
+{
+public:
+    NetImpairment();
+
+    void setLossPercent(double percent) { lossPercent = percent; }
+    void setDelayMs(int ms) { delayUs = qint64(ms) * 1000; }
+    void setJitterMs(int ms) { jitterUs = qint64(ms) * 1000; }
+    void setRetransmitMs(int ms) { retransmitUs = qint64(ms) * 1000; }
+    void setReorderPercent(double percent) { reorderPercent = percent; }
+    void setReorderMs(int ms) { reorderUs = qint64(ms) * 1000; }
+    void setSeed(quint32 seed) { rnd.seed(seed); }
+    bool isActive() const { return lossPercent > 0.0 || delayUs > 0 || jitterUs > 0 || reorderPercent > 0.0; }
+
+    // Time a message sent at nowUs arrives, -1 if it is lost
+    qint64 arrivalUs(qint64 nowUs, bool stream);
+
+private:
+    double lossPercent = 0.0;
+    qint64 delayUs = 0;
+    qint64 jitterUs = 0;
+    qint64 retransmitUs = 200000;
+    double reorderPercent = 0.0;
+    qint64 reorderUs = 20000;
+    qint64 lastStreamArrivalUs = 0;
+    std::mt19937 rnd;
+};
+
+#endif // NETIMPAIRMENT_H
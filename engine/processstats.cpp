@@ -0,0 +1,115 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QTextStream>
+#include "processstats.h"
+#include "keyclock.h"
+#if defined(Q_OS_LINUX)
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#endif
+
+#if defined(Q_OS_LINUX)
+// A "Name:   1234 kB" line of /proc/self/status
+static qint64 statusKb(const char *name)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if ( f == nullptr )
+        return -1;
+    char line[256];
+    qint64 kb = -1;
+    size_t len = strlen(name);
+    while ( fgets(line, sizeof(line), f) != nullptr ) {
+        if ( !strncmp(line, name, len) && line[len] == ':' ) {
+            long long v;
+            if ( sscanf(line + len + 1, "%lld", &v) == 1 )
+                kb = v;
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+#endif
+
+qint64 ProcessStats::sinceStartUs()
+{
+#if defined(Q_OS_LINUX)
+    FILE *f = fopen("/proc/self/stat", "r");
+    if ( f == nullptr )
+        return -1;
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    // The command name may contain spaces, the fields follow the last ')'
+    char *p = strrchr(buf, ')');
+    if ( p == nullptr )
+        return -1;
+    // Field 22 is the start time in clock ticks after boot, p is at 2
+    unsigned long long start = 0;
+    int field = 2;
+    for (char *tok = strtok(p + 1, " "); tok != nullptr; tok = strtok(nullptr, " ")) {
+        if ( ++field == 22 ) {
+            start = strtoull(tok, nullptr, 10);
+            break;
+        }
+    }
+    if ( field != 22 )
+        return -1;
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    qint64 nowUs = qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    return nowUs - qint64(start) * 1000000 / sysconf(_SC_CLK_TCK);
+#else
+    return -1;
+#endif
+}
+
+qint64 ProcessStats::residentKb()
+{
+#if defined(Q_OS_LINUX)
+    return statusKb("VmRSS");
+#else
+    return -1;
+#endif
+}
+
+qint64 ProcessStats::peakResidentKb()
+{
+#if defined(Q_OS_LINUX)
+    return statusKb("VmHWM");
+#else
+    return -1;
+#endif
+}
+
+// KeyClock starts at its first call, main() calls it first thing
+void ProcessStats::printStartupReport(const char *name)
+{
+    QTextStream out(stdout);
+    out << name << ": startup " << sinceStartUs() / 1000.0 << " ms"
+        << "  (from main " << KeyClock::nowUs() / 1000.0 << " ms)"
+        << "  resident " << residentKb() << " kB"
+        << "  peak " << peakResidentKb() << " kB\n";
+}
@@ -0,0 +1,195 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+#include <QMutex>
+#include <QAtomicInt>
+#include <QStringList>
+#include "realtime.h"
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+#if defined(Q_OS_LINUX)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// What a thread got, see enterThread()
+enum RealTimeApplied {
+    RT_NONE,
+    RT_FIFO,
+    RT_RR,
+    RT_NICE,
+    RT_PRIORITY             // Windows thread priority
+};
+
+// Nice value of each role when real time scheduling is not allowed
+static const int roleNice[RT_ROLES] = { -15, -12, -10 };
+static const char *const roleName[RT_ROLES] = { "key", "send", "tone" };
+
+static QMutex configLock;
+static RealTimeConfig currentConfig = { false, false, RT_DEFAULT_PRIORITY, { -1, -1, -1 }, true };
+static QAtomicInt enabledFlag(0);
+static QAtomicInt lockedFlag(0);
+static QAtomicInt appliedPolicy[RT_ROLES];
+static QAtomicInt appliedValue[RT_ROLES];
+static QAtomicInt appliedCpu[RT_ROLES];
+
+static bool lockProcessMemory()
+{
+#if defined(Q_OS_WIN)
+    return false;
+#else
+    struct rlimit limit;
+    if ( getrlimit(RLIMIT_MEMLOCK, &limit) != 0 )
+        return false;
+    if ( limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < rlim_t(RT_MEMLOCK_MIN_KB) * 1024 )
+        return false;
+    // Future mappings too, thread stacks and buffers allocated later
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#endif
+}
+
+void RealTime::configure(const RealTimeConfig &config)
+{
+    QMutexLocker locker(&configLock);
+    currentConfig = config;
+    currentConfig.priority = qBound(3, config.priority, 99);
+    enabledFlag.storeRelease(config.enabled ? 1 : 0);
+    if ( config.enabled && config.lockMemory && lockedFlag.loadAcquire() == 0 ) {
+        lockedFlag.storeRelease(lockProcessMemory() ? 1 : 0);
+    }
+#if !defined(Q_OS_WIN)
+    if ( (!config.enabled || !config.lockMemory) && lockedFlag.loadAcquire() != 0 ) {
+        munlockall();
+        lockedFlag.storeRelease(0);
+    }
+#endif
+}
+
+RealTimeConfig RealTime::config()
+{
+    QMutexLocker locker(&configLock);
+    return currentConfig;
+}
+
+bool RealTime::isEnabled()
+{
+    return enabledFlag.loadAcquire() != 0;
+}
+
+void RealTime::enterThread(RealTimeRole role)
+{
+    if ( !isEnabled() )
+        return;
+    RealTimeConfig c = config();
+    int priority = c.priority - int(role);
+    int cpu = c.cpu[role];
+    int policy = RT_NONE;
+    int value = 0;
+#if defined(Q_OS_WIN)
+    // Without real time scheduling classes the thread priority is the
+    // most Windows offers a thread
+    Q_UNUSED(priority);
+    if ( SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) ) {
+        policy = RT_PRIORITY;
+        value = THREAD_PRIORITY_TIME_CRITICAL;
+    }
+    if ( cpu >= 0 && (cpu >= int(sizeof(DWORD_PTR) * 8)
+                      || !SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu)) ) {
+        cpu = -1;
+    }
+#else
+    struct sched_param param;
+    param.sched_priority = priority;
+    if ( pthread_setschedparam(pthread_self(), c.roundRobin ? SCHED_RR : SCHED_FIFO, &param) == 0 ) {
+        policy = c.roundRobin ? RT_RR : RT_FIFO;
+        value = priority;
+    } else {
+#if defined(Q_OS_LINUX)
+        // The nice value of a thread is set through its thread id.
+        // Without CAP_SYS_NICE or an RLIMIT_NICE this fails too.
+        id_t tid = id_t(syscall(SYS_gettid));
+        if ( setpriority(PRIO_PROCESS, tid, roleNice[role]) == 0 ) {
+            policy = RT_NICE;
+            value = roleNice[role];
+        }
+#endif
+    }
+#if defined(Q_OS_LINUX)
+    if ( cpu >= CPU_SETSIZE ) {
+        cpu = -1;
+    } else if ( cpu >= 0 ) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if ( pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 )
+            cpu = -1;
+    }
+#else
+    cpu = -1;
+#endif
+#endif
+    appliedPolicy[role].storeRelease(policy);
+    appliedValue[role].storeRelease(value);
+    appliedCpu[role].storeRelease(cpu);
+}
+
+QString RealTime::threadState(RealTimeRole role)
+{
+    if ( !isEnabled() )
+        return QString();
+    QString state;
+    int value = appliedValue[role].loadAcquire();
+    switch ( appliedPolicy[role].loadAcquire() ) {
+    case RT_FIFO: state = QString("fifo %1").arg(value); break;
+    case RT_RR: state = QString("rr %1").arg(value); break;
+    case RT_NICE: state = QString("nice %1").arg(value); break;
+    case RT_PRIORITY: state = QString("priority %1").arg(value); break;
+    default: return QString();
+    }
+    int cpu = appliedCpu[role].loadAcquire();
+    if ( cpu >= 0 ) {
+        state.append(QString(" cpu %1").arg(cpu));
+    }
+    return state;
+}
+
+bool RealTime::memoryLocked()
+{
+    return lockedFlag.loadAcquire() != 0;
+}
+
+QString RealTime::report()
+{
+    if ( !isEnabled() )
+        return "real time off";
+    QStringList parts;
+    for (int i=0; i<RT_ROLES; i++) {
+        QString state = threadState(RealTimeRole(i));
+        parts.append(QString("%1 %2").arg(roleName[i]).arg(state.isEmpty() ? "-" : state));
+    }
+    parts.append(memoryLocked() ? "memory locked" : "memory not locked");
+    return parts.join(", ");
+}
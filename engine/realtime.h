@@ -0,0 +1,74 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <QString>
+
+// SCHED_FIFO priority of the key input thread, the send workers get one
+// less and the side tone two less
+#define RT_DEFAULT_PRIORITY 70
+// Lock the memory only if the process may lock at least this much, a
+// small RLIMIT_MEMLOCK would make later allocations fail
+#define RT_MEMLOCK_MIN_KB (256 * 1024)
+
+// Threads on the key path, each asks for its own priority and CPU
+enum RealTimeRole {
+    RT_KEY,         // Key input thread
+    RT_SEND,        // Send workers
+    RT_AUDIO,       // Side tone
+    RT_ROLES
+};
+
+struct RealTimeConfig {
+    bool enabled;
+    bool roundRobin;        // SCHED_RR instead of SCHED_FIFO
+    int priority;
+    int cpu[RT_ROLES];      // -1 for any CPU
+    bool lockMemory;
+};
+
+// Opt-in real time mode for the threads on the key path. Each of them
+// calls enterThread() when it starts. With the mode on a thread asks for
+// SCHED_FIFO (or SCHED_RR) and falls back to a negative nice value when
+// the process may not use real time scheduling, and is pinned to its
+// CPU if one is set. The process memory is locked when the mode is
+// configured. With the mode off the threads are left to the default
+// scheduler, as before.
+class RealTime
+{
+public:
+    static void configure(const RealTimeConfig &config);
+    static RealTimeConfig config();
+    static bool isEnabled();
+
+    // Called on the thread itself
+    static void enterThread(RealTimeRole role);
+
+    // What the threads of a role got, e.g. "fifo 70 cpu 2" or "nice -15",
+    // empty when none has started in real time mode
+    static QString threadState(RealTimeRole role);
+    static bool memoryLocked();
+    // All roles and the memory lock on one line
+    static QString report();
+};
+
+#endif // REALTIME_H
@@ -0,0 +1,155 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+
+#include <cstring>
+#include "sockettimestamps.h"
+#include "keyclock.h"
+#if defined(Q_OS_LINUX)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <time.h>
+#include <errno.h>
+#endif
+
+#if defined(Q_OS_LINUX)
+// The kernel stamps on the wall clock, the stamp's age moves it to the
+// KeyClock time line
+static qint64 keyClockUs(const struct timespec &ts)
+{
+    qint64 now = KeyClock::nowUs();
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    qint64 ageUs = (qint64(real.tv_sec) - qint64(ts.tv_sec)) * 1000000
+            + (real.tv_nsec - ts.tv_nsec) / 1000;
+    if ( ageUs < 0 || ageUs > ST_MAX_AGE_US )
+        return -1;
+    return now - ageUs;
+}
+
+// The software stamp in a message's control data, -1 if there is none
+static qint64 softwareStamp(struct msghdr *msg)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c != nullptr; c = CMSG_NXTHDR(msg, c)) {
+        if ( c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING ) {
+            struct scm_timestamping ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            if ( ts.ts[0].tv_sec != 0 || ts.ts[0].tv_nsec != 0 )
+                return keyClockUs(ts.ts[0]);
+        }
+    }
+    return -1;
+}
+#endif
+
+bool SocketTimestamps::enable(qintptr fd)
+{
+#if defined(Q_OS_LINUX)
+    int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE
+            | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if ( setsockopt(int(fd), SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0 )
+        return true;
+    // Before Linux 4.0 the stamp comes with a copy of the packet
+    flags &= ~SOF_TIMESTAMPING_OPT_TSONLY;
+    return setsockopt(int(fd), SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+#else
+    Q_UNUSED(fd);
+    return false;
+#endif
+}
+
+qint64 SocketTimestamps::receive(qintptr fd, char *data, qint64 size, qint64 *rxUs)
+{
+    *rxUs = -1;
+#if defined(Q_OS_LINUX)
+    char control[256];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size_t(size);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    for (;;) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(int(fd), &msg, MSG_DONTWAIT);
+        if ( n > 0 ) {
+            *rxUs = softwareStamp(&msg);
+            return qint64(n);
+        }
+        if ( n == 0 )
+            return 0;
+        if ( errno == EINTR )
+            continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : -1;
+    }
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    return -1;
+#endif
+}
+
+bool SocketTimestamps::takeSendStamp(qintptr fd, quint32 *id, qint64 *txUs)
+{
+    *txUs = -1;
+#if defined(Q_OS_LINUX)
+    // Room for the looped back packet of older kernels, it is cut off
+    char data[64];
+    char control[512];
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ( recvmsg(int(fd), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 )
+        return false;
+    bool stamped = false;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+        if ( (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+             || (c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR) ) {
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(c), sizeof(err));
+            if ( err.ee_errno == ENOMSG && err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING
+                 && err.ee_info == SCM_TSTAMP_SND ) {
+                *id = err.ee_data;
+                stamped = true;
+            }
+        }
+    }
+    // Anything else on the queue is skipped
+    if ( stamped ) {
+        *txUs = softwareStamp(&msg);
+    }
+    return true;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(id);
+    return false;
+#endif
+}
@@ -0,0 +1,54 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+
+
+#ifndef SOCKETTIMESTAMPS_H
+#define SOCKETTIMESTAMPS_H
+
+#include <QtGlobal>
+
+// A kernel stamp more than this off the clock is not believed
+#define ST_MAX_AGE_US Q_INT64_C(10000000)
+
+// Kernel software timestamps of what a socket sends and receives
+// (SO_TIMESTAMPING), so a round trip is measured from when a probe left
+// the network stack to when the answer arrived in it, without the time
+// the client took to get it queued, written and read. Only Linux has
+// them, elsewhere enable() fails and the application's times are used.
+// All times are on the KeyClock time line.
+class SocketTimestamps
+{
+public:
+    // Stamp every write to and everything received by fd. The send
+    // stamps are numbered from this call on: by the offset of the last
+    // byte of the write on a stream, by the datagram otherwise. A TCP
+    // socket must be connected. False if the kernel can't.
+    static bool enable(qintptr fd);
+    // Read up to size bytes like recv(). *rxUs is when the kernel
+    // received the data, -1 if it wasn't stamped. Returns the bytes
+    // read, 0 at the end of a stream, -1 on an error and -2 when there
+    // is nothing to read.
+    static qint64 receive(qintptr fd, char *data, qint64 size, qint64 *rxUs);
+    // Take the next send stamp from the socket's error queue, false if
+    // there is none
+    static bool takeSendStamp(qintptr fd, quint32 *id, qint64 *txUs);
+};
+
+#endif // SOCKETTIMESTAMPS_H
@@ -0,0 +1,83 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include "textkeyer.h"
+#include "morse.h"
+
+qint64 TextKeyer::schedule(const QString &text, qint64 startUs, QVector<KeyerEdge> *edges) const
+{
+    int charWpm = qMax(speedWpm, charSpeedWpm);
+    qint64 unitUs = 1200000 / charWpm;
+    qint64 letterUs = 3 * unitUs;
+    qint64 wordUs = 7 * unitUs;
+    if ( charWpm > speedWpm ) {
+        // The time of the 19 space units in a word at the lower speed
+        qint64 spacesUs = qint64((60.0 * charWpm - 37.2 * speedWpm) / (charWpm * speedWpm) * 1000000.0);
+        letterUs = (3 * spacesUs) / 19;
+        wordUs = (7 * spacesUs) / 19;
+    }
+    qint64 t = startUs;
+    // Space before the next element, none at the start
+    qint64 gapUs = 0;
+    bool sent = false;
+    bool prosign = false;
+    foreach (QChar ch, text) {
+        char c = ch.toLatin1();
+        if ( c == '<' ) {
+            prosign = true;
+            continue;
+        }
+        if ( c == '>' ) {
+            prosign = false;
+            gapUs = letterUs;
+            continue;
+        }
+        if ( ch.isSpace() ) {
+            if ( sent )
+                gapUs = wordUs;
+            continue;
+        }
+        quint16 code = morseCode(c);
+        if ( code == 0 )
+            continue;
+        int elements = 0;
+        while ( (code >> (elements + 1)) != 0 ) {
+            elements++;
+        }
+        for (int i=elements-1; i>=0; i--) {
+            t += gapUs;
+            KeyerEdge down;
+            down.down = true;
+            down.atUs = t;
+            edges->append(down);
+            t += ((code >> i) & 1) ? 3 * unitUs : unitUs;
+            KeyerEdge up;
+            up.down = false;
+            up.atUs = t;
+            edges->append(up);
+            gapUs = unitUs;
+        }
+        sent = true;
+        if ( !prosign )
+            gapUs = letterUs;
+    }
+    return t + gapUs;
+}
@@ -0,0 +1,58 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef TEXTKEYER_H
+#define TEXTKEYER_H
+
+#include <QString>
+#include <QVector>
+
+// Keying of text, the schedule of every element is known in advance
+struct KeyerEdge {
+    bool down;
+    qint64 atUs;
+};
+
+// Element timing of text at a given speed, PARIS standard (50 units a
+// word). With a character speed above the speed the characters are sent
+// at the character speed and the letter and word spaces are stretched to
+// make up the speed (Farnsworth, the ARRL timing).
+class TextKeyer
+{
+public:
+    void setWpm(int wpm) { speedWpm = qMax(1, wpm); }
+    int wpm() const { return speedWpm; }
+    // 0 for the same as the speed
+    void setCharWpm(int wpm) { charSpeedWpm = qMax(0, wpm); }
+    int charWpm() const { return charSpeedWpm; }
+
+    // Appends the key edges of 'text' starting at 'startUs', always key
+    // down first and alternating. Characters without a code are skipped,
+    // "<SK>" is sent as one character. Returns where the next text
+    // starts, after the letter or word space.
+    qint64 schedule(const QString &text, qint64 startUs, QVector<KeyerEdge> *edges) const;
+
+private:
+    int speedWpm = 20;
+    int charSpeedWpm = 0;
+};
+
+#endif // TEXTKEYER_H
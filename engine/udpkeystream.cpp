@@ -0,0 +1,75 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include "udpkeystream.h"
+
+UdpKeyStream::UdpKeyStream()
+{
+}
+
+void UdpKeyStream::setRedundancy(int events)
+{
+    QMutexLocker locker(&lock);
+    redundancy = qBound(1, events, KP_MAX_EVENTS);
+    count = qMin(count, redundancy);
+}
+
+int UdpKeyStream::eventsPerDatagram()
+{
+    QMutexLocker locker(&lock);
+    return redundancy;
+}
+
+void UdpKeyStream::reset()
+{
+    QMutexLocker locker(&lock);
+    count = 0;
+    repeatAtUs = -1;
+}
+
+int UdpKeyStream::addEvent(const KeyMessage &msg, qint64 nowUs, char *out)
+{
+    QMutexLocker locker(&lock);
+    // Oldest first, drop the oldest when full
+    if ( count == redundancy ) {
+        for (int i=1; i<count; i++) {
+            history[i - 1] = history[i];
+        }
+        count--;
+    }
+    history[count++] = msg;
+    repeatAtUs = nowUs + UDP_REPEAT_MS * 1000;
+    return encode(out);
+}
+
+int UdpKeyStream::repeat(qint64 nowUs, char *out)
+{
+    QMutexLocker locker(&lock);
+    if ( repeatAtUs < 0 || nowUs < repeatAtUs || count == 0 )
+        return 0;
+    repeatAtUs = -1;
+    return encode(out);
+}
+
+int UdpKeyStream::encode(char *out)
+{
+    return KeyProtocol::encodeEvents(out, history, count);
+}
@@ -0,0 +1,61 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#ifndef UDPKEYSTREAM_H
+#define UDPKEYSTREAM_H
+
+#include <QMutex>
+#include "keyprotocol.h"
+
+// Resend the latest events once if no new key event follows within this
+// time, so a lost datagram at the end of a character is recovered too
+#define UDP_REPEAT_MS 10
+
+// Key events for the UDP transport. Every datagram carries the last
+// 'redundancy' key events with their sequence numbers, the server drops
+// the ones it already has. One lost datagram is then recovered from the
+// next one without waiting for a retransmit as TCP does.
+class UdpKeyStream
+{
+public:
+    UdpKeyStream();
+
+    void setRedundancy(int events);
+    int eventsPerDatagram();
+    void reset();
+
+    // Add a key event and encode the datagram to send into out (at least
+    // KP_MAX_FRAME bytes). Returns the datagram length.
+    int addEvent(const KeyMessage &msg, qint64 nowUs, char *out);
+    // Datagram repeating the latest events if one is due, otherwise 0
+    int repeat(qint64 nowUs, char *out);
+
+private:
+    int encode(char *out);
+
+    QMutex lock;
+    KeyMessage history[KP_MAX_EVENTS];
+    int count = 0;
+    int redundancy = 4;
+    qint64 repeatAtUs = -1;
+};
+
+#endif // UDPKEYSTREAM_H
@@ -0,0 +1,15 @@
+QT       = core
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+TARGET = CW_keyer_headless
+
+include(../engine/engine.pri)
+
+SOURCES += \
+    main.cpp
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
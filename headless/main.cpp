@@ -0,0 +1,301 @@
+// COPYRIGHT AND PERMISSION NOTICE
+
+// Copyright (c) 2020 - 2021, Bjorn Langels, <sm0sbl@langelspost.se>
+// All rights reserved.
+
+// Permission to use, copy, modify, and distribute this software for any purpose
+// with or without fee is hereby granted, provided that the above copyright
+// notice and this permission notice appear in all copies.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS. IN
+// NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+// DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE
+// OR OTHER DEALINGS IN THE SOFTWARE.
+
+// Except as contained in this notice, the name of a copyright holder shall not
+// be used in advertising or otherwise to promote the sale, use or other dealings
+// in this Software without prior written authorization of the copyright holder.
+
+#include <QCoreApplication>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <QTimer>
+#include "keyengine.h"
+#include "keyclock.h"
+#include "keypathtrace.h"
+#include "processstats.h"
+#include "loopbackserver.h"
+#include "realtime.h"
+#include <cstring>
+#include <cstdlib>
+
+// Seconds between status lines
+#define HEADLESS_STATUS_S 10
+
+// Runs the key engine with the settings of the GUI client and reports
+// on stdout instead of a window.
+class HeadlessClient : public KeyEngineHandler
+{
+public:
+    HeadlessClient() : out(stdout) {}
+
+    bool start(const QString &file)
+    {
+        QSettings settings(file, QSettings::IniFormat);
+        settings.beginGroup("MAIN");
+        engine.loadSettings(settings);
+        QString host = settings.value("keyIP", "").toString();
+        quint16 port = quint16(settings.value("keyNetPort", "").toUInt());
+        QString keyPort = settings.value("KeyPort", "").toString();
+        engine.setTransportUdp(!QString::compare(settings.value("KeyTransport", "").toString(), "UDP"));
+        QString keyInput = settings.value("KeyInput", "").toString();
+        if ( !QString::compare(keyInput, "HID") ) {
+            engine.setKeyLine(KeyInputThread::LineEvdev);
+        } else if ( !QString::compare(keyInput, "DSR") ) {
+            engine.setKeyLine(KeyInputThread::LineDSR);
+        } else {
+            engine.setKeyLine(KeyInputThread::LineCTS);
+        }
+        engine.setKeyInverted(!QString::compare(settings.value("KeyInvert", "").toString(), "Inverted"));
+        engine.setKeyDebounceUs(settings.value("KeyDebounce", 45).toInt() * 1000);
+        engine.setKeyThread(!QString::compare(settings.value("KeyThread", "").toString(), "true"));
+        autoKeyDelay = !QString::compare(settings.value("AutoKeyDelay", "").toString(), "true");
+        engine.setAutoKeyDelay(autoKeyDelay);
+        settings.endGroup();
+        if ( !traceFile.isEmpty() && !engine.startTrace(traceFile) ) {
+            out << "Can't write trace " << traceFile << "\n";
+            return false;
+        }
+
+        if ( host.isEmpty() || port == 0 ) {
+            out << "No key server (keyIP, keyNetPort) in " << file << "\n";
+            return false;
+        }
+        if ( !keyPort.isEmpty() && !engine.openKeyPort(keyPort) ) {
+            out << "Can't open key port " << keyPort << "\n";
+            return false;
+        }
+        out << "Connecting to " << host << ":" << port
+            << (engine.transportUdp() ? " (UDP)" : " (TCP)") << "\n";
+        out.flush();
+        engine.connectToServer(host, port);
+        return true;
+    }
+
+    void setMetricsFile(const QString &file) { metricsFile = file; }
+    void setKeyPathFile(const QString &file) { keyPathFile = file; }
+    void setTraceFile(const QString &file) { traceFile = file; }
+    void setSendText(const QString &text) { sendText = text; }
+
+    // Replay a trace instead of connecting, true if every key time came
+    // out as recorded
+    bool replay(const QString &file)
+    {
+        KeyTraceReplayResult r = engine.replayTrace(file);
+        if ( !r.ok ) {
+            out << "Can't read trace " << file << "\n";
+            return false;
+        }
+        out << "Replayed " << r.traceUs / 1000000.0 << " s in " << r.elapsedUs / 1000.0 << " ms: "
+            << r.edges << " key edges, " << r.pongs << " pongs, "
+            << r.sent << " key times, " << r.mismatches << " differ (max " << r.maxDiffUs << " us)\n"
+            << "Key delay " << engine.keyDelayMs() << " ms (recommended " << engine.recommendedKeyDelayMs() << ")"
+            << "  clock offset " << engine.clockOffsetUs() / 1000.0 << " ms"
+            << " skew " << engine.clockSkewPpm() << " ppm\n";
+        out.flush();
+        return r.mismatches == 0;
+    }
+
+    void printStatus()
+    {
+        KeySenderStats s = engine.sendStatistics();
+        KeyMetricSummary toWrite = engine.metrics().summary(KM_EDGE_TO_WRITE, KM_MINUTE_US);
+        out << "delay " << engine.keyDelayMs() << " ms (recommended " << engine.recommendedKeyDelayMs() << ")"
+            << "  one way " << engine.lastOneWayMs() << " ms (" << engine.minOneWayMs()
+            << " - " << engine.maxOneWayMs() << ")"
+            << "  clock offset " << engine.clockOffsetUs() / 1000.0 << " ms"
+            << " skew " << engine.clockSkewPpm() << " ppm"
+            << "  edge to write p99 " << toWrite.p99 / 1000.0 << " ms"
+            << "  sent " << s.sent << " dropped " << s.dropped;
+        if ( engine.serverAcks() ) {
+            KeyAckStats a = engine.ackStatistics();
+            out << "  acked " << a.acked << " late " << a.late
+                << " min slack " << a.minSlackUs / 1000.0 << " ms";
+        }
+        if ( engine.reconnectCount() > 0 ) {
+            out << "  reconnects " << engine.reconnectCount() << " resent " << engine.resentCount();
+        }
+        KeyMetricSummary writes = engine.metrics().summary(KM_WRITE_BYTES, KM_MINUTE_US);
+        out << "  packets " << writes.count / 60.0 << "/s "
+            << (s.keyEvents ? double(s.keyBytes) / s.keyEvents : 0.0) << " bytes per key event";
+        if ( engine.batchPercent() > 0 ) {
+            KeyMetricSummary hold = engine.metrics().summary(KM_BATCH_HOLD, KM_MINUTE_US);
+            out << " batch hold p99 " << hold.p99 / 1000.0 << " ms";
+        }
+        if ( engine.isStamped() ) {
+            KeyMetricSummary tx = engine.metrics().summary(KM_TX_STACK, KM_MINUTE_US);
+            KeyMetricSummary rx = engine.metrics().summary(KM_RX_STACK, KM_MINUTE_US);
+            out << "  kernel lag p99 send " << tx.p99 / 1000.0 << " receive " << rx.p99 / 1000.0 << " ms";
+        }
+        KeyMetricSummary keyWake = engine.metrics().summary(KM_WAKE_KEY, KM_MINUTE_US);
+        KeyMetricSummary sendWake = engine.metrics().summary(KM_WAKE_SEND, KM_MINUTE_US);
+        out << "  wake up p99 key " << keyWake.p99 / 1000.0 << " send " << sendWake.p99 / 1000.0 << " ms";
+        if ( RealTime::isEnabled() ) {
+            out << " (" << RealTime::report() << ")";
+        }
+        for (int i=0; i<engine.destinationCount(); i++) {
+            KeySession *session = engine.destination(i);
+            out << "  [" << session->host() << ":" << session->port() << " "
+                << (session->isConnected() ? "delay " : "down, delay ") << session->keyDelayMs()
+                << " ms one way " << session->lastOneWayMs() << " ms]";
+        }
+        out << "\n";
+        out.flush();
+        if ( !metricsFile.isEmpty() ) {
+            engine.metrics().writeFile(metricsFile, KM_MINUTE_US);
+        }
+        if ( !keyPathFile.isEmpty() ) {
+            KeyPathTrace::writeChromeTrace(keyPathFile);
+        }
+    }
+
+    // The engine reconnects on its own, keep running until stopped
+    void connectionChanged(KeyConnectionState state) override
+    {
+        switch ( state ) {
+        case KC_CONNECTED:
+            out << "Connected\n";
+            // Nobody to press "Set key delay", measure it right away. A
+            // reconnect keeps the measured delay.
+            if ( !autoKeyDelay && !measured )
+                engine.measureKeyDelay();
+            measured = true;
+            if ( !sendText.isEmpty() ) {
+                out << "Sending \"" << sendText << "\" at " << engine.keyerWpm() << " wpm\n";
+                engine.sendText(sendText);
+                sendText.clear();
+            }
+            break;
+        case KC_CONNECTING:
+            out << "Connecting\n";
+            break;
+        case KC_RECONNECTING:
+            out << "Connection lost, reconnecting\n";
+            break;
+        default:
+            out << "Disconnected\n";
+            break;
+        }
+        out.flush();
+    }
+
+    void destinationChanged(int index, KeyConnectionState state) override
+    {
+        KeySession *session = engine.destination(index);
+        out << "Destination " << session->host() << ":" << session->port()
+            << (state == KC_CONNECTED ? " connected" : state == KC_DISCONNECTED ? " disconnected" : " reconnecting")
+            << "\n";
+        out.flush();
+    }
+
+    void keyDelayChanged(int ms) override
+    {
+        out << "Key delay " << ms << " ms\n";
+        out.flush();
+    }
+
+    void keyPortChanged(bool open, const QString &name) override
+    {
+        out << "Key port " << name << (open ? " opened" : " unplugged, waiting for it") << "\n";
+        out.flush();
+    }
+
+private:
+    QTextStream out;
+    KeyEngine engine { this };
+    bool autoKeyDelay = false;
+    bool measured = false;
+    QString metricsFile;
+    QString keyPathFile;
+    QString traceFile;
+    QString sendText;
+};
+
+int main(int argc, char *argv[])
+{
+    // Start the clock for the startup report
+    KeyClock::nowUs();
+    QCoreApplication a(argc, argv);
+    QString file = QStandardPaths::writableLocation(QStandardPaths::ConfigLocation)
+            + "/remotecwclient.ini";
+
+    // "--config <file>" another settings file than the GUI client's
+    // "--metrics-file <file>" latency percentiles of the last minute,
+    // CSV or JSON by the extension, rewritten with every status line
+    // "--key-path-file <file>" the key path trace (Chrome trace JSON),
+    // rewritten with every status line
+    // "--trace <file>" record key edges and pings to a trace file
+    // "--replay <file>" replay a trace offline and compare the key times
+    // "--send <text>" key the text once connected, see KeyerWpm
+    // "--startup-report" print startup time and memory use and exit
+    // "--loopback-server [port]" runs a local stand-in key server
+    bool startupReport = false;
+    QString metricsFile;
+    QString keyPathFile;
+    QString traceFile;
+    QString replayFile;
+    QString sendText;
+    for (int i=1; i<argc; i++) {
+        if ( !strcmp(argv[i], "--config") && i + 1 < argc ) {
+            file = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--metrics-file") && i + 1 < argc ) {
+            metricsFile = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--key-path-file") && i + 1 < argc ) {
+            keyPathFile = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--trace") && i + 1 < argc ) {
+            traceFile = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--replay") && i + 1 < argc ) {
+            replayFile = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--send") && i + 1 < argc ) {
+            sendText = QString::fromLocal8Bit(argv[++i]);
+        } else if ( !strcmp(argv[i], "--startup-report") ) {
+            startupReport = true;
+        } else if ( !strcmp(argv[i], "--loopback-server") ) {
+            LoopbackKeyServer server;
+            quint16 port = (i + 1 < argc) ? quint16(atoi(argv[i+1])) : 5000;
+            if ( !server.listen(QHostAddress::Any, port) ) {
+                return 1;
+            }
+            return a.exec();
+        }
+    }
+
+    HeadlessClient client;
+    if ( startupReport ) {
+        // With the engine up and the event loop running, like the GUI
+        // client with its window shown
+        QTimer::singleShot(0, []() {
+            ProcessStats::printStartupReport("CW_keyer_headless");
+            QCoreApplication::quit();
+        });
+        return a.exec();
+    }
+    if ( !replayFile.isEmpty() ) {
+        return client.replay(replayFile) ? 0 : 2;
+    }
+    client.setMetricsFile(metricsFile);
+    client.setKeyPathFile(keyPathFile);
+    client.setTraceFile(traceFile);
+    client.setSendText(sendText);
+    if ( !client.start(file) ) {
+        return 1;
+    }
+    QTimer status;
+    QObject::connect(&status, &QTimer::timeout, [&client]() { client.printStatus(); });
+    status.start(HEADLESS_STATUS_S * 1000);
+    return a.exec();
+}